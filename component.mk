@@ -2,6 +2,6 @@
 
 COMPONENT_ADD_INCLUDEDIRS := ./include
 COMPONENT_SRCDIRS := ./src ./src/formats ./src/chips
-CPPFLAGS += -DVGM_DECODER_LOGGER=0
+CPPFLAGS += -DVGM_DECODER_LOGGER=0 -DVGM_LOOP_CACHE_MAX_SAMPLES=0
 
 # COMPONENT_DEPENDS := spibus
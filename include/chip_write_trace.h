@@ -0,0 +1,90 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "chips/chip_write_observer.h"
+
+typedef struct
+{
+    uint32_t sample; // sample position of the write
+    uint8_t chip;    // CHIP_WRITE_AY38910 or CHIP_WRITE_NES_APU
+    uint8_t reg;
+    uint8_t value;
+    uint8_t reserved;
+} ChipWriteRecord;
+
+typedef struct
+{
+    uint32_t ident; // "VGMT"
+    uint16_t version;
+    uint16_t recordSize;
+} ChipWriteTraceHeader;
+
+/**
+ * Records chip register writes to the preallocated ring buffer and optionally
+ * to binary trace file (ChipWriteTraceHeader followed by ChipWriteRecord items).
+ * When ring buffer is full, the oldest records are overwritten.
+ * The class is not thread safe.
+ */
+class ChipWriteTrace: public ChipWriteObserver
+{
+public:
+    /** Creates trace with ring buffer for capacity records */
+    explicit ChipWriteTrace(uint32_t capacity);
+    ~ChipWriteTrace();
+
+    /**
+     * Starts writing records to the binary file. File must be opened in binary mode.
+     * Returns false if trace header cannot be written.
+     */
+    bool setOutputFile(FILE *file);
+
+    void onWrite(uint8_t chip, uint8_t reg, uint8_t value) override;
+
+    /** Returns number of records available in ring buffer */
+    uint32_t getCount() const { return m_count; }
+
+    /** Returns number of records, lost due to ring buffer overflow */
+    uint32_t getDropped() const { return m_dropped; }
+
+    /**
+     * Moves up to maxCount oldest records from ring buffer to records.
+     * Returns number of records read.
+     */
+    uint32_t read(ChipWriteRecord *records, uint32_t maxCount);
+
+    /** Removes all records from ring buffer */
+    void clear();
+
+private:
+    ChipWriteRecord *m_records = nullptr;
+    uint32_t m_capacity = 0;
+    uint32_t m_head = 0;
+    uint32_t m_count = 0;
+    uint32_t m_dropped = 0;
+    FILE *m_file = nullptr;
+};
@@ -24,9 +24,39 @@ SOFTWARE.
 
 #pragma once
 
+#include "chip_write_observer.h"
+#include "chip_decimator.h"
+
 #include <stdint.h>
 #include <stdlib.h>
 
+/** Number of samples, which AY38910::getSamples() renders in one pass */
+#ifndef AY38910_BLOCK_SAMPLES
+#define AY38910_BLOCK_SAMPLES 64
+#endif
+
+/**
+ * Fractional bits of tone, noise and envelope counters. Counters are fixed-point phase
+ * accumulators, so chip clock to sample rate ratio is not truncated to integer.
+ */
+#define AY38910_PHASE_BITS 8
+
+/** Number of stems, rendered by AY38910::getStems(): channels A, B and C */
+#define AY38910_STEMS 3
+
+/**
+ * Chip families compiled into AY38910. Rendering code is specialized for each family
+ * (AY-3-8910/8912/8913 and YM2149/YM3439/YMZ), so builds for a single device type can
+ * set the other family to 0.
+ */
+#ifndef AY38910_AY_FAMILY
+#define AY38910_AY_FAMILY 1
+#endif
+
+#ifndef AY38910_YM_FAMILY
+#define AY38910_YM_FAMILY 1
+#endif
+
 enum
 {
     CHIP_TYPE_AY8910 = 0x00,
@@ -44,14 +74,30 @@ enum
     CHIP_TYPE_YM2610B = 0x23,
 };
 
+/** Channel bits for AY38910::setChannelMask() */
+enum
+{
+    AY38910_CHANNEL_A = 0x01,
+    AY38910_CHANNEL_B = 0x02,
+    AY38910_CHANNEL_C = 0x04,
+    AY38910_CHANNEL_NOISE = 0x08,
+    AY38910_CHANNEL_ALL = 0x0F,
+};
+
 class AY38910
 {
+    /** Batch renderer keeps state of the chip in its lane while chip is attached */
+    friend class AY38910Batch;
+
 public:
-    AY38910() = default;
+    AY38910();
 
     AY38910(uint8_t chipType, uint8_t flags);
 
-    /** Sets chip configuration */
+    /**
+     * Sets chip configuration. Chip type selects rendering code specialized for
+     * AY-3-8910 or YM2149 family, so there are no chip type checks per sample.
+     */
     void setType( uint8_t chipType, uint8_t flags );
 
     /** Resets ay-3-8910 state */
@@ -76,24 +122,65 @@ public:
     /** Returns left (16 bits) and right (16 bits) channels if next sound sample */
     uint32_t getSample();
 
+    /**
+     * Renders count samples to buffer, output is the same as of getSample() calls.
+     * Tone and noise counters are advanced in SIMD lanes (SSE2 or NEON), channels are
+     * mixed for 4 or 8 (AVX2) samples at once. Build with AY38910_NO_SIMD to use
+     * scalar code only.
+     */
+    void getSamples(uint32_t *buffer, uint32_t count);
+
+    /**
+     * Renders count samples to buffer like getSamples(), and in the same pass writes level
+     * of each channel to planar stem buffers: stems[n] receives count 16-bit levels of
+     * channel n (A, B, C). Noise is part of the channels, it is mixed to. Muted channels
+     * give silent stems, nullptr entries of stems are skipped.
+     */
+    void getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count);
+
     /** Set chip clock external frequency */
     void setFrequency( uint32_t frequency );
 
     /**
-     * Although AY-3-8910/YM2149 emulator allows to run at lower sample frequencies,
-     * it is recommended to leave 44100 Hz as base emulator frequency for good quality.
-     * Setting low sample frequencies like 11025 Hz greatly reduces quality of high
-     * frequency tones. It is recommended to do downsampling with the output of AY-3-8910
-     * emulator.
+     * Sets output sample frequency. Counters are fixed-point phase accumulators, so tone
+     * pitch is correct at any rate (22050, 32000, 48000 Hz), and chip can render directly
+     * at DAC rate. Still, low sample frequencies like 11025 Hz reduce quality of high
+     * frequency tones, since they are not band limited.
      */
     void setSampleFrequency( uint32_t sampleFrequency );
 
     /** Returns currently set sample frequency */
     uint32_t getSampleFrequency() const { return m_sampleFrequency; }
 
+    /**
+     * Sets synthesis quality (CHIP_QUALITY_FAST by default). Balanced and accurate
+     * qualities render at higher rate and decimate the output to sample frequency.
+     * Quality can be changed while playing, chip registers are kept.
+     */
+    void setQuality(uint8_t quality);
+
     /** Changes volume level. Default level is 100! */
     void setVolume(uint16_t volume);
 
+    /** Sets observer for register writes, nullptr disables notifications */
+    void setObserver(ChipWriteObserver *observer) { m_observer = observer; }
+
+    /**
+     * Sets channels to play (AY38910_CHANNEL_* bits), other channels are muted. Muted
+     * channels are not mixed, muted noise generator is advanced in bulk without producing
+     * the output sequence. Counters keep running, so unmuted channels stay in phase.
+     */
+    void setChannelMask(uint8_t mask) { m_channelMask = mask; }
+
+    /** Returns channels, which are not muted */
+    uint8_t getChannelMask() const { return m_channelMask; }
+
+    /**
+     * Returns hash of chip state (registers, counters, envelope and noise generator).
+     * Equal hashes mean that chip produces the same samples for the same register writes.
+     */
+    uint64_t getStateHash() const;
+
     /** TODO: */
     //void setStereoMode(uint8_t mode);
 
@@ -113,9 +200,20 @@ private:
     /** Audio hardware sample frequency */
     uint32_t m_sampleFrequency = 44100;
 
-    /** How many tone ticks in one audio sample */
+    /** Synthesis quality, CHIP_QUALITY_* */
+    uint8_t m_quality = CHIP_QUALITY_FAST;
+
+    /** Converts oversampled output to sample frequency */
+    ChipDecimator m_decimator;
+
+    /** Convert oversampled stems, they follow m_decimator phase while m_stemsSynced is set */
+    ChipDecimator m_stemDecimator[AY38910_STEMS];
+    bool m_stemsSynced = false;
+
+    /** How many tone ticks in one audio sample, fixed point with AY38910_PHASE_BITS fraction bits */
     uint32_t m_toneFrequencyScale = 0;
 
+    /** How many envelope ticks in one audio sample, fixed point as m_toneFrequencyScale */
     uint32_t m_envFrequencyScale = 0;
 
     /** period value for sound channels: A, B, C. */
@@ -135,22 +233,19 @@ private:
     /** Period value for envelope. */
     uint32_t m_periodE = 0;
 
-    /** Envelope register is used only for storing passed value */
+    /** Envelope shape register */
     uint8_t m_envelopeReg = 0;
 
+    /** Envelope reached the hold segment of the shape and is not updated any more */
     bool m_holding = true;
 
-    bool m_hold = false;
-
-    bool m_attack = false;
-
-    bool m_continue = false;
-
-    bool m_alternate = false;
-
     bool m_noiseRecalc = false;
 
-    uint8_t m_envStepMask = 0x0F;
+    /** Envelope step in the shape table (0-63), YM2149 steps by 1, AY-3-8910 steps by 2 */
+    uint8_t m_envStep = 0;
+
+    /** Chip is of YM2149 family: 32 volume levels and 32 envelope steps */
+    bool m_ymFamily = false;
 
     /** Indicates whether a particular channel is in envelope or period mode. */
     bool m_useEnvelope[3]{};
@@ -167,20 +262,49 @@ private:
     /** Turn noise on/off */
     bool m_noiseHigh = false;
 
-    /** Envelope frequency counter */
-    uint32_t m_counterEnv = 0;
+    /** Envelope frequency counter, 64 bits since period of 0xFFFF does not leave room for fraction bits */
+    uint64_t m_counterEnv = 0;
 
-    /** Envelope tick counter */
+    /** Envelope level of current step */
     uint8_t m_envVolume = 0;
 
-    /** volume level table for the chip */
-    uint16_t m_levelTable[32];
+    /** volume level table for the chip, extra entry allows 32-bit reads of the last level */
+    uint16_t m_levelTable[33]{};
 
     /** user volume level */
     uint16_t m_userVolume = 100;
 
+    /** Channels to play, AY38910_CHANNEL_* bits */
+    uint8_t m_channelMask = AY38910_CHANNEL_ALL;
+
+    /** register writes observer */
+    ChipWriteObserver *m_observer = nullptr;
+
+    /** Returns envelope level (0-31) of the shape (register 13) at step 0-63 */
+    static uint8_t envelopeLevel(uint8_t shape, uint8_t step);
+
     /** Recalculates volume tables */
     void calcVolumeTables();
+
+    /**
+     * Recalculates counter scales and decimator for clock, sample frequency and quality.
+     * Registers and counters are kept, so the rate can be changed while playing.
+     */
+    void calcRates();
+
+    /** Rendering functions of the chip family, selected by selectFamily() */
+    uint32_t (AY38910::*m_renderSample)() = nullptr;
+    void (AY38910::*m_renderBlock)(uint32_t *buffer, uint16_t *const *stems, uint32_t count) = nullptr;
+
+    /** Selects family specialized rendering functions for the chip type */
+    void selectFamily();
+
+    void updateNoise();
+    template <typename Family> void updateEnvelope();
+    template <typename Family> uint32_t renderSample();
+    template <typename Family> void renderBlock(uint32_t *buffer, uint16_t *const *stems, uint32_t count);
+    template <typename Family> void updateCounters(uint8_t *outputs, uint8_t *envelope, uint32_t count);
+    void mixSamples(const uint8_t *outputs, const uint8_t *envelope, uint32_t *buffer, uint16_t *const *stems, uint32_t count);
 };
 
 
@@ -0,0 +1,122 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "ay-3-8910.h"
+
+#include <stdint.h>
+
+/** Number of chips, rendered by AY38910Batch at once */
+#ifndef AY38910_BATCH_LANES
+#define AY38910_BATCH_LANES 8
+#endif
+
+/**
+ * Renders up to AY38910_BATCH_LANES independent AY38910 chips in one pass. State of the
+ * chips (tone, noise and envelope counters, periods, noise generator, mixer and level
+ * tables) is kept as structure of arrays, one chip per lane, and all lanes are advanced
+ * together: 8 lanes per instruction with AVX2, 4 lanes with SSE2 or NEON. Build with
+ * AY38910_NO_SIMD to use scalar code only.
+ *
+ * Chip objects stay the register front-end: lane state is saved to the chip by saveLane()
+ * before chip registers are written, and loaded back by loadLane() after the writes.
+ * Output of each lane is the same as output of AY38910::getSamples() of the chip.
+ */
+class AY38910Batch
+{
+public:
+    AY38910Batch();
+
+    /**
+     * Attaches chip to the lane and loads its state, nullptr detaches the chip. Lanes
+     * without the chip are silent. Only CHIP_QUALITY_FAST chips can be attached, returns
+     * false for other qualities.
+     */
+    bool setChip(int lane, AY38910 *chip);
+
+    /** Returns chip of the lane, or nullptr */
+    AY38910 *getChip(int lane) const { return m_chips[lane]; }
+
+    /** Saves lane state to the chip. Must be called before chip registers are written */
+    void saveLane(int lane);
+
+    /** Loads lane state from the chip. Must be called after chip registers are written */
+    void loadLane(int lane);
+
+    /**
+     * Renders count samples of all lanes: buffers[lane] receives count samples in the
+     * format of AY38910::getSamples(). Lanes with nullptr buffer are advanced without output.
+     */
+    void getSamples(uint32_t *const *buffers, uint32_t count);
+
+private:
+    AY38910 *m_chips[AY38910_BATCH_LANES]{};
+
+    /**
+     * Lane state, see AY38910 members of the same meaning. Periods are shifted by
+     * AY38910_PHASE_BITS, flags are stored as masks: 0 or 0xFFFFFFFF.
+     */
+    uint32_t m_counter[3][AY38910_BATCH_LANES]{};
+    uint32_t m_period[3][AY38910_BATCH_LANES]{};
+    uint32_t m_toneOutput[3][AY38910_BATCH_LANES]{};
+    uint32_t m_counterNoise[AY38910_BATCH_LANES]{};
+    uint32_t m_periodNoise[AY38910_BATCH_LANES]{};
+    uint32_t m_noiseRecalc[AY38910_BATCH_LANES]{};
+    uint32_t m_noiseHigh[AY38910_BATCH_LANES]{};
+    uint32_t m_rng[AY38910_BATCH_LANES]{};
+    uint32_t m_toneScale[AY38910_BATCH_LANES]{};
+    uint32_t m_envScale[AY38910_BATCH_LANES]{};
+
+    /** Envelope counter fits 32 bits, since envelope period is below 2^32 - 2^16 */
+    uint32_t m_counterEnv[AY38910_BATCH_LANES]{};
+    uint32_t m_periodE[AY38910_BATCH_LANES]{};
+    uint32_t m_holding[AY38910_BATCH_LANES]{};
+    uint32_t m_envStep[AY38910_BATCH_LANES]{};
+    uint32_t m_envVolume[AY38910_BATCH_LANES]{};
+    uint32_t m_envStepSize[AY38910_BATCH_LANES]{};
+    /** Mask of AY-3-8910 family lanes, which use half of 32 envelope levels */
+    uint32_t m_envHalfLevel[AY38910_BATCH_LANES]{};
+
+    /**
+     * Two segments of envelope shape. Level at segment step s (0-31) is
+     * ((s ^ segmentXor) & segmentAnd) | segmentOr, hold segments have constant level.
+     */
+    uint32_t m_segmentXor[2][AY38910_BATCH_LANES]{};
+    uint32_t m_segmentAnd[2][AY38910_BATCH_LANES]{};
+    uint32_t m_segmentOr[2][AY38910_BATCH_LANES]{};
+    uint32_t m_segmentHold[2][AY38910_BATCH_LANES]{};
+
+    /** Mixer: channel is enabled by tone and noise outputs, volume is amplitude or envelope */
+    uint32_t m_toneEnable[3][AY38910_BATCH_LANES]{};
+    uint32_t m_noiseEnable[3][AY38910_BATCH_LANES]{};
+    uint32_t m_useEnvelope[3][AY38910_BATCH_LANES]{};
+    uint32_t m_amplitude[3][AY38910_BATCH_LANES]{};
+
+    /** Level tables of all lanes, lane n starts at m_levelBase[n] */
+    uint32_t m_levelTable[AY38910_BATCH_LANES * 32]{};
+    uint32_t m_levelBase[AY38910_BATCH_LANES]{};
+
+    void renderLanes(int first, uint32_t *const *buffers, uint32_t count);
+};
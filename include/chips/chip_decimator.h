@@ -0,0 +1,133 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Synthesis quality of the chips. Cost is given in chip steps per second of audio
+ * at 44100 Hz output rate.
+ */
+enum
+{
+    /** One chip step per output sample: 44100 steps per second, no filtering */
+    CHIP_QUALITY_FAST = 0,
+
+    /**
+     * 4x oversampling with two halfband 2:1 decimation stages: 176400 steps per
+     * second, plus 2 multiplications per output sample.
+     */
+    CHIP_QUALITY_BALANCED = 1,
+
+    /**
+     * Chip runs at its own clock: AY-3-8910 steps at clock / 8 (223722 steps per
+     * second for 1.79 MHz chip), NES APU steps at cpu clock (1789773 steps per second).
+     * Output is filtered by Kaiser windowed-sinc lowpass, spanning 32 output samples:
+     * flat (0.1 dB) passband up to 0.40 of output rate, 70 dB attenuation from 0.54 of
+     * output rate, so louder aliases fall only above 0.46 of output rate (20.3 kHz at
+     * 44100 Hz). Each change of chip output is
+     * added as band-limited step (32 multiply-adds), so filter cost depends on how often
+     * the output changes, not on chip clock.
+     */
+    CHIP_QUALITY_ACCURATE = 2,
+};
+
+/** Number of halfband stages for CHIP_QUALITY_BALANCED */
+#define CHIP_DECIMATOR_HALFBAND_STAGES 2
+
+/** Length of CHIP_QUALITY_ACCURATE filter in output samples, output is delayed by half of it */
+#define CHIP_DECIMATOR_SINC_TAPS 32
+
+/** Step positions within output sample period, resolved by CHIP_QUALITY_ACCURATE filter */
+#define CHIP_DECIMATOR_SINC_PHASES 128
+
+/**
+ * Converts chip output, rendered at higher rate, to output sample rate. Chips output
+ * the same 16-bit level to both left and right channels, so only one channel is filtered.
+ */
+class ChipDecimator
+{
+public:
+    ChipDecimator() = default;
+
+    /** Disables decimation, input samples are passed as is */
+    void disable();
+
+    /** Decimates by 2^stages with halfband filters */
+    void setHalfband(uint8_t stages);
+
+    /**
+     * Decimates from inputRate to outputRate with windowed-sinc filter, input steps are
+     * placed at fractional output phase. If filter table can not be allocated, input is
+     * averaged over each output sample period instead.
+     */
+    void setRates(uint32_t inputRate, uint32_t outputRate);
+
+    /** Returns true if decimation is enabled */
+    bool isEnabled() const { return m_mode != 0; }
+
+    /** Clears filter history */
+    void reset();
+
+    /**
+     * Takes configuration and phase of source decimator with empty history, so both
+     * decimators give output samples for the same input samples.
+     */
+    void follow(const ChipDecimator &source);
+
+    /** Returns number of input samples, which give next count output samples */
+    uint32_t getInputCount(uint32_t count) const;
+
+    /** Decimates input samples, returns number of samples written to output */
+    uint32_t process(const uint32_t *input, uint32_t count, uint32_t *output);
+
+    /** Updates state hash with filter history */
+    uint64_t getStateHash(uint64_t hash) const;
+
+private:
+    uint8_t m_mode = 0;
+
+    /** Halfband decimation */
+    uint8_t m_stages = 0;
+    uint8_t m_phase = 0;
+    int32_t m_history[CHIP_DECIMATOR_HALFBAND_STAGES][7]{};
+
+    /** Sinc and box decimation: input sample is outputRate units, output sample is inputRate units */
+    uint32_t m_inputRate = 0;
+    uint32_t m_outputRate = 0;
+    uint32_t m_remain = 0;
+    uint64_t m_sum = 0;
+
+    /**
+     * Sinc decimation: last input level and deviation of next output samples from it,
+     * made by input steps within filter length (16 fraction bits).
+     */
+    int32_t m_level = 0;
+    int64_t m_deviation[CHIP_DECIMATOR_SINC_TAPS]{};
+
+    uint32_t putHalfband(int32_t sample, uint32_t *output);
+    uint32_t putBox(uint32_t sample, uint32_t *output);
+    uint32_t putSinc(int32_t sample, uint32_t *output);
+};
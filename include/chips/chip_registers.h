@@ -0,0 +1,78 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "chips/chip_write_observer.h"
+
+#include <stdint.h>
+
+/** Writing the value, which register already has, changes nothing */
+#define REG_NOOP      0x01
+/** Register state is fully replaced by the next write to the same register */
+#define REG_OVERWRITE 0x02
+/** Write uses values of other registers, so earlier writes to them are not dead */
+#define REG_BARRIER   0x04
+/** Unknown register, which can change the state of other registers */
+#define REG_UNKNOWN   0x08
+
+/**
+ * AY-3-8910 registers 0-12, 14, 15 only store values, envelope shape (13) restarts
+ * the envelope, so repeated writes of the same shape are not dropped.
+ */
+static inline uint8_t ay8910RegisterClass(uint8_t reg)
+{
+    if ( reg == 13 ) return REG_OVERWRITE;
+    if ( reg < 16 ) return REG_NOOP | REG_OVERWRITE;
+    return REG_UNKNOWN | REG_BARRIER;
+}
+
+/**
+ * NES APU: volume, sweep, linear counter and DMC address/length registers only store
+ * values. Timer registers clamp channel counters and length registers restart channels,
+ * so they are never dropped as unchanged. $4015 reads DMC address and length.
+ */
+static inline uint8_t nesApuRegisterClass(uint8_t reg)
+{
+    switch ( reg )
+    {
+        case 0x00: case 0x01: case 0x04: case 0x05: case 0x08: case 0x09:
+        case 0x0C: case 0x0D: case 0x12: case 0x13:
+            return REG_NOOP | REG_OVERWRITE;
+        case 0x03: case 0x07: case 0x0B: case 0x0F: case 0x11: case 0x17:
+            return REG_OVERWRITE;
+        case 0x02: case 0x06: case 0x0A: case 0x0E: case 0x10:
+            return 0;
+        case 0x15:
+            return REG_BARRIER;
+        default:
+            return REG_UNKNOWN | REG_BARRIER;
+    }
+}
+
+/** Returns REG_* flags of chip register */
+static inline uint8_t chipRegisterClass(uint8_t chip, uint8_t reg)
+{
+    return chip == CHIP_WRITE_AY38910 ? ay8910RegisterClass( reg ) : nesApuRegisterClass( reg );
+}
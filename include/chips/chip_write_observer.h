@@ -0,0 +1,65 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/** Chip identifiers, reported to observer. Values match VGM write commands */
+enum
+{
+    CHIP_WRITE_AY38910 = 0xA0,
+    CHIP_WRITE_NES_APU = 0xB4,
+};
+
+/**
+ * Receives register writes of emulated chips. When no observer is set, chips
+ * do not spend any time except for a single pointer check.
+ */
+class ChipWriteObserver
+{
+public:
+    ChipWriteObserver() = default;
+    virtual ~ChipWriteObserver() = default;
+
+    /**
+     * Called on each chip register write.
+     * @param chip CHIP_WRITE_AY38910 or CHIP_WRITE_NES_APU
+     * @param reg register index (NES APU registers are 0x00-0x1F for 0x4000-0x401F)
+     * @param value value written
+     */
+    virtual void onWrite(uint8_t chip, uint8_t reg, uint8_t value) = 0;
+
+    /**
+     * Sets sample position for next writes. VgmFile updates it before decoding
+     * each block, so all writes of the block get the sample where the block starts.
+     */
+    void setPosition(uint32_t samples) { m_position = samples; }
+
+    /** Returns sample position for current writes */
+    uint32_t getPosition() const { return m_position; }
+
+protected:
+    uint32_t m_position = 0;
+};
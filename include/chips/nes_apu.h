@@ -25,12 +25,17 @@ SOFTWARE.
 #pragma once
 
 #include "nes_cartridge.h"
+#include "chip_write_observer.h"
+#include "chip_decimator.h"
 
 #include <stdint.h>
 #include <string>
 
 #define APU_MAX_REG   (0x20)
 
+/** Number of stems, rendered by NesApu::getStems(): pulse 1, pulse 2, triangle, noise and DMC */
+#define NES_APU_STEMS 5
+
 typedef struct
 {
     uint16_t lenCounter;
@@ -57,8 +62,30 @@ typedef struct
     uint32_t dmcLen;
     uint8_t dmcBuffer;
     bool    dmcIrqFlag;
+
+    uint32_t pendingSamples; // samples, not yet applied to the timer of muted channel
 } ChannelInfo;
 
+typedef struct
+{
+    uint8_t regs[APU_MAX_REG];
+    ChannelInfo chan[5];
+    uint32_t lastFrameCounter;
+    uint8_t apuFrames;
+    uint16_t shiftNoise;
+} NesApuState;
+
+/** Channel bits for NesApu::setChannelMask() */
+enum
+{
+    NES_APU_CHANNEL_PULSE1 = 0x01,
+    NES_APU_CHANNEL_PULSE2 = 0x02,
+    NES_APU_CHANNEL_TRIANGLE = 0x04,
+    NES_APU_CHANNEL_NOISE = 0x08,
+    NES_APU_CHANNEL_DMC = 0x10,
+    NES_APU_CHANNEL_ALL = 0x1F,
+};
+
 class NesCpu;
 
 class NesApu
@@ -75,11 +102,34 @@ public:
     uint8_t read(uint16_t reg);
 
     /**
-     * Returns next sample at 44100 frequency rate. Each call to getSample()
-     * simulates ~ 40.5 nes cpu ticks (1789773 Hz / 44100 Hz).
+     * Returns next sample at sample frequency rate (44100 by default). Each call to
+     * getSample() simulates ~ 40.5 nes cpu ticks (1789773 Hz / 44100 Hz).
      */
     uint32_t getSample();
 
+    /**
+     * Renders count samples to buffer like getSample() calls, and in the same pass writes
+     * output of each channel to planar stem buffers: stems[n] receives count 16-bit levels
+     * of channel n (pulse 1, pulse 2, triangle, noise, DMC). Muted channels give silent
+     * stems, nullptr entries of stems are skipped.
+     */
+    void getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count);
+
+    /**
+     * Sets output sample frequency. Channel counters are fixed-point phase accumulators,
+     * so pitch is correct at any rate, and apu can render directly at DAC rate.
+     */
+    void setSampleFrequency(uint32_t sampleFrequency);
+
+    /** Returns currently set sample frequency */
+    uint32_t getSampleFrequency() const { return m_sampleFrequency; }
+
+    /**
+     * Sets synthesis quality (CHIP_QUALITY_FAST by default). Balanced and accurate
+     * qualities render at higher rate and decimate the output to sample frequency.
+     */
+    void setQuality(uint8_t quality);
+
     /** Sets volume, default volume is 100 */
     void setVolume(uint16_t volume);
 
@@ -89,6 +139,42 @@ public:
     /** Power nes apu */
     void power();
 
+    /** Saves apu registers and channels state. Volume settings are not saved */
+    void saveState(NesApuState &state) const;
+
+    /** Restores apu registers and channels state */
+    void loadState(const NesApuState &state);
+
+    /** Updates state hash with apu registers. Channel counters are not included */
+    uint64_t getRegistersHash(uint64_t hash) const;
+
+    /**
+     * Returns hash of complete apu state (registers, channel counters, frame counter).
+     * Equal hashes mean that apu produces the same samples for the same register writes.
+     */
+    uint64_t getStateHash() const;
+
+    /** Sets observer for register writes, nullptr disables notifications */
+    void setObserver(ChipWriteObserver *observer) { m_observer = observer; }
+
+    /**
+     * Sets channels to play (NES_APU_CHANNEL_* bits), other channels are muted and not mixed.
+     * Pulse, triangle and noise channels are updated only on frame counter clocks, while
+     * muted. Their timers are caught up in one step before the clock, register write or
+     * unmute, so unmuted channels stay in phase. DMC keeps running, since its output level
+     * depends on every sample bit.
+     */
+    void setChannelMask(uint8_t mask);
+
+    /** Returns channels, which are not muted */
+    uint8_t getChannelMask() const { return m_channelMask; }
+
+    /**
+     * Reports current values of all registers to the observer, useful when
+     * apu state is changed by loadState().
+     */
+    void notifyRegisters();
+
 private:
     NesCpu *m_cpu = nullptr;
 
@@ -98,6 +184,14 @@ private:
     uint32_t m_noiseVolTable[16]{};
     uint32_t m_dmcVolTable[16]{};
 
+    /** Nes cpu ticks per sample, fixed point with CONST_SHIFT_BITS fraction bits */
+    uint32_t m_counterScaler = 0;
+    uint32_t m_sampleFrequency = 0;
+    uint8_t m_quality = CHIP_QUALITY_FAST;
+    ChipDecimator m_decimator;
+    ChipDecimator m_stemDecimator[NES_APU_STEMS];
+    bool m_stemsSynced = false;
+
     uint32_t m_lastFrameCounter = 0;
     uint8_t m_apuFrames = 0;
     uint16_t m_shiftNoise;
@@ -105,12 +199,31 @@ private:
     bool m_halfSignal = false;
     bool m_fullSignal = false;
     uint16_t m_volume = 100;
+    uint8_t m_channelMask = NES_APU_CHANNEL_ALL;
     ChannelInfo m_chan[5]{};
+    ChipWriteObserver *m_observer = nullptr;
+
+    /**
+     * DMC sample bytes, which can be read directly from the cartridge data block. Span starts
+     * at DMC address, and is valid while cartridge and its bank mapping do not change.
+     */
+    const uint8_t *m_dmcSpan = nullptr;
+    uint32_t m_dmcSpanLength = 0;
+    NesCartridge *m_dmcCartridge = nullptr;
+    uint32_t m_dmcCartridgeVersion = 0;
+    uint32_t m_dmcMappingVersion = 0;
 
     // APU Processing
+    uint32_t renderSample();
+    uint32_t getStemLevel(int index) const;
+    bool skipMutedChannel(int index);
+    void syncChannel(int index);
+    void syncChannels();
     void updateRectChannel(int i);
     void updateTriangleChannel(ChannelInfo &info);
     void updateNoiseChannel(ChannelInfo &chan);
     void updateDmcChannel(ChannelInfo &info);
+    bool loadDmcByte(ChannelInfo &info);
+    uint8_t fetchDmcByte(uint16_t address);
     void updateFrameCounter();
 };
@@ -22,4 +22,33 @@ public:
     virtual void reset() = 0;
 
     virtual void power() = 0;
+
+    /** Returns physical address in cartridge memory for cpu address (after bank switching) */
+    virtual uint32_t mapAddress(uint16_t address) { return address; }
+
+    /**
+     * Returns pointer to cartridge data at cpu address and sets length to the number of bytes,
+     * which can be read from the pointer directly (till the end of the bank or data block).
+     * Returns nullptr if address is not mapped to the data, such bytes are accessed via read().
+     * The pointer is valid while getMappingVersion() returns the same value.
+     */
+    virtual const uint8_t *getDataSpan(uint16_t address, uint32_t &length) { return nullptr; }
+
+    /** Returns counter, which changes every time cpu address mapping changes (bank switching) */
+    uint32_t getMappingVersion() const { return m_mappingVersion; }
+
+    /** Returns size of the buffer required to save cartridge state */
+    virtual uint32_t getStateSize() { return 0; }
+
+    /** Saves cartridge state (mapper registers, RAM) to the buffer of getStateSize() bytes */
+    virtual void saveState(uint8_t *buffer) {}
+
+    /** Restores cartridge state, saved by saveState() */
+    virtual void loadState(const uint8_t *buffer) {}
+
+    /** Updates state hash with cartridge state (mapper registers, RAM) */
+    virtual uint64_t getStateHash(uint64_t hash) { return hash; }
+
+protected:
+    uint32_t m_mappingVersion = 0;
 };
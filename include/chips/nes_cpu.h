@@ -26,10 +26,19 @@ SOFTWARE.
 
 #include "nes_cartridge.h"
 #include "nes_apu.h"
+#include "nes_cpu_profiler.h"
 
 #include <stdint.h>
 #include <string>
 
+/**
+ * callSubroutine()/continueSubroutine() result: cpu spins in the loop, which
+ * can never exit, because cpu registers and memory do not change between iterations.
+ */
+#define NES_CPU_IDLE_LOOP (-2)
+
+#define NES_CPU_RAM_SIZE (2048)
+
 typedef struct
 {
     uint16_t pc;
@@ -57,12 +66,16 @@ public:
     /** Power nes apu */
     void power();
 
-    /** executes single instruction. returns false if cpu hardware error is detected */
+    /**
+     * executes single instruction. returns false if cpu hardware error is detected
+     * or if cpu is stuck in idle loop.
+     */
     bool executeInstruction();
 
     /**
      * Calls subroutine limiting the maximum number of instructions.
      * Returns negative number if cpu error detected
+     * Returns NES_CPU_IDLE_LOOP if subroutine spins in the loop, which never exits
      * Returns positive number if subroutine call is completed
      * Returns zero if limit of instructions is reached, but subroutine is not completed (use continueSubroutine).
      */
@@ -71,6 +84,7 @@ public:
     /**
      * Continues subroutine from the last place limiting the maximum number of instructions.
      * Returns negative number if cpu error detected
+     * Returns NES_CPU_IDLE_LOOP if subroutine spins in the loop, which never exits
      * Returns positive number if subroutine call is completed
      * Returns zero if limit of instructions is reached, but subroutine is not completed (use continueSubroutine).
      */
@@ -99,6 +113,9 @@ public:
      */
     NesCartridge *getCartridge();
 
+    /** Returns counter, which changes every time new cartridge is inserted */
+    uint32_t getCartridgeVersion() const { return m_cartridgeVersion; }
+
     /**
      * Returns pointer to Nes APU unit
      */
@@ -106,6 +123,30 @@ public:
 
     NesCpuState &cpuState();
 
+#if NES_CPU_PROFILER
+    /** Sets profiler for executed instructions, nullptr disables profiling (default) */
+    void setProfiler(NesCpuProfiler *profiler) { m_profiler = profiler; }
+#endif
+
+    /** Returns size of the buffer required to save cpu, RAM, apu and cartridge state */
+    uint32_t getStateSize();
+
+    /** Saves cpu, RAM, apu and cartridge state to the buffer of getStateSize() bytes */
+    void saveState(uint8_t *buffer);
+
+    /**
+     * Restores cpu, RAM, apu and cartridge state, saved by saveState().
+     * Inserted cartridge must be of the same type and contain the same data.
+     */
+    void loadState(const uint8_t *buffer);
+
+    /**
+     * Returns hash of cpu registers, RAM, apu registers and cartridge state.
+     * Program counter is not included, so the method is useful between subroutine calls,
+     * when the same hash means that the music repeats.
+     */
+    uint64_t getStateHash();
+
 private:
     struct Instruction
     {
@@ -120,6 +161,17 @@ private:
     // Nes cpu RAM
     uint8_t *m_ram = nullptr;
     NesCartridge *m_cartridge = nullptr;
+    uint32_t m_cartridgeVersion = 0;
+
+    /** Number of memory writes, used to detect idle loops */
+    uint32_t m_writeCount = 0;
+    /** Cpu state captured on the last backward jump */
+    NesCpuState m_loopState{};
+    uint32_t m_loopWriteCount = 0;
+    bool m_idleLoop = false;
+#if NES_CPU_PROFILER
+    NesCpuProfiler *m_profiler = nullptr;
+#endif
 
     static const NesCpu::Instruction commands[256];
 
@@ -145,6 +197,9 @@ private:
     void UND() { m_cpu.implied = true; };
     uint8_t fetch() { return read( m_cpu.pc++ ); }
     uint8_t readInternal(uint16_t address);
+    uint32_t mapAddress(uint16_t address);
+    void branch();
+    void checkIdleLoop(uint16_t target);
 
     // CPU Core
     // opcodes
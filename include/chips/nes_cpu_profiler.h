@@ -0,0 +1,110 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/*
+    NES_CPU_PROFILER accepts the following values
+    0 - profiler is not compiled in (default)
+    1 - NesCpu collects executed instructions and cycles
+*/
+#ifndef NES_CPU_PROFILER
+#define NES_CPU_PROFILER 0
+#endif
+
+#if NES_CPU_PROFILER
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Collects statistics of NesCpu interpreter: executed instructions per mapped
+ * PC (bank-switched address), per opcode, and cycles per callSubroutine().
+ * Cycles are base 6502 cycles without page crossing and branch penalties.
+ * Profiler is attached to NesCpu with NesCpu::setProfiler() (VgmFile::setProfiler()
+ * for the played track), cpu instances without profiler are not profiled. Profiler is
+ * not thread safe, it must not be shared by cpu instances, running on different threads.
+ */
+class NesCpuProfiler
+{
+public:
+    /** Clears collected statistics */
+    void clear();
+
+    /** Starts new subroutine call from emulator (init or play routine) */
+    void beginCall(uint32_t addr);
+
+    /** Completes subroutine call from emulator */
+    void endCall();
+
+    /** Accounts instruction, executed at mapped pc */
+    void instruction(uint32_t pc, uint8_t opcode);
+
+    /** Moves to the nested call stack frame on JSR */
+    void enterSubroutine(uint32_t addr);
+
+    /** Returns to the parent call stack frame on RTS */
+    void leaveSubroutine();
+
+    /** Prints subroutine calls, top hot PCs and opcode histogram */
+    void writeReport(FILE *file, int maxPcs = 40);
+
+    /** Writes call stacks in folded format (flamegraph.pl input), weighted by cycles */
+    void writeFoldedStacks(FILE *file);
+
+private:
+    struct CallNode
+    {
+        uint32_t addr;
+        int parent;
+        uint64_t cycles;
+    };
+
+    struct CallStats
+    {
+        uint64_t calls;
+        uint64_t cycles;
+        uint64_t maxCycles;
+        uint64_t instructions;
+    };
+
+    std::vector<CallNode> m_nodes;
+    std::map<uint64_t, int> m_children;
+    std::unordered_map<uint32_t, uint64_t> m_pcCounts;
+    std::map<uint32_t, CallStats> m_calls;
+    uint64_t m_opcodeCounts[256]{};
+    uint64_t m_totalInstructions = 0;
+
+    int m_node = -1;
+    uint32_t m_callAddr = 0;
+    uint64_t m_callCycles = 0;
+    uint64_t m_callInstructions = 0;
+
+    int getNode(int parent, uint32_t addr);
+};
+
+#endif
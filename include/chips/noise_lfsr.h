@@ -0,0 +1,68 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Fibonacci LFSR of noise generators: state bit 0 is the output, on each step state is
+ * shifted right and bit0 XOR bit[tap] is inserted at the top bit (width - 1).
+ * AY-3-8910 uses width 17 and tap 3, NES APU uses width 15 with tap 1 (long mode)
+ * or tap 6 (short mode).
+ *
+ * Next width bits of the output sequence are the state itself, and next width - tap
+ * bits after them depend only on the state, so they are produced with one XOR.
+ */
+
+/** Returns LFSR state after count steps */
+static inline uint32_t lfsrAdvance(uint32_t state, uint32_t width, uint32_t tap, uint32_t count)
+{
+    while ( count )
+    {
+        uint32_t bits = count < width - tap ? count : width - tap;
+        uint32_t feedback = (state ^ (state >> tap)) & ((1 << bits) - 1);
+        state = (state >> bits) | (feedback << (width - bits));
+        count -= bits;
+    }
+    return state;
+}
+
+/**
+ * Returns 64 bits of LFSR output sequence, starting from the current state: bit n is
+ * the output after n steps. State after n steps is (sequence >> n) & ((1 << width) - 1)
+ * for n <= 64 - width.
+ */
+static inline uint64_t lfsrSequence(uint32_t state, uint32_t width, uint32_t tap)
+{
+    uint64_t sequence = state;
+    for (uint32_t length = width; length < 64; )
+    {
+        uint32_t bits = 64 - length < width - tap ? 64 - length : width - tap;
+        uint64_t feedback = ((sequence >> (length - width)) ^ (sequence >> (length - width + tap))) & ((1ULL << bits) - 1);
+        sequence |= feedback << length;
+        length += bits;
+    }
+    return sequence;
+}
@@ -42,6 +42,18 @@ public:
 
     void power() override;
 
+    uint32_t mapAddress(uint16_t address) override { return mapper031( address ); }
+
+    const uint8_t *getDataSpan(uint16_t address, uint32_t &length) override;
+
+    uint32_t getStateSize() override;
+
+    void saveState(uint8_t *buffer) override;
+
+    void loadState(const uint8_t *buffer) override;
+
+    uint64_t getStateHash(uint64_t hash) override;
+
     /**
      * Registers new data memory blockю
      * @param data pointer to VGM data block (first 2 bytes is length).
@@ -0,0 +1,45 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/** Initial value for stateHash() */
+#define STATE_HASH_INIT (0xCBF29CE484222325ULL)
+
+/**
+ * Updates 64-bit FNV-1a hash with data block. Used to compare emulated
+ * chip states, for example to find the loop in the music.
+ */
+static inline uint64_t stateHash(const void *data, uint32_t size, uint64_t hash = STATE_HASH_INIT)
+{
+    const uint8_t *ptr = static_cast<const uint8_t *>(data);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        hash ^= ptr[i];
+        hash *= 0x00000100000001B3ULL;
+    }
+    return hash;
+}
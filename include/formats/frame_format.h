@@ -0,0 +1,100 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Compact register dump format (.vgr). File is the header, NES APU data blocks
+ * (each is 32-bit length and data with 2-byte address prefix) and the frame stream.
+ *
+ * Each frame of the stream is:
+ *  - 0x80 | (n - 1): n empty frames, n = 1..128;
+ *  - group mask byte (bit g means mask byte g is present), mask bytes, where
+ *    bit s of mask byte g means slot g * 8 + s is written, and slot values in
+ *    ascending slot order.
+ * Slots are applied in ascending order. For AY-3-8910 slot is register index,
+ * NES APU slots are mapped by frameNesApuRegisters table.
+ *
+ * If FRAME_FLAG_LZ is set, the stream is compressed: token t < 0x80 is followed by t + 1
+ * literal bytes, token t >= 0x80 is followed by the distance - 1 byte and copies
+ * (t & 0x7F) + 3 bytes from the last 256 decoded bytes. Matches never reach before
+ * the loop frame, so decoding can restart at loopOffset.
+ */
+typedef struct FrameHeader
+{
+    uint32_t ident;        // "VGFR"
+    uint8_t version;       // FRAME_FORMAT_VERSION
+    uint8_t chip;          // CHIP_WRITE_AY38910 or CHIP_WRITE_NES_APU
+    uint8_t flags;         // FRAME_FLAG_*
+    uint8_t dataBlocks;    // number of NES APU data blocks
+    uint32_t clock;        // chip clock in Hz
+    uint8_t ay8910Type;
+    uint8_t ay8910Flags;
+    uint16_t rate;         // frames per second
+    uint32_t frameCount;
+    uint32_t loopFrame;    // FRAME_NO_LOOP if track does not loop
+    uint32_t loopOffset;   // offset of the loop frame in the stream
+    uint32_t streamSize;
+} FrameHeader;
+
+/** Frame file identifier "VGFR" */
+#define FRAME_IDENT          0x52464756
+#define FRAME_FORMAT_VERSION 1
+
+/** Frame stream is LZ compressed */
+#define FRAME_FLAG_LZ        0x01
+
+#define FRAME_NO_LOOP        0xFFFFFFFF
+
+/** Empty frames run flag of the first frame byte */
+#define FRAME_EMPTY_RUN      0x80
+#define FRAME_MAX_EMPTY_RUN  128
+
+#define FRAME_AY8910_SLOTS   16
+#define FRAME_NES_APU_SLOTS  23
+#define FRAME_MAX_SLOTS      24
+
+#define FRAME_LZ_WINDOW      256
+#define FRAME_LZ_MIN_MATCH   3
+#define FRAME_LZ_MAX_MATCH   (0x7F + FRAME_LZ_MIN_MATCH)
+#define FRAME_LZ_MAX_LITERAL 0x80
+
+/**
+ * NES APU registers of frame slots. Frame counter goes first, DMC sample address and
+ * length are set before $4015 starts DMC. $4015 has two slots: the last value written
+ * before channel registers of the frame, which enables channels before their length
+ * counters are loaded, and the last value written after them.
+ */
+static const uint8_t frameNesApuRegisters[FRAME_NES_APU_SLOTS] =
+{
+    0x17, 0x10, 0x11, 0x12, 0x13, 0x15,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x15,
+};
+
+/** First NES APU slot of channel registers $4000-$400F */
+#define FRAME_NES_CHANNEL_FIRST_SLOT 6
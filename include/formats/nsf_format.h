@@ -47,3 +47,22 @@ typedef struct NsfHeader
     uint8_t dataLength[3];
 } NsfHeader;
 
+
+/** NSF file identifier "NESM" */
+#define NSF_IDENT        0x4D53454E
+/** NSFe file identifier "NSFE" */
+#define NSFE_IDENT       0x4546534E
+/** NSF2 flags (nsf2Reserved field): metadata chunks follow program data */
+#define NSF2_FLAG_METADATA 0x80
+
+/** NSFe chunk identifiers (chunk is 32-bit length, 4-byte id and data) */
+#define NSFE_CHUNK_INFO  0x4F464E49 // "INFO", required
+#define NSFE_CHUNK_DATA  0x41544144 // "DATA", required
+#define NSFE_CHUNK_BANK  0x4B4E4142 // "BANK"
+#define NSFE_CHUNK_RATE  0x45544152 // "RATE"
+#define NSFE_CHUNK_NEND  0x444E454E // "NEND"
+#define NSFE_CHUNK_TIME  0x656D6974 // "time", int32 track lengths in ms
+#define NSFE_CHUNK_FADE  0x65646166 // "fade", int32 fade lengths in ms
+#define NSFE_CHUNK_PLST  0x74736C70 // "plst", playlist of song indexes
+#define NSFE_CHUNK_TLBL  0x6C626C74 // "tlbl", zero terminated track labels
+#define NSFE_CHUNK_AUTH  0x68747561 // "auth", title, artist, copyright, ripper
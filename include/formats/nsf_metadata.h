@@ -0,0 +1,104 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "formats/nsf_format.h"
+
+#include <stdint.h>
+
+/** Fade length, used for NSFe tracks with time, but without fade */
+#ifndef NSFE_DEFAULT_FADE_MS
+#define NSFE_DEFAULT_FADE_MS 2000
+#endif
+
+/**
+ * Parses NSF header, NSFe chunks and NSF2 metadata trailer.
+ * For NSFe files classic NsfHeader is built from INFO, BANK, RATE and auth chunks,
+ * so the decoder works with both formats in the same way. No memory is allocated:
+ * chunk data is accessed directly in the source buffer, which must stay valid.
+ */
+class NsfMetadata
+{
+public:
+    /** Parses NSF or NSFe data, returns false if data is not valid */
+    bool parse(const uint8_t *data, int size);
+
+    /** Resets parsed data */
+    void clear();
+
+    /** Returns classic NSF header (built for NSFe files) */
+    const NsfHeader &getHeader() const { return m_header; }
+
+    /** Returns program data, loaded to loadAddress */
+    const uint8_t *getProgramData() const { return m_program; }
+
+    /** Returns program data size in bytes */
+    int getProgramSize() const { return m_programSize; }
+
+    /** Returns number of songs in the program */
+    int getSongCount() const { return m_header.songIndex ? m_header.songIndex : 1; }
+
+    /** Returns number of tracks: playlist length if there is playlist, or number of songs */
+    int getTrackCount() const { return m_playlistSize ? m_playlistSize : getSongCount(); }
+
+    /** Returns first track to play (0-based) */
+    int getStartTrack() const { return m_startTrack; }
+
+    /** Returns song index for the track (0-based), -1 if track is out of range */
+    int getSong(int track) const;
+
+    /**
+     * Returns track duration and fade length in milliseconds from time and fade chunks.
+     * If fade is not specified, NSFE_DEFAULT_FADE_MS is returned.
+     * Returns false if duration is unknown.
+     */
+    bool getTrackTime(int track, uint32_t &duration, uint32_t &fade) const;
+
+    /** Returns zero terminated track label or nullptr if there is no label */
+    const char *getTrackLabel(int track) const;
+
+    /** Returns zero terminated string from auth chunk (0 - title, 1 - artist, 2 - copyright, 3 - ripper) */
+    const char *getAuthString(int index) const;
+
+private:
+    NsfHeader m_header{};
+    const uint8_t *m_program = nullptr;
+    int m_programSize = 0;
+    int m_startTrack = 0;
+    const uint8_t *m_times = nullptr;
+    int m_timeCount = 0;
+    const uint8_t *m_fades = nullptr;
+    int m_fadeCount = 0;
+    const uint8_t *m_playlist = nullptr;
+    int m_playlistSize = 0;
+    const char *m_labels = nullptr;
+    int m_labelsSize = 0;
+    const char *m_auth = nullptr;
+    int m_authSize = 0;
+
+    bool parseNsfe(const uint8_t *data, int size);
+    bool parseChunks(const uint8_t *data, int size, bool nsf2);
+    const char *getString(const char *strings, int size, int index) const;
+};
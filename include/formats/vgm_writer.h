@@ -0,0 +1,89 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "formats/vgm_format.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Builds VGM 1.71 file from chip register writes and waits.
+ * Consecutive waits are merged and stored with the shortest wait commands.
+ */
+class VgmWriter
+{
+public:
+    VgmWriter();
+    ~VgmWriter();
+
+    /** Enables AY-3-8910 chip in the header */
+    void setAy8910(uint32_t clock, uint8_t type, uint8_t flags);
+
+    /** Enables NES APU chip in the header */
+    void setNesApu(uint32_t clock);
+
+    /**
+     * Adds register write command.
+     * @param command VGM write command (0xA0 for AY-3-8910, 0xB4 for NES APU)
+     * @param reg register index
+     * @param value value to write
+     */
+    void write(uint8_t command, uint8_t reg, uint8_t value);
+
+    /** Adds wait in samples (44100 Hz) */
+    void wait(uint32_t samples);
+
+    /** Adds 0x67 data block of specified type */
+    void dataBlock(uint8_t type, const uint8_t *data, uint32_t size);
+
+    /** Sets GD3 tag block ("Gd3 " header included), which is stored after the commands */
+    void setGd3(const uint8_t *data, uint32_t size);
+
+    /** Marks current position as loop start */
+    void setLoop();
+
+    /** Returns number of samples added so far */
+    uint32_t getTotalSamples() const { return m_totalSamples; }
+
+    /** Finalizes data with end of sound data command and writes VGM file */
+    bool save(FILE *file);
+
+    /** Clears all commands, chip settings are kept */
+    void clear();
+
+private:
+    VgmHeader m_header{};
+    std::vector<uint8_t> m_data;
+    std::vector<uint8_t> m_gd3;
+    uint32_t m_pendingWait = 0;
+    uint32_t m_totalSamples = 0;
+    bool m_loop = false;
+    uint32_t m_loopOffset = 0;
+    uint32_t m_loopSample = 0;
+
+    void flushWait();
+};
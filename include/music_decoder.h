@@ -24,8 +24,19 @@ SOFTWARE.
 
 #pragma once
 
+#include "chips/nes_cpu_profiler.h"
+
 #include <stdint.h>
 
+class ChipWriteObserver;
+
+/** Track length, found by BaseMusicDecoder::analyzeTrack() */
+typedef struct
+{
+    uint32_t introSamples; // samples before the loop start, or track length if there is no loop
+    uint32_t loopSamples;  // loop length in samples, 0 if track does not loop
+} MusicTrackInfo;
+
 class BaseMusicDecoder
 {
 public:
@@ -37,21 +48,80 @@ public:
 
     virtual uint32_t getSample() = 0;
 
+    /**
+     * Reads count samples to buffer. Must not read more samples, than returned by decodeBlock().
+     * Decoders, which chips render blocks of samples, override it.
+     */
+    virtual void getSamples(uint32_t *buffer, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++) buffer[i] = getSample();
+    }
+
+    /** Returns number of stems (chip channels), which getStems() renders, 0 if there are no stems */
+    virtual int getStemCount() { return 0; }
+
+    /**
+     * Reads count samples to buffer like getSamples(), and in the same pass writes output
+     * of each chip channel to planar stem buffers: stems[n] receives count 16-bit levels
+     * of channel n, nullptr entries are skipped. Must have getStemCount() entries.
+     */
+    virtual void getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+    {
+        getSamples( buffer, count );
+    }
+
     /**
      * Decodes data block and returns number of samples to read from decoder.
      * If it returns -1, then error occured, 0 means - nothing left.
+     * Number of samples is always given at 44100 Hz (VGM timing), see setSampleFrequency().
      */
     virtual int decodeBlock() = 0;
 
-    /** Sets sampling frequency. ,Must be called before decodePcm */
-//    void setSampleFrequency( uint32_t frequency ) virtual;
+    /**
+     * Sets output sample frequency of the chips (44100 by default). getSamples() and
+     * getStems() count samples at this frequency, while decodeBlock() keeps returning
+     * 44100 Hz samples, so the caller converts them.
+     */
+    virtual void setSampleFrequency(uint32_t frequency) {}
 
     /** Sets volume, default level is 100 */
     virtual void setVolume(uint16_t volume) {}
 
+    /** Sets synthesis quality of the chips (CHIP_QUALITY_*) */
+    virtual void setQuality(uint8_t quality) {}
+
+    /** Sets chip channels to play, bit n enables channel n of the chip */
+    virtual void setChannelMask(uint8_t mask) {}
+
     /** Returns number of tracks in opened file */
     virtual int getTrackCount() { return 1; }
 
     /** Sets track to play */
     virtual bool setTrack(int track) { return true; };
+
+    /**
+     * Prepares the track for fast setTrack() call, for example runs NSF init routine.
+     * Returns false if the format has nothing to prepare or preparation failed.
+     */
+    virtual bool prepareTrack(int track) { return false; }
+
+    /** Sets observer for chip register writes, nullptr disables notifications */
+    virtual void setObserver(ChipWriteObserver *observer) {}
+
+#if NES_CPU_PROFILER
+    /** Sets profiler for NES cpu, which plays the track. Formats without cpu code ignore it */
+    virtual void setProfiler(NesCpuProfiler *profiler) {}
+#endif
+
+    /**
+     * Finds intro and loop length of the track. Playback state is not changed.
+     * Returns false if the length cannot be detected.
+     */
+    virtual bool analyzeTrack(int track, MusicTrackInfo &info) { return false; }
+
+    /**
+     * Returns track duration and fade length in milliseconds, stored in the file.
+     * Returns false if the file has no track times.
+     */
+    virtual bool getTrackTime(int track, uint32_t &duration, uint32_t &fade) { return false; }
 };
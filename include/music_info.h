@@ -0,0 +1,174 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "formats/nsf_metadata.h"
+
+#include <stdint.h>
+
+/** Formats, detected by MusicInfo::probe() */
+enum
+{
+    MUSIC_FORMAT_UNKNOWN = 0,
+    MUSIC_FORMAT_VGM     = 1,
+    MUSIC_FORMAT_NSF     = 2,
+};
+
+/** Sound chips, used by the music file */
+enum
+{
+    MUSIC_CHIP_SN76489   = 0x0001,
+    MUSIC_CHIP_YM2413    = 0x0002,
+    MUSIC_CHIP_YM2612    = 0x0004,
+    MUSIC_CHIP_YM2151    = 0x0008,
+    MUSIC_CHIP_AY38910   = 0x0010,
+    MUSIC_CHIP_NES_APU   = 0x0020,
+    MUSIC_CHIP_GB_DMG    = 0x0040,
+    // NSF expansion sound chips
+    MUSIC_CHIP_VRC6      = 0x0100,
+    MUSIC_CHIP_VRC7      = 0x0200,
+    MUSIC_CHIP_FDS       = 0x0400,
+    MUSIC_CHIP_MMC5      = 0x0800,
+    MUSIC_CHIP_N163      = 0x1000,
+    MUSIC_CHIP_S5B       = 0x2000,
+    // Any other chip from VGM header
+    MUSIC_CHIP_OTHER     = 0x8000,
+};
+
+/** Tags, available via MusicInfo::getTag() */
+enum
+{
+    MUSIC_TAG_TITLE = 0,
+    MUSIC_TAG_GAME,
+    MUSIC_TAG_SYSTEM,
+    MUSIC_TAG_AUTHOR,
+    MUSIC_TAG_DATE,
+    MUSIC_TAG_RIPPER,
+    MUSIC_TAG_NOTES,
+    MUSIC_TAG_COPYRIGHT,
+    MUSIC_TAG_COUNT,
+};
+
+/** Tag text encodings */
+enum
+{
+    MUSIC_TAG_ASCII   = 0,
+    MUSIC_TAG_UTF16LE = 1,
+};
+
+/**
+ * View of the tag text inside the music file data. Text is not null terminated,
+ * use MusicInfo::copyTag() to get UTF-8 string.
+ */
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t length;  // length in bytes
+    uint8_t encoding; // MUSIC_TAG_ASCII or MUSIC_TAG_UTF16LE
+} MusicTag;
+
+/**
+ * Reads metadata of VGM and NSF files: chips, clocks, track count, durations
+ * and tags. Only headers and GD3 tags are parsed, no chip is created and no
+ * music data is decoded, so the probe is cheap enough to scan large libraries.
+ * Tags point to the probed data, so it must be accessible while tags are used.
+ */
+class MusicInfo
+{
+public:
+    MusicInfo() = default;
+    ~MusicInfo() = default;
+
+    /** Parses metadata of VGM or NSF data. Returns false if format is not recognized */
+    bool probe(const uint8_t *data, int size);
+
+    /** Returns MUSIC_FORMAT_VGM, MUSIC_FORMAT_NSF or MUSIC_FORMAT_UNKNOWN */
+    int getFormat() const { return m_format; }
+
+    /** Returns mask of MUSIC_CHIP_* flags */
+    uint32_t getChips() const { return m_chips; }
+
+    /** Returns AY-3-8910 clock in Hz or 0 if chip is not used */
+    uint32_t getAy8910Clock() const { return m_ay8910Clock; }
+
+    /** Returns AY-3-8910 chip type from VGM header */
+    uint8_t getAy8910Type() const { return m_ay8910Type; }
+
+    /** Returns NES APU clock in Hz or 0 if chip is not used */
+    uint32_t getNesApuClock() const { return m_nesApuClock; }
+
+    /** Returns number of tracks */
+    int getTrackCount() const { return m_trackCount; }
+
+    /** Returns first track to play (NSF start song) */
+    int getStartTrack() const { return m_startTrack; }
+
+    /**
+     * Returns number of samples (44100 Hz) to play track with loop played once.
+     * 0 is returned for NSF files, see getTrackSamples() for track times of NSFe and NSF2.
+     */
+    uint32_t getTotalSamples() const { return m_totalSamples; }
+
+    /** Returns number of samples in the loop, 0 if there is no loop */
+    uint32_t getLoopSamples() const { return m_loopSamples; }
+
+    /** Returns number of samples before the loop start */
+    uint32_t getIntroSamples() const { return m_totalSamples - m_loopSamples; }
+
+    /**
+     * Returns number of samples (44100 Hz) to play the track, including fade out, and
+     * fade length. NSFe and NSF2 files store time of each track, VGM tracks have
+     * getTotalSamples() length without fade. Returns false if duration is unknown.
+     */
+    bool getTrackSamples(int track, uint32_t &totalSamples, uint32_t &fadeSamples) const;
+
+    /** Returns tag view, tag is MUSIC_TAG_TITLE ... MUSIC_TAG_COPYRIGHT */
+    const MusicTag &getTag(int tag) const;
+
+    /**
+     * Converts tag to null terminated UTF-8 string.
+     * Returns length of the string, the text is truncated if the buffer is too small.
+     */
+    static int copyTag(const MusicTag &tag, char *buffer, int size);
+
+private:
+    int m_format = MUSIC_FORMAT_UNKNOWN;
+    uint32_t m_chips = 0;
+    uint32_t m_ay8910Clock = 0;
+    uint8_t m_ay8910Type = 0;
+    uint32_t m_nesApuClock = 0;
+    int m_trackCount = 0;
+    int m_startTrack = 0;
+    uint32_t m_totalSamples = 0;
+    uint32_t m_loopSamples = 0;
+    MusicTag m_tags[MUSIC_TAG_COUNT]{};
+    /** Track times of NSFe and NSF2 files */
+    NsfMetadata m_nsf;
+
+    void clear();
+    bool probeVgm(const uint8_t *data, int size);
+    bool probeNsf(const uint8_t *data, int size);
+    void parseGd3(const uint8_t *data, int size, uint32_t offset);
+};
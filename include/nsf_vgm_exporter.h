@@ -0,0 +1,101 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "chips/chip_write_observer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+class NsfMusicDecoder;
+
+/**
+ * Converts NSF track to VGM file ahead of time, so the device can play it
+ * without 6502 emulation. NSF play routine is executed without sound synthesis,
+ * apu writes are recorded with sample positions. Loop point is found, when
+ * the state of emulated NES (cpu registers, RAM, apu registers, cartridge banks)
+ * after play routine repeats one of previous states. DMC sample data, used by the
+ * track, is stored to VGM data block.
+ */
+class NsfVgmExporter: private ChipWriteObserver
+{
+public:
+    NsfVgmExporter();
+    ~NsfVgmExporter();
+
+    /** Opens NSF data. Data must be accessible until exporter is closed */
+    bool open(const uint8_t *data, int size);
+
+    /** Closes NSF data */
+    void close();
+
+    /** Returns number of tracks in opened file */
+    int getTrackCount();
+
+    /** Sets maximum duration of converted track, if loop is not detected. Default is 3 minutes */
+    void setMaxDuration(uint32_t milliseconds);
+
+    /** Runs NSF track and records apu writes */
+    bool convert(int track);
+
+    /** Returns length of converted track in samples */
+    uint32_t getTotalSamples() const { return m_totalSamples; }
+
+    /** Returns length of loop in samples or 0 if loop is not detected */
+    uint32_t getLoopSamples() const { return m_loop ? m_totalSamples - m_loopSample : 0; }
+
+    /** Writes converted track as VGM file */
+    bool save(FILE *file);
+
+private:
+    struct Event
+    {
+        uint32_t sample;
+        uint8_t reg;
+        uint8_t value;
+    };
+
+    NsfMusicDecoder *m_decoder = nullptr;
+    uint32_t m_maxSamples;
+    std::vector<Event> m_events;
+    uint8_t m_regs[0x20]{};
+
+    /** Copy of DMC sample memory $C000-$FFFF */
+    uint8_t *m_dmcMemory = nullptr;
+    std::vector<bool> m_dmcUsed;
+    uint32_t m_dmcStart = 0;
+    uint32_t m_dmcEnd = 0;
+    bool m_dmcConflict = false;
+
+    bool m_loop = false;
+    uint32_t m_loopEvent = 0;
+    uint32_t m_loopSample = 0;
+    uint32_t m_totalSamples = 0;
+
+    void onWrite(uint8_t chip, uint8_t reg, uint8_t value) override;
+    void captureDmcSample();
+    void clear();
+};
@@ -0,0 +1,91 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "chips/ay-3-8910_batch.h"
+
+class VgmMusicDecoder;
+
+/** Number of VGM streams, decoded by VgmBatchDecoder at once */
+#define VGM_BATCH_DECODER_LANES AY38910_BATCH_LANES
+
+/**
+ * Decodes up to VGM_BATCH_DECODER_LANES independent VGM files with AY-3-8910 chip at
+ * once. Each lane has its own VgmMusicDecoder, which supplies register writes, and chips
+ * of all lanes are rendered together by AY38910Batch. Output is 44100 Hz, in the format
+ * of BaseMusicDecoder::getSamples(), and is the same as decoder output at CHIP_QUALITY_FAST.
+ */
+class VgmBatchDecoder
+{
+public:
+    VgmBatchDecoder();
+    ~VgmBatchDecoder();
+
+    /**
+     * Opens VGM data in the lane, closing the file, which was played there. Returns
+     * false if data is not a VGM file or the file has no AY-3-8910 chip.
+     */
+    bool open(int lane, const uint8_t *data, int size);
+
+    /** Closes the file of the lane, lane becomes silent */
+    void close(int lane);
+
+    /** Returns true if the lane has file, which is not finished yet */
+    bool isPlaying(int lane) const { return m_decoders[lane] != nullptr; }
+
+    /** Sets volume of lanes, opened after the call. Default level is 100 */
+    void setVolume(uint16_t volume) { m_volume = volume; }
+
+    /**
+     * Sets maximum decoding duration of each lane in milliseconds, 0 means no limit.
+     * Default duration is 3 minutes, as for VgmFile.
+     */
+    void setMaxDuration(uint32_t milliseconds);
+
+    /** Returns number of samples, decoded in the lane */
+    uint32_t getDecodedSamples(int lane) const { return m_samplesPlayed[lane]; }
+
+    /**
+     * Decodes next count samples of all lanes: buffers[lane] receives count samples,
+     * nullptr buffers are skipped. Finished and not opened lanes are filled with silence.
+     * Returns number of lanes, which are still playing.
+     */
+    int decode(uint32_t *const *buffers, uint32_t count);
+
+private:
+    VgmMusicDecoder *m_decoders[VGM_BATCH_DECODER_LANES]{};
+    AY38910Batch m_batch;
+
+    /** Samples left until the next block of register writes */
+    uint32_t m_waitSamples[VGM_BATCH_DECODER_LANES]{};
+    uint32_t m_samplesPlayed[VGM_BATCH_DECODER_LANES]{};
+
+    /** Duration in samples, 0 if not limited */
+    uint32_t m_duration = 0;
+    uint16_t m_volume = 100;
+
+    bool decodeBlock(int lane);
+};
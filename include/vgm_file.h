@@ -26,6 +26,16 @@ SOFTWARE.
 
 #include <stdint.h>
 #include "music_decoder.h"
+#include "chips/chip_write_observer.h"
+#include "chips/chip_decimator.h"
+
+/** Number of samples, read from decoder at once */
+#ifndef VGM_FILE_BLOCK_SAMPLES
+#define VGM_FILE_BLOCK_SAMPLES 64
+#endif
+
+/** Maximum number of stems (chip channels), decodeStems() can write */
+#define VGM_FILE_MAX_STEMS 5
 
 class VgmFile
 {
@@ -33,7 +43,7 @@ public:
     VgmFile();
     ~VgmFile();
 
-    /** Allows to open NSF and VGM data blocks */
+    /** Allows to open NSF, VGM and frame (.vgr) data blocks */
     bool open(const uint8_t *data, int size);
 
     /** Closes either VGM or NSF data */
@@ -46,24 +56,87 @@ public:
      */
     int decodePcm(uint8_t *outBuffer, int maxSize);
 
-    /** Sets sampling frequency. ,Must be called before decodePcm */
+    /**
+     * Returns number of stems (chip channels) of opened file: 3 for AY-3-8910 (A, B, C),
+     * 5 for NES APU (pulse 1, pulse 2, triangle, noise, DMC).
+     */
+    int getStemCount();
+
+    /**
+     * Decodes next block like decodePcm(), and in the same pass writes each chip channel
+     * to its own buffer: stems[n] receives 16-bit unsigned mono samples of channel n,
+     * one for each stereo sample in outBuffer (returned size / 4). stems must have
+     * getStemCount() entries, nullptr entries are skipped. Can follow decodePcm() calls:
+     * if looped VGM track is replayed from the cache, chips render the loop again up to
+     * the current position on the first decodeStems() call. Stems of samples, already
+     * read from decoder by decodePcm() (up to VGM_FILE_BLOCK_SAMPLES), are silent.
+     */
+    int decodeStems(uint8_t *outBuffer, uint16_t *const *stems, int maxSize);
+
+    /**
+     * Sets output sample frequency (44100 by default), for example 22050, 32000 or 48000 Hz.
+     * Chips render directly at this frequency, and VGM waits (44100 Hz) are converted to
+     * output samples with the fraction carried to the next wait, so timing does not drift.
+     * Durations and positions (setMaxDuration(), getDecodedSamples()) stay in 44100 Hz samples.
+     */
     void setSampleFrequency( uint32_t frequency );
 
     /** Sets volume, default level is 100 */
     void setVolume(uint16_t volume);
 
+    /**
+     * Sets synthesis quality: CHIP_QUALITY_FAST (default), CHIP_QUALITY_BALANCED or
+     * CHIP_QUALITY_ACCURATE. See include/chips/chip_decimator.h for the cost of each tier.
+     */
+    void setQuality(uint8_t quality);
+
+    /**
+     * Sets chip channels to play, other channels are muted and not synthesized. Bit n
+     * enables channel n of the chip: AY38910_CHANNEL_* (A, B, C, noise) or
+     * NES_APU_CHANNEL_* (pulse 1, pulse 2, triangle, noise, DMC). Use single bit to solo
+     * the channel, 0xFF to play all channels. Can be changed during playback, new mask
+     * applies after samples, already read from decoder (up to VGM_FILE_BLOCK_SAMPLES).
+     */
+    void setChannelMask(uint8_t mask);
+
     /** Returns number of tracks in opened file */
     int getTrackCount();
 
-    /** Sets track to play */
+    /**
+     * Sets track to play from the beginning. If the file stores track duration (NSFe,
+     * NSF2 time and fade chunks), the track is limited to it and faded out for the stored
+     * fade length. Otherwise duration and fading, set by setMaxDuration() (setMaxSamples())
+     * and setFading(), are used.
+     */
     bool setTrack(int track);
 
+    /**
+     * Prepares the track, so that later setTrack() call switches to it instantly (runs
+     * NSF init routine in advance). Can be called from background thread, while the
+     * file is played and tracks are switched, but not concurrently with open() or close().
+     * Returns false if the file format has nothing to prepare.
+     */
+    bool prepareTrack(int track);
+
+    /** Returns track duration and fade length in milliseconds, if they are stored in the file */
+    bool getTrackTime(int track, uint32_t &duration, uint32_t &fade);
+
     /**
      * Sets maximum decoding duration in milliseconds.
      * Useful for looped music
      */
     void setMaxDuration( uint32_t milliseconds );
 
+    /** Sets maximum decoding duration in samples (44100 Hz), 0 means no limit */
+    void setMaxSamples( uint32_t samples );
+
+    /**
+     * Finds intro and loop length of the track. For VGM files values are taken from
+     * the header, NSF tracks are emulated on separate cpu instance.
+     * Returns false if the length is unknown.
+     */
+    bool analyzeTrack(int track, MusicTrackInfo &info);
+
     /**
      * Returns number of total samples in track.
      * Be careful, some formats do not allow to calculate samples before
@@ -74,37 +147,78 @@ public:
     uint32_t getTotalSamples() { return m_duration; }
 
     /**
-     * Returns number of samples, already decoded.
+     * Returns number of samples (44100 Hz), already decoded.
      */
     uint32_t getDecodedSamples() { return m_samplesPlayed; }
 
     /**
      * Enables fade effect
      *
-     * @param enable true to enable fade effect at the end
+     * @param enable true to enable fade effect at the end (last 2 seconds)
      */
     void setFading(bool enable);
 
+    /**
+     * Returns true if fade effect is applied to the current track: set by setFading(),
+     * or by the fade length, stored in the file (see setTrack()).
+     */
+    bool getFading() const { return m_fadeEffect; }
+
+    /**
+     * Sets observer for chip register writes, nullptr disables notifications.
+     * Observer position is updated with number of decoded samples before
+     * each decoded block.
+     */
+    void setObserver(ChipWriteObserver *observer);
+
+#if NES_CPU_PROFILER
+    /** Sets profiler for NES cpu, which plays NSF tracks, nullptr disables profiling */
+    void setProfiler(NesCpuProfiler *profiler);
+#endif
+
 private:
     BaseMusicDecoder * m_decoder = nullptr;
+    ChipWriteObserver * m_observer = nullptr;
+#if NES_CPU_PROFILER
+    NesCpuProfiler * m_profiler = nullptr;
+#endif
 
-    /** Duration in samples */
+    /** Duration in samples, and the duration to use for tracks without stored time */
     uint32_t m_duration = 0;
+    uint32_t m_defaultDuration = 0;
+
+    /** Played samples and the end of the current decoder block, 44100 Hz samples */
+    uint32_t m_samplesPlayed = 0;
+    uint32_t m_blockEnd = 0;
+
+    /** Output samples left in the current decoder block */
+    uint32_t m_waitSamples = 0;
 
-    uint32_t m_samplesPlayed;
-    uint32_t m_waitSamples;
+    /** Output sample frequency and the fraction of output sample, left from the previous waits */
+    uint32_t m_sampleFrequency = 44100;
+    uint32_t m_waitFraction = 0;
 
-    uint32_t m_readCounter;
-    uint32_t m_writeCounter;
-    uint32_t m_readScaler;
-    uint32_t m_writeScaler;
+    /** Samples, read from decoder, but not mixed yet. They belong to the current decoded block */
+    uint32_t m_block[VGM_FILE_BLOCK_SAMPLES];
+    uint32_t m_blockPos = 0;
+    uint32_t m_blockSize = 0;
+    /** Chip channels of the current decoded block, valid if m_blockStems is set */
+    uint16_t m_stemBlock[VGM_FILE_MAX_STEMS][VGM_FILE_BLOCK_SAMPLES];
+    bool m_blockStems = false;
 
-    uint32_t m_sampleSum;
-    bool m_sampleSumValid = false;
     bool m_fadeEffect = false;
+    bool m_defaultFading = false;
+    /** Fade length in samples, volume is samples left * m_fadeScale / 65536 of 1024 */
+    uint32_t m_fadeSamples;
+    uint32_t m_fadeScale;
     uint16_t m_shifter = 0;
     uint16_t m_volume = 100;
+    uint8_t m_quality = CHIP_QUALITY_FAST;
+    uint8_t m_channelMask = 0xFF;
 
-    void interpolateSample();
+    int decode(uint8_t *outBuffer, uint16_t *const *stems, int maxSize);
+    void readBlock(int stemCount);
+    void resetPosition();
+    void resetFade();
     void deleteDecoder();
 };
@@ -0,0 +1,92 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "formats/frame_format.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+class VgmMusicDecoder;
+
+/**
+ * Converts VGM file with AY-3-8910 or NES APU to compact frame format, played by
+ * FrameMusicDecoder. Writes are quantized to frames of fixed rate: only the last
+ * value of each register in the frame is stored, and unchanged values of registers
+ * without side effects are not stored at all. Commands for other chips are dropped.
+ */
+class VgmFrameConverter
+{
+public:
+    VgmFrameConverter();
+    ~VgmFrameConverter();
+
+    /** Statistics of the last convert() call */
+    typedef struct
+    {
+        uint32_t writes;     // chip writes in source file
+        uint32_t dropped;    // writes to registers, not stored in the format
+        uint32_t merged;     // writes, replaced by the next write in the same frame
+        uint32_t unchanged;  // writes of unchanged values
+        uint32_t frames;
+        uint32_t rawSize;    // frame stream size before compression
+        uint32_t streamSize; // stored frame stream size
+    } Stats;
+
+    /** Opens VGM data. Data must be accessible until converter is closed */
+    bool open(const uint8_t *data, int size);
+
+    /** Closes VGM data */
+    void close();
+
+    /**
+     * Builds frame stream.
+     * @param rate frames per second, 0 to use rate from VGM header. If header has no
+     *        rate, 60 is used for tracks with 735 sample waits between writes, otherwise 50.
+     * @param compress true to compress the stream if it becomes smaller
+     */
+    bool convert(uint32_t rate, bool compress);
+
+    /** Returns statistics of convert() call */
+    const Stats &getStats() const { return m_stats; }
+
+    /** Writes frame file */
+    bool save(FILE *file);
+
+private:
+    VgmMusicDecoder *m_decoder = nullptr;
+    FrameHeader m_header{};
+    std::vector<uint8_t> m_stream;
+    Stats m_stats{};
+    uint8_t m_shadow[FRAME_MAX_SLOTS]{};
+    bool m_shadowValid[FRAME_MAX_SLOTS]{};
+
+    int getSlot(uint8_t reg, uint32_t written) const;
+    uint32_t detectRate() const;
+    uint32_t getFrame(uint64_t position, bool beforeLoop) const;
+    uint32_t encodeFrame(const uint8_t *values, uint32_t written, uint8_t *frame);
+    static void compress(const uint8_t *data, uint32_t size, std::vector<uint8_t> &stream);
+};
@@ -0,0 +1,84 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "formats/vgm_writer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+class VgmMusicDecoder;
+
+/**
+ * Rewrites VGM file with fewer commands, producing the same audio. Command stream is
+ * taken from VgmMusicDecoder, register shadows of AY-3-8910 and NES APU are tracked:
+ *  - writes of the value, which register already has, are dropped for registers
+ *    without side effects;
+ *  - writes, overwritten by the write to the same register before any wait, are dropped;
+ *  - waits are merged and stored with the shortest wait commands;
+ *  - loop offset is moved to the new position of the loop start.
+ * Commands for chips, which are not emulated by the decoder, are not stored.
+ */
+class VgmOptimizer
+{
+public:
+    VgmOptimizer();
+    ~VgmOptimizer();
+
+    /** Statistics of the last optimize() call */
+    typedef struct
+    {
+        uint32_t writes;     // chip writes in source file
+        uint32_t noops;      // dropped writes of unchanged values
+        uint32_t dead;       // dropped writes, overwritten before the wait
+    } Stats;
+
+    /** Opens VGM data. Data must be accessible until optimizer is closed */
+    bool open(const uint8_t *data, int size);
+
+    /** Closes VGM data */
+    void close();
+
+    /** Builds optimized command stream */
+    bool optimize();
+
+    /** Returns statistics of optimize() call */
+    const Stats &getStats() const { return m_stats; }
+
+    /** Writes optimized VGM file */
+    bool save(FILE *file);
+
+private:
+    VgmMusicDecoder *m_decoder = nullptr;
+    const uint8_t *m_data = nullptr;
+    int m_size = 0;
+    VgmWriter m_writer;
+    Stats m_stats{};
+    uint8_t m_shadow[256]{};
+    bool m_shadowValid[256]{};
+
+    bool isDeadWrite(uint32_t index, uint32_t end) const;
+    void invalidateShadows();
+};
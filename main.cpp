@@ -23,7 +23,13 @@ SOFTWARE.
 */
 
 #include "vgm_file.h"
+#include "chip_write_trace.h"
+#include "nsf_vgm_exporter.h"
+#include "vgm_optimizer.h"
+#include "vgm_frame_converter.h"
+#include "music_info.h"
 #include "formats/wav_format.h"
+#include "chips/nes_cpu_profiler.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +39,22 @@ SOFTWARE.
 #define AUDIO_PLAYER 0
 #endif
 
+#ifndef MUSIC_INDEX
+#define MUSIC_INDEX 0
+#endif
+
+#ifndef RENDER_CACHE
+#define RENDER_CACHE 0
+#endif
+
+#if MUSIC_INDEX
+#include "tools/music_index.h"
+#endif
+
+#if RENDER_CACHE
+#include "tools/render_cache.h"
+#endif
+
 #if AUDIO_PLAYER
 #ifdef _WIN32
 #include <SDL.h>
@@ -60,18 +82,45 @@ int readFile(const char *name, uint8_t **buffer )
     return filelen;
 }
 
-int writeFile(const char *name, VgmFile *vgm, int trackIndex)
+/** Limits track duration: by time stored in the file, by detected loop or to 90 seconds */
+static void setupTrack(VgmFile *vgm, int trackIndex)
+{
+    MusicTrackInfo info;
+    uint32_t duration, fade;
+    if ( vgm->getTrackTime( trackIndex, duration, fade ) )
+    {
+        // Track time from the file is applied by setTrack(), no analysis is needed
+    }
+    else if ( vgm->analyzeTrack( trackIndex, info ) )
+    {
+        // Stop exactly after the second loop, fade only looped tracks
+        vgm->setMaxSamples( info.introSamples + info.loopSamples * 2 );
+        vgm->setFading( info.loopSamples != 0 );
+    }
+    else
+    {
+        vgm->setMaxDuration( 90000 );
+        vgm->setFading( true );
+    }
+    vgm->setSampleFrequency( 44100 );
+    vgm->setTrack( trackIndex );
+    vgm->setVolume( 100 );
+}
+
+/** Reads up to size bytes of unsigned PCM16 stereo data, returns number of bytes read */
+typedef int (*PcmReader)(void *context, uint8_t *buffer, int size);
+
+static int readVgmPcm(void *context, uint8_t *buffer, int size)
+{
+    return static_cast<VgmFile *>(context)->decodePcm( buffer, size );
+}
+
+int writeWave(const char *name, PcmReader reader, void *context)
 {
     bool warningDisplayed = false;
     uint8_t buffer[1024];
     FILE *fileptr;
 
-    if ( trackIndex >= vgm->getTrackCount() )
-    {
-        fprintf( stderr, "Source sound file has only %d tracks\n", vgm->getTrackCount() );
-        return -1;
-    }
-
     fileptr = fopen(name, "wb");
     if ( fileptr == nullptr )
     {
@@ -85,14 +134,9 @@ int writeFile(const char *name, VgmFile *vgm, int trackIndex)
         0x61746164, 0
     };
     fwrite( &header, sizeof(header), 1, fileptr );
-    vgm->setMaxDuration( 90000 );
-    vgm->setFading( true );
-    vgm->setSampleFrequency( 44100 );
-    vgm->setTrack( trackIndex );
-    vgm->setVolume( 100 );
     for(;;)
     {
-        int size = vgm->decodePcm(buffer, sizeof(buffer));
+        int size = reader( context, buffer, sizeof(buffer) );
         if ( size < 0 )
         {
             break;
@@ -122,6 +166,238 @@ int writeFile(const char *name, VgmFile *vgm, int trackIndex)
     return 0;
 }
 
+int writeFile(const char *name, VgmFile *vgm, int trackIndex)
+{
+    if ( trackIndex >= vgm->getTrackCount() )
+    {
+        fprintf( stderr, "Source sound file has only %d tracks\n", vgm->getTrackCount() );
+        return -1;
+    }
+    setupTrack( vgm, trackIndex );
+    return writeWave( name, readVgmPcm, vgm );
+}
+
+#if RENDER_CACHE
+
+static int readCachePcm(void *context, uint8_t *buffer, int size)
+{
+    return static_cast<RenderCache *>(context)->read( buffer, size );
+}
+
+int writeCachedFile(const char *directory, uint64_t maxBytes, const char *input, const char *name, int trackIndex)
+{
+    uint8_t *data;
+    int size = readFile( input, &data );
+    if ( size < 0 )
+    {
+        fprintf( stderr, "Failed to open file %s \n", input );
+        return -1;
+    }
+    RenderCache cache;
+    VgmFile file;
+    int result = -1;
+    if ( !file.open( data, size ) || trackIndex >= file.getTrackCount() )
+    {
+        fprintf( stderr, "Failed to parse vgm data %s \n", input );
+    }
+    else if ( cache.open( directory, maxBytes ) )
+    {
+        // Duration and fading are chosen by setupTrack() for each track, and are a part of the key
+        setupTrack( &file, trackIndex );
+        RenderCacheKey key{};
+        key.fileHash = RenderCache::hashFile( data, size );
+        key.track = trackIndex;
+        key.sampleRate = 44100;
+        key.duration = file.getTotalSamples();
+        key.volume = 100;
+        key.format = RENDER_CACHE_FORMAT_U16_STEREO;
+        key.flags = file.getFading() ? 1 : 0;
+        bool hit = cache.contains( key );
+        if ( cache.start( key, &file ) )
+        {
+            fprintf( stderr, "Render cache %s\n", hit ? "hit" : "miss" );
+            result = writeWave( name, readCachePcm, &cache );
+        }
+        cache.stop();
+    }
+    file.close();
+    free( data );
+    return result;
+}
+
+#endif
+
+static bool hasExtension(const char *name, const char *ext)
+{
+    size_t nameLen = strlen( name );
+    size_t extLen = strlen( ext );
+    return nameLen >= extLen && !strcasecmp( name + nameLen - extLen, ext );
+}
+
+int exportVgm(const char *name, const uint8_t *data, int size, int trackIndex)
+{
+    NsfVgmExporter exporter;
+    if ( !exporter.open( data, size ) )
+    {
+        fprintf( stderr, "Only NSF files can be converted to VGM\n" );
+        return -1;
+    }
+    if ( trackIndex >= exporter.getTrackCount() )
+    {
+        fprintf( stderr, "Source sound file has only %d tracks\n", exporter.getTrackCount() );
+        return -1;
+    }
+    if ( !exporter.convert( trackIndex ) )
+    {
+        fprintf( stderr, "Failed to convert track %d\n", trackIndex );
+        return -1;
+    }
+    FILE *fileptr = fopen( name, "wb" );
+    if ( fileptr == nullptr )
+    {
+        fprintf( stderr, "Failed to open file %s \n", name );
+        return -1;
+    }
+    bool result = exporter.save( fileptr );
+    fclose( fileptr );
+    if ( !result )
+    {
+        return -1;
+    }
+    fprintf( stderr, "Track length: %u samples, loop: %u samples\n",
+             exporter.getTotalSamples(), exporter.getLoopSamples() );
+    return 0;
+}
+
+int optimizeVgm(const char *input, const char *name)
+{
+    uint8_t *data;
+    int size = readFile( input, &data );
+    if ( size < 0 )
+    {
+        fprintf( stderr, "Failed to open file %s \n", input );
+        return -1;
+    }
+    VgmOptimizer optimizer;
+    if ( !optimizer.open( data, size ) || !optimizer.optimize() )
+    {
+        fprintf( stderr, "Only VGM files with AY-3-8910 or NES APU can be optimized\n" );
+        free( data );
+        return -1;
+    }
+    FILE *fileptr = fopen( name, "wb" );
+    if ( fileptr == nullptr )
+    {
+        fprintf( stderr, "Failed to open file %s \n", name );
+        free( data );
+        return -1;
+    }
+    bool result = optimizer.save( fileptr );
+    int newSize = ftell( fileptr );
+    fclose( fileptr );
+    optimizer.close();
+    free( data );
+    if ( !result )
+    {
+        return -1;
+    }
+    const VgmOptimizer::Stats &stats = optimizer.getStats();
+    fprintf( stderr, "Writes: %u, dropped unchanged: %u, dropped overwritten: %u\n",
+             stats.writes, stats.noops, stats.dead );
+    fprintf( stderr, "Size: %d -> %d bytes\n", size, newSize );
+    return 0;
+}
+
+int compactVgm(const char *input, const char *name, uint32_t rate)
+{
+    uint8_t *data;
+    int size = readFile( input, &data );
+    if ( size < 0 )
+    {
+        fprintf( stderr, "Failed to open file %s \n", input );
+        return -1;
+    }
+    VgmFrameConverter converter;
+    if ( !converter.open( data, size ) || !converter.convert( rate, true ) )
+    {
+        fprintf( stderr, "Only VGM files with AY-3-8910 or NES APU can be converted\n" );
+        free( data );
+        return -1;
+    }
+    FILE *fileptr = fopen( name, "wb" );
+    if ( fileptr == nullptr )
+    {
+        fprintf( stderr, "Failed to open file %s \n", name );
+        free( data );
+        return -1;
+    }
+    bool result = converter.save( fileptr );
+    int newSize = ftell( fileptr );
+    fclose( fileptr );
+    converter.close();
+    free( data );
+    if ( !result )
+    {
+        return -1;
+    }
+    const VgmFrameConverter::Stats &stats = converter.getStats();
+    fprintf( stderr, "Writes: %u, frames: %u, dropped: %u, merged: %u, unchanged: %u\n",
+             stats.writes, stats.frames, stats.dropped, stats.merged, stats.unchanged );
+    fprintf( stderr, "Stream: %u -> %u bytes, size: %d -> %d bytes\n",
+             stats.rawSize, stats.streamSize, size, newSize );
+    return 0;
+}
+
+int printInfo(const uint8_t *data, int size)
+{
+    static const char *chipNames[16] =
+    {
+        "SN76489", "YM2413", "YM2612", "YM2151", "AY-3-8910", "NES APU", "GB DMG", nullptr,
+        "VRC6", "VRC7", "FDS", "MMC5", "N163", "S5B", nullptr, "other",
+    };
+    static const char *tagNames[MUSIC_TAG_COUNT] =
+    {
+        "Title", "Game", "System", "Author", "Date", "Ripper", "Notes", "Copyright",
+    };
+    MusicInfo info;
+    if ( !info.probe( data, size ) )
+    {
+        fprintf( stderr, "Unknown file format\n" );
+        return -1;
+    }
+    printf( "Format: %s\n", info.getFormat() == MUSIC_FORMAT_VGM ? "VGM" : "NSF" );
+    printf( "Chips:" );
+    for (int i = 0; i < 16; i++)
+    {
+        if ( ( info.getChips() & (1 << i) ) && chipNames[i] ) printf( " %s", chipNames[i] );
+    }
+    printf( "\n" );
+    if ( info.getAy8910Clock() ) printf( "AY-3-8910 clock: %u Hz\n", info.getAy8910Clock() );
+    if ( info.getNesApuClock() ) printf( "NES APU clock: %u Hz\n", info.getNesApuClock() );
+    printf( "Tracks: %d\n", info.getTrackCount() );
+    if ( info.getTotalSamples() )
+    {
+        printf( "Intro: %u samples\nLoop: %u samples\n", info.getIntroSamples(), info.getLoopSamples() );
+    }
+    for (int track = 0; info.getFormat() == MUSIC_FORMAT_NSF && track < info.getTrackCount(); track++)
+    {
+        uint32_t totalSamples, fadeSamples;
+        if ( info.getTrackSamples( track, totalSamples, fadeSamples ) )
+        {
+            printf( "Track %d: %u samples, fade %u samples\n", track, totalSamples, fadeSamples );
+        }
+    }
+    for (int i = 0; i < MUSIC_TAG_COUNT; i++)
+    {
+        char text[256];
+        if ( MusicInfo::copyTag( info.getTag( i ), text, sizeof(text) ) )
+        {
+            printf( "%s: %s\n", tagNames[i], text );
+        }
+    }
+    return 0;
+}
+
 #if AUDIO_PLAYER
 
 static bool s_stopped = false;
@@ -145,11 +421,7 @@ int playTrack(VgmFile *vgm, int trackIndex)
     spec.callback = getAudioCallback;
     spec.userdata = vgm;
 
-    vgm->setMaxDuration( 90000 );
-    vgm->setFading( true );
-    vgm->setSampleFrequency( 44100 );
-    vgm->setTrack( trackIndex );
-    vgm->setVolume( 100 );
+    setupTrack( vgm, trackIndex );
     s_stopped = false;
 
     if ( SDL_OpenAudio(&spec, NULL) < 0 )
@@ -173,13 +445,67 @@ int main(int argc, char *argv[])
     int trackIndex = 0;
     if (argc < 3)
     {
-        fprintf(stderr, "Converts NSF or VGM files to wav data\n");
-        fprintf(stderr, "Usage: vgm2pcm input output [track_index]\n");
+        fprintf(stderr, "Converts NSF or VGM files to wav data, or NSF files to VGM (output.vgm)\n");
+        fprintf(stderr, "Usage: vgm2pcm input output [track_index [trace_file]]\n");
+        fprintf(stderr, "Usage: vgm2pcm input info\n");
+        fprintf(stderr, "Usage: vgm2pcm optimize input.vgm output.vgm\n");
+        fprintf(stderr, "Usage: vgm2pcm compact input.vgm output.vgr [frame_rate]\n");
+        #if MUSIC_INDEX
+        fprintf(stderr, "Usage: vgm2pcm index directory index_file [threads]\n");
+        #endif
+        #if RENDER_CACHE
+        fprintf(stderr, "Usage: vgm2pcm cache directory max_megabytes input output [track_index]\n");
+        #endif
         #if AUDIO_PLAYER
         fprintf(stderr, "Usage: vgm2pcm input play [track_index]\n");
         #endif
         return -1;
     }
+    #if MUSIC_INDEX
+    if ( !strcmp( argv[1], "index" ) )
+    {
+        MusicIndex::BuildStats stats{};
+        if ( argc < 4 || !MusicIndex::build( argv[2], argv[3], argc > 4 ? strtoul(argv[4], nullptr, 10) : 0, &stats ) )
+        {
+            fprintf( stderr, "Failed to build index\n" );
+            return -1;
+        }
+        fprintf( stderr, "Indexed %u files: %u reused, %u scanned, %u failed\n",
+                 stats.files, stats.reused, stats.scanned, stats.failed );
+        fprintf(stderr, "DONE\n");
+        return 0;
+    }
+    #endif
+    if ( !strcmp( argv[1], "optimize" ) )
+    {
+        if ( argc < 4 || optimizeVgm( argv[2], argv[3] ) < 0 )
+        {
+            return -1;
+        }
+        fprintf(stderr, "DONE\n");
+        return 0;
+    }
+    if ( !strcmp( argv[1], "compact" ) )
+    {
+        if ( argc < 4 || compactVgm( argv[2], argv[3], argc > 4 ? strtoul( argv[4], nullptr, 10 ) : 0 ) < 0 )
+        {
+            return -1;
+        }
+        fprintf(stderr, "DONE\n");
+        return 0;
+    }
+    #if RENDER_CACHE
+    if ( !strcmp( argv[1], "cache" ) )
+    {
+        if ( argc < 6 || writeCachedFile( argv[2], strtoull( argv[3], nullptr, 10 ) * 1024 * 1024, argv[4], argv[5],
+                                          argc > 6 ? strtoul( argv[6], nullptr, 10 ) : 0 ) < 0 )
+        {
+            return -1;
+        }
+        fprintf(stderr, "DONE\n");
+        return 0;
+    }
+    #endif
     if (argc > 3)
     {
         trackIndex = strtoul(argv[3], nullptr, 10);
@@ -191,12 +517,41 @@ int main(int argc, char *argv[])
         fprintf( stderr, "Failed to open file %s \n", argv[1] );
         return -1;
     }
+    if ( !strcmp( argv[2], "info" ) )
+    {
+        return printInfo( data, size );
+    }
+    if ( hasExtension( argv[2], ".vgm" ) )
+    {
+        if ( exportVgm( argv[2], data, size, trackIndex ) < 0 )
+        {
+            return -1;
+        }
+        fprintf(stderr, "DONE\n");
+        return 0;
+    }
     VgmFile file;
+    #if NES_CPU_PROFILER
+    NesCpuProfiler profiler;
+    file.setProfiler( &profiler );
+    #endif
     if (!file.open(data, size))
     {
         fprintf( stderr, "Failed to parse vgm data %s \n", argv[1] );
         return -1;
     }
+    ChipWriteTrace trace( 0 );
+    FILE *traceFile = nullptr;
+    if ( argc > 4 )
+    {
+        traceFile = fopen( argv[4], "wb" );
+        if ( traceFile == nullptr || !trace.setOutputFile( traceFile ) )
+        {
+            fprintf( stderr, "Failed to open file %s \n", argv[4] );
+            return -1;
+        }
+        file.setObserver( &trace );
+    }
     #if AUDIO_PLAYER
     if ( !strcmp( argv[2], "play" ) )
     {
@@ -208,6 +563,19 @@ int main(int argc, char *argv[])
     {
         return -1;
     }
+    if ( traceFile != nullptr )
+    {
+        fclose( traceFile );
+    }
+    #if NES_CPU_PROFILER
+    profiler.writeReport( stderr );
+    FILE *folded = fopen( "nes_cpu.folded", "wb" );
+    if ( folded != nullptr )
+    {
+        profiler.writeFoldedStacks( folded );
+        fclose( folded );
+    }
+    #endif
     fprintf(stderr, "DONE\n");
     return 0;
 }
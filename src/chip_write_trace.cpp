@@ -0,0 +1,96 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chip_write_trace.h"
+
+#include <stdlib.h>
+
+ChipWriteTrace::ChipWriteTrace(uint32_t capacity)
+{
+    m_records = static_cast<ChipWriteRecord *>(malloc( capacity * sizeof(ChipWriteRecord) ));
+    m_capacity = m_records ? capacity : 0;
+}
+
+ChipWriteTrace::~ChipWriteTrace()
+{
+    if ( m_records )
+    {
+        free( m_records );
+        m_records = nullptr;
+    }
+}
+
+bool ChipWriteTrace::setOutputFile(FILE *file)
+{
+    m_file = file;
+    if ( m_file == nullptr )
+    {
+        return true;
+    }
+    ChipWriteTraceHeader header = { 0x544D4756, 1, sizeof(ChipWriteRecord) };
+    return fwrite( &header, sizeof(header), 1, m_file ) == 1;
+}
+
+void ChipWriteTrace::onWrite(uint8_t chip, uint8_t reg, uint8_t value)
+{
+    ChipWriteRecord record = { m_position, chip, reg, value, 0 };
+    if ( m_file )
+    {
+        fwrite( &record, sizeof(record), 1, m_file );
+    }
+    if ( !m_capacity )
+    {
+        return;
+    }
+    if ( m_count == m_capacity )
+    {
+        // Overwrite the oldest record
+        m_head = m_head + 1 == m_capacity ? 0 : m_head + 1;
+        m_count--;
+        m_dropped++;
+    }
+    uint32_t tail = m_head + m_count;
+    if ( tail >= m_capacity ) tail -= m_capacity;
+    m_records[tail] = record;
+    m_count++;
+}
+
+uint32_t ChipWriteTrace::read(ChipWriteRecord *records, uint32_t maxCount)
+{
+    uint32_t count = 0;
+    while ( count < maxCount && m_count )
+    {
+        records[count++] = m_records[m_head];
+        m_head = m_head + 1 == m_capacity ? 0 : m_head + 1;
+        m_count--;
+    }
+    return count;
+}
+
+void ChipWriteTrace::clear()
+{
+    m_head = 0;
+    m_count = 0;
+    m_dropped = 0;
+}
@@ -23,9 +23,12 @@ SOFTWARE.
 */
 
 #include "chips/ay-3-8910.h"
+#include "chips/state_hash.h"
+#include "chips/noise_lfsr.h"
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define AY38910_DEBUG 1
 
@@ -35,8 +38,27 @@ SOFTWARE.
 #include "../vgm_logger.h"
 
 
+#if !defined(AY38910_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define AY38910_AVX2 1
+#define AY38910_SSE2 1
+#elif !defined(AY38910_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define AY38910_SSE2 1
+#elif !defined(AY38910_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define AY38910_NEON 1
+#endif
+
 #define YM2149_PIN26_LOW   (0x10)
 
+#define AY38910_RNG_WIDTH  17
+#define AY38910_RNG_TAP    3
+
+#if !AY38910_AY_FAMILY && !AY38910_YM_FAMILY
+#error At least one of AY38910_AY_FAMILY and AY38910_YM_FAMILY must be enabled
+#endif
+
 /*
 
 Normalized voltage
@@ -60,13 +82,16 @@ Normalized voltage
 
  */
 
+#if AY38910_AY_FAMILY
 static uint16_t ay8910LevelTable[16] =
 {
 0,	183,	408,	683,	1020,	1433,	1939,	2558,	3317,	4246,	5385,	6779,	8487,	10579,	13142,	16281,
 /*    2345,  3017,  3945,  4820,  5985,  7190,  8590,  10600,
     11370, 12890, 13620, 14275, 14760, 15090, 15350, 15950,*/
 };
+#endif
 
+#if AY38910_YM_FAMILY
 static uint16_t ym2149LevelTable[32] =
 {
 0,	81,	171,	270,	380,	501,	635,	783,
@@ -74,6 +99,7 @@ static uint16_t ym2149LevelTable[32] =
 3055,	3457,	3902,	4394,	4937,	5538,	6201,	6935,
 7746,	8642,	9632,	10726,	11936,	13272,	14749,	16382,
 };
+#endif
 
 enum
 {
@@ -121,6 +147,40 @@ enum
 };
 
 
+enum
+{
+    ENV_DOWN = 0,
+    ENV_UP = 1,
+    ENV_HOLD_LOW = 2,
+    ENV_HOLD_HIGH = 3,
+};
+
+/**
+ * Envelope segments: each shape is two segments of 32 steps. Envelope steps through both
+ * segments and repeats them, until the hold segment is reached. Shape bits are:
+ * hold (0x01), alternate (0x02), attack (0x04), continue (0x08).
+ */
+static constexpr uint8_t envelopeShapes[16][2] =
+{
+    { ENV_DOWN, ENV_HOLD_LOW }, { ENV_DOWN, ENV_HOLD_LOW }, { ENV_DOWN, ENV_HOLD_LOW }, { ENV_DOWN, ENV_HOLD_LOW },
+    { ENV_UP, ENV_HOLD_LOW }, { ENV_UP, ENV_HOLD_LOW }, { ENV_UP, ENV_HOLD_LOW }, { ENV_UP, ENV_HOLD_LOW },
+    { ENV_DOWN, ENV_DOWN }, { ENV_DOWN, ENV_HOLD_LOW }, { ENV_DOWN, ENV_UP }, { ENV_DOWN, ENV_HOLD_HIGH },
+    { ENV_UP, ENV_UP }, { ENV_UP, ENV_HOLD_HIGH }, { ENV_UP, ENV_DOWN }, { ENV_UP, ENV_HOLD_LOW },
+};
+
+/** Envelope levels of each segment step (32 levels of YM2149) */
+static constexpr uint8_t envelopeSegments[4][32] =
+{
+    { 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16,
+      15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 },
+    {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+       0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 },
+    { 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31,
+      31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31 },
+};
+
 enum
 {
     CHANNEL_A = 0,
@@ -128,6 +188,46 @@ enum
     CHANNEL_C = 2,
 };
 
+/**
+ * Advances phase counter by one sample and returns true if period is passed. Remainder of
+ * the phase is kept, if period is shorter than a sample, counter restarts from 0.
+ */
+static inline bool advancePhase(uint32_t &counter, uint32_t scale, uint32_t period)
+{
+    counter += scale;
+    if ( counter < period )
+    {
+        return false;
+    }
+    counter -= period;
+    if ( counter >= period ) counter = 0;
+    return true;
+}
+
+/** AY-3-8910 family: 16 volume levels, envelope steps through the 32-step shape table by 2 */
+struct Ay8910Family
+{
+    static constexpr uint8_t envStepSize = 2;
+    static constexpr uint8_t envLevelShift = 1;
+};
+
+/** YM2149 family: 32 volume levels and 32 envelope steps */
+struct Ym2149Family
+{
+    static constexpr uint8_t envStepSize = 1;
+    static constexpr uint8_t envLevelShift = 0;
+};
+
+
+uint8_t AY38910::envelopeLevel(uint8_t shape, uint8_t step)
+{
+    return envelopeSegments[ envelopeShapes[shape & 0x0F][(step >> 5) & 1] ][step & 31];
+}
+
+AY38910::AY38910()
+{
+    selectFamily();
+}
 
 AY38910::AY38910(uint8_t chipType, uint8_t flags)
 {
@@ -138,19 +238,59 @@ void AY38910::setType( uint8_t chipType, uint8_t flags )
 {
     m_chipType = chipType;
     m_flags = flags;
+    selectFamily();
     reset();
 }
 
+void AY38910::selectFamily()
+{
+    m_ymFamily = ( m_chipType & 0xF0 ) != 0;
+#if !AY38910_YM_FAMILY
+    if ( m_ymFamily )
+    {
+        LOGE( "YM2149 family is not supported by this build, using AY-3-8910\n" );
+        m_ymFamily = false;
+    }
+#endif
+#if !AY38910_AY_FAMILY
+    if ( !m_ymFamily )
+    {
+        LOGE( "AY-3-8910 family is not supported by this build, using YM2149\n" );
+        m_ymFamily = true;
+    }
+#endif
+#if AY38910_YM_FAMILY
+    if ( m_ymFamily )
+    {
+        m_renderSample = &AY38910::renderSample<Ym2149Family>;
+        m_renderBlock = &AY38910::renderBlock<Ym2149Family>;
+    }
+#endif
+#if AY38910_AY_FAMILY
+    if ( !m_ymFamily )
+    {
+        m_renderSample = &AY38910::renderSample<Ay8910Family>;
+        m_renderBlock = &AY38910::renderBlock<Ay8910Family>;
+    }
+#endif
+}
+
 void AY38910::setFrequency( uint32_t frequency )
 {
     m_frequency = frequency * 2;
-    reset();
+    calcRates();
 }
 
 void AY38910::setSampleFrequency( uint32_t sampleFrequency )
 {
     m_sampleFrequency = sampleFrequency;
-    reset();
+    calcRates();
+}
+
+void AY38910::setQuality(uint8_t quality)
+{
+    m_quality = quality;
+    calcRates();
 }
 
 void AY38910::setVolume(uint16_t volume)
@@ -161,7 +301,8 @@ void AY38910::setVolume(uint16_t volume)
 
 void AY38910::calcVolumeTables()
 {
-    if ( m_chipType & 0xF0 )
+#if AY38910_YM_FAMILY
+    if ( m_ymFamily )
     {
         for (int i = 0; i < 32; i++)
         {
@@ -170,7 +311,9 @@ void AY38910::calcVolumeTables()
             m_levelTable[i] = vol;
         }
     }
-    else
+#endif
+#if AY38910_AY_FAMILY
+    if ( !m_ymFamily )
     {
         for (int i = 0; i < 16; i++)
         {
@@ -179,24 +322,63 @@ void AY38910::calcVolumeTables()
             m_levelTable[i] = vol;
         }
     }
+#endif
 }
 
 void AY38910::reset()
 {
-    m_envStepMask = ( m_chipType & 0xF0 ) ? 0x1F: 0x0F;
-    m_toneFrequencyScale = (m_frequency / m_sampleFrequency); // * 16
-    m_envFrequencyScale = (m_frequency / m_sampleFrequency);  // * 256
-    if ( !( m_chipType & 0xF0 ) )
+    calcRates();
+    for (int i=0; i<=R_ENVELOPE; i++) write(i, 0);
+}
+
+void AY38910::calcRates()
+{
+    uint32_t renderFrequency = m_sampleFrequency;
+    if ( m_quality == CHIP_QUALITY_BALANCED )
+    {
+        renderFrequency <<= CHIP_DECIMATOR_HALFBAND_STAGES;
+        m_decimator.setHalfband( CHIP_DECIMATOR_HALFBAND_STAGES );
+    }
+    else if ( m_quality == CHIP_QUALITY_ACCURATE && m_frequency / 16 > m_sampleFrequency )
+    {
+        // Tone counters of the chip are clocked at clock / 8 (m_frequency is doubled clock)
+        renderFrequency = m_frequency / 16;
+        m_decimator.setRates( renderFrequency, m_sampleFrequency );
+    }
+    else
+    {
+        m_decimator.disable();
+    }
+    m_stemsSynced = false;
+    // Tone periods are stored * 16, envelope period * 256
+    m_toneFrequencyScale = ( (static_cast<uint64_t>(m_frequency) << AY38910_PHASE_BITS) +
+                             renderFrequency / 2 ) / renderFrequency;
+    m_envFrequencyScale = m_toneFrequencyScale;
+    if ( !m_ymFamily )
     {
         m_envFrequencyScale /= 2;
     }
 
-    if ( ( m_chipType & 0xF0 ) && ( m_flags & YM2149_PIN26_LOW ) )
+    // Clock divider only changes envelope speed, so it is applied here once
+    if ( m_ymFamily && ( m_flags & YM2149_PIN26_LOW ) )
     {
         m_envFrequencyScale /= 2;
     }
+}
 
-    for (int i=0; i<=R_ENVELOPE; i++) write(i, 0);
+uint64_t AY38910::getStateHash() const
+{
+    const uint32_t values[] =
+    {
+        m_rng, m_period[0], m_period[1], m_period[2], m_periodNoise, m_mixer,
+        m_amplitude[0], m_amplitude[1], m_amplitude[2], m_ampR[0], m_ampR[1], m_ampR[2],
+        m_periodE, m_envelopeReg, m_holding, m_envStep, m_ymFamily,
+        m_noiseRecalc, m_useEnvelope[0], m_useEnvelope[1], m_useEnvelope[2],
+        m_counter[0], m_counter[1], m_counter[2],
+        m_channelOutput[0], m_channelOutput[1], m_channelOutput[2],
+        m_counterNoise, m_noiseHigh, static_cast<uint32_t>(m_counterEnv), m_envVolume,
+    };
+    return m_decimator.getStateHash( stateHash( values, sizeof(values) ) );
 }
 
 uint16_t AY38910::read(uint8_t reg)
@@ -242,6 +424,7 @@ uint16_t AY38910::read(uint8_t reg)
 void AY38910::write(uint8_t reg, uint16_t value)
 {
     LOGI( ">> reg: %d = 0x%02X\n", reg, value);
+    if ( m_observer ) m_observer->onWrite( CHIP_WRITE_AY38910, reg, value );
     switch (reg)
     {
     case FTR_A:
@@ -277,7 +460,7 @@ void AY38910::write(uint8_t reg, uint16_t value)
         m_ampR[channel] = value;
         m_amplitude[channel] = (value & 0x0f);
         // For YM2149 type chips there 32 levels instead of 16
-        if ( m_chipType & 0xF0 ) m_amplitude[channel] <<= 1;
+        if ( m_ymFamily ) m_amplitude[channel] <<= 1;
         m_useEnvelope[channel] = ((value & 0x10) != 0);
         break;
     }
@@ -290,13 +473,8 @@ void AY38910::write(uint8_t reg, uint16_t value)
     case R_ENVELOPE:
         m_envelopeReg = value;
         m_holding = false;
-        m_hold = !!(value & 0x01); // true means one cycle only
-        m_alternate = !!(value & 0x02); // true means change direction after each cycle
-        // When both the Hold bit and the Alternate bit are ones, the envelope counter is reset to its initial count before holding.
-        m_attack = !!(value & 0x04); // if true from 0000 to 1111, otherwise from 1111 to 0000
-        m_continue = !!(value & 0x08); // if true hold bit, otherwise hold is enabled
-        if ( !m_continue ) m_hold = true;
-        m_envVolume = m_attack ? 0 : m_envStepMask;
+        m_envStep = 0;
+        m_envVolume = envelopeSegments[ envelopeShapes[value & 0x0F][0] ][0] >> ( m_ymFamily ? 0 : 1 );
 
         m_counterEnv = 0;
         break;
@@ -309,34 +487,22 @@ void AY38910::write(uint8_t reg, uint16_t value)
     }
 }
 
-uint32_t AY38910::getSample()
+inline void AY38910::updateNoise()
 {
-    for (int i=0; i<3; i++)
+    m_noiseRecalc = !m_noiseRecalc;
+    if ( m_noiseRecalc )
     {
-        m_counter[i] += m_toneFrequencyScale;
-        if (m_counter[i] >= m_period[i])
-        {
-            m_channelOutput[i] = !m_channelOutput[i];
-            m_counter[i] = 0;
-        }
-    }
-
-    m_counterNoise += m_toneFrequencyScale;
-    if (m_counterNoise >= m_periodNoise)
-    {
-        m_counterNoise = 0;
-        m_noiseRecalc = !m_noiseRecalc;
-        if ( m_noiseRecalc )
-        {
-            // The Random Number Generator of the 8910 is a 17-bit shift
-            // register. The input to the shift register is bit0 XOR bit3
-            // (bit0 is the output).
-            m_rng ^= (((m_rng & 1) ^ ((m_rng >> 3) & 1)) << 17);
-            m_rng >>= 1;
-            m_noiseHigh = !!(m_rng & 1);
-        }
+        // The Random Number Generator of the 8910 is a 17-bit shift
+        // register. The input to the shift register is bit0 XOR bit3
+        // (bit0 is the output).
+        m_rng = lfsrAdvance( m_rng, AY38910_RNG_WIDTH, AY38910_RNG_TAP, 1 );
+        m_noiseHigh = !!(m_rng & 1);
     }
+}
 
+template <typename Family>
+inline void AY38910::updateEnvelope()
+{
     if ( !m_holding )
     {
         if (m_periodE > 0)
@@ -344,34 +510,110 @@ uint32_t AY38910::getSample()
             m_counterEnv += m_envFrequencyScale;
             // The envelope counter runs at half the speed of the
             // tone counter, so double the envelope period
-            if (m_counterEnv >= m_periodE)
+            uint64_t period = static_cast<uint64_t>(m_periodE) << AY38910_PHASE_BITS;
+            if (m_counterEnv >= period)
             {
-                m_counterEnv = 0;
-                m_envVolume += m_attack ? 1: -1;
-                if ( m_envVolume > m_envStepMask ) // if overflow happened, we reached the boundary: low or high
-                {
-                    m_holding = m_hold;
-                    // step back
-                    m_envVolume -= m_attack ? 1: -1;
-                    if ( !m_continue ) m_envVolume = 0;
-                    else if ( m_alternate && m_hold ) m_envVolume ^= m_envStepMask;
-                    else if ( !m_hold && !m_alternate ) m_envVolume ^= m_envStepMask;
-                    else if ( !m_hold && m_alternate ) m_attack = !m_attack;
-                }
+                m_counterEnv -= period;
+                if (m_counterEnv >= period) m_counterEnv = 0;
+                m_envStep = (m_envStep + Family::envStepSize) & 63;
+                uint8_t segment = envelopeShapes[m_envelopeReg & 0x0F][m_envStep >> 5];
+                m_envVolume = envelopeSegments[segment][m_envStep & 31] >> Family::envLevelShift;
+                m_holding = segment >= ENV_HOLD_LOW;
             }
         }
     }
+}
+
+uint32_t AY38910::getSample()
+{
+    if ( m_decimator.isEnabled() )
+    {
+        uint32_t sample;
+        getSamples( &sample, 1 );
+        return sample;
+    }
+    return (this->*m_renderSample)();
+}
+
+void AY38910::getSamples(uint32_t *buffer, uint32_t count)
+{
+    getStems( buffer, nullptr, count );
+}
+
+void AY38910::getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    if ( !m_decimator.isEnabled() )
+    {
+        (this->*m_renderBlock)( buffer, stems, count );
+        return;
+    }
+    if ( !stems )
+    {
+        m_stemsSynced = false;
+    }
+    else if ( !m_stemsSynced )
+    {
+        for (int n = 0; n < AY38910_STEMS; n++) m_stemDecimator[n].follow( m_decimator );
+        m_stemsSynced = true;
+    }
+    uint32_t block[AY38910_BLOCK_SAMPLES];
+    uint16_t stemBlock[AY38910_STEMS][AY38910_BLOCK_SAMPLES];
+    uint16_t *const blockStems[AY38910_STEMS] = { stemBlock[0], stemBlock[1], stemBlock[2] };
+    uint32_t position = 0;
+    uint32_t inputCount = m_decimator.getInputCount( count );
+    while ( inputCount )
+    {
+        uint32_t size = inputCount < AY38910_BLOCK_SAMPLES ? inputCount : AY38910_BLOCK_SAMPLES;
+        (this->*m_renderBlock)( block, stems ? blockStems : nullptr, size );
+        uint32_t written = m_decimator.process( block, size, buffer + position );
+        for (int n = 0; stems && n < AY38910_STEMS; n++)
+        {
+            // Stem decimators are fed even for skipped stems to stay in phase with the mix
+            for (uint32_t i = 0; i < size; i++) block[i] = stemBlock[n][i];
+            m_stemDecimator[n].process( block, size, block );
+            for (uint32_t i = 0; stems[n] && i < written; i++)
+            {
+                stems[n][position + i] = static_cast<uint16_t>( block[i] );
+            }
+        }
+        position += written;
+        inputCount -= size;
+    }
+}
+
+template <typename Family>
+uint32_t AY38910::renderSample()
+{
+    for (int i=0; i<3; i++)
+    {
+        if ( advancePhase( m_counter[i], m_toneFrequencyScale, m_period[i] << AY38910_PHASE_BITS ) )
+        {
+            m_channelOutput[i] = !m_channelOutput[i];
+        }
+    }
+
+    if ( advancePhase( m_counterNoise, m_toneFrequencyScale, m_periodNoise << AY38910_PHASE_BITS ) )
+    {
+        updateNoise();
+    }
+
+    updateEnvelope<Family>();
 
     uint32_t left = 0;
     uint32_t right = 0;
 
+    bool noiseHigh = m_noiseHigh && (m_channelMask & AY38910_CHANNEL_NOISE);
     for(int chan=0; chan<3; chan++)
     {
+        if ( !(m_channelMask & (1 << chan)) )
+        {
+            continue;
+        }
 // Two variant for calculating enable field. Both work
 //        bool enabled = ( ((m_mixer >> chan) & 1)  || m_channelOutput[chan] ) &&
 //                       ( ((m_mixer >> (3 + chan)) & 1) || m_noiseHigh );
         bool enabled = ( ((m_mixer >> chan) & 1) == 0 && m_channelOutput[chan] ) ||
-                       ( ((m_mixer >> (3 + chan)) & 1) == 0 && m_noiseHigh );
+                       ( ((m_mixer >> (3 + chan)) & 1) == 0 && noiseHigh );
         if (m_useEnvelope[chan])
         {
             // TODO: Evelope must have it's own table
@@ -388,3 +630,244 @@ uint32_t AY38910::getSample()
 /*    right /= 3;*/ if ( right > 65535 ) right = 65535;
     return (left<<16) | right;
 }
+
+template <typename Family>
+void AY38910::renderBlock(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    // Tone and noise outputs (bits 0-2 are channels A-C, bit 3 is noise) and envelope level of each sample
+    uint8_t outputs[AY38910_BLOCK_SAMPLES];
+    uint8_t envelope[AY38910_BLOCK_SAMPLES];
+    uint16_t *blockStems[AY38910_STEMS];
+    for (int n = 0; stems && n < AY38910_STEMS; n++) blockStems[n] = stems[n];
+    while ( count )
+    {
+        uint32_t size = count < AY38910_BLOCK_SAMPLES ? count : AY38910_BLOCK_SAMPLES;
+        updateCounters<Family>( outputs, envelope, size );
+        mixSamples( outputs, envelope, buffer, stems ? blockStems : nullptr, size );
+        for (int n = 0; stems && n < AY38910_STEMS; n++)
+        {
+            if ( blockStems[n] ) blockStems[n] += size;
+        }
+        buffer += size;
+        count -= size;
+    }
+}
+
+template <typename Family>
+void AY38910::updateCounters(uint8_t *outputs, uint8_t *envelope, uint32_t count)
+{
+    uint32_t toneOutput = m_channelOutput[0] | (m_channelOutput[1] << 1) | (m_channelOutput[2] << 2);
+    // Noise output is taken from precomputed random sequence, bit n is the output after n steps.
+    // Muted noise is not mixed, so its steps are only counted and applied to generator at the end
+    const bool noiseEnabled = m_channelMask & AY38910_CHANNEL_NOISE;
+    uint64_t noiseSequence = noiseEnabled ? lfsrSequence( m_rng, AY38910_RNG_WIDTH, AY38910_RNG_TAP ) : m_rng;
+    uint32_t noiseSteps = 0;
+    uint32_t mutedNoiseSteps = 0;
+    uint32_t noiseOutput = m_noiseHigh;
+#if AY38910_SSE2
+    // Lanes 0-2 are tone counters, lane 3 is noise counter. Counters never reach 2^31,
+    // so signed compare with period - 1 gives counter >= period
+    __m128i counter = _mm_set_epi32( m_counterNoise, m_counter[2], m_counter[1], m_counter[0] );
+    const __m128i period = _mm_slli_epi32( _mm_set_epi32( m_periodNoise, m_period[2], m_period[1], m_period[0] ),
+                                           AY38910_PHASE_BITS );
+    const __m128i limit = _mm_sub_epi32( period, _mm_set1_epi32( 1 ) );
+    const __m128i scale = _mm_set1_epi32( m_toneFrequencyScale );
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // Same as advancePhase() for all lanes
+        counter = _mm_add_epi32( counter, scale );
+        __m128i overflow = _mm_cmpgt_epi32( counter, limit );
+        counter = _mm_sub_epi32( counter, _mm_and_si128( overflow, period ) );
+        counter = _mm_andnot_si128( _mm_cmpgt_epi32( counter, limit ), counter );
+        uint32_t toggles = _mm_movemask_ps( _mm_castsi128_ps( overflow ) );
+#elif AY38910_NEON
+    uint32x4_t counter = { m_counter[0], m_counter[1], m_counter[2], m_counterNoise };
+    const uint32x4_t registers = { m_period[0], m_period[1], m_period[2], m_periodNoise };
+    const uint32x4_t period = vshlq_n_u32( registers, AY38910_PHASE_BITS );
+    const uint32x4_t scale = vdupq_n_u32( m_toneFrequencyScale );
+    const uint32x4_t bits = { 1, 2, 4, 8 };
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // Same as advancePhase() for all lanes
+        counter = vaddq_u32( counter, scale );
+        uint32x4_t overflow = vcgeq_u32( counter, period );
+        counter = vsubq_u32( counter, vandq_u32( overflow, period ) );
+        counter = vbicq_u32( counter, vcgeq_u32( counter, period ) );
+        uint32_t toggles = vaddvq_u32( vandq_u32( overflow, bits ) );
+#else
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t toggles = 0;
+        for (int chan = 0; chan < 3; chan++)
+        {
+            if ( advancePhase( m_counter[chan], m_toneFrequencyScale, m_period[chan] << AY38910_PHASE_BITS ) )
+            {
+                toggles |= 1 << chan;
+            }
+        }
+        if ( advancePhase( m_counterNoise, m_toneFrequencyScale, m_periodNoise << AY38910_PHASE_BITS ) )
+        {
+            toggles |= 8;
+        }
+#endif
+        toneOutput ^= toggles & 7;
+        if ( toggles & 8 )
+        {
+            m_noiseRecalc = !m_noiseRecalc;
+            if ( m_noiseRecalc && !noiseEnabled )
+            {
+                mutedNoiseSteps++;
+            }
+            else if ( m_noiseRecalc )
+            {
+                if ( ++noiseSteps == 64 - AY38910_RNG_WIDTH )
+                {
+                    m_rng = (noiseSequence >> noiseSteps) & ((1 << AY38910_RNG_WIDTH) - 1);
+                    noiseSequence = lfsrSequence( m_rng, AY38910_RNG_WIDTH, AY38910_RNG_TAP );
+                    noiseSteps = 0;
+                }
+                noiseOutput = (noiseSequence >> noiseSteps) & 1;
+            }
+        }
+        updateEnvelope<Family>();
+        outputs[i] = toneOutput | (noiseOutput << 3);
+        envelope[i] = m_envVolume;
+    }
+#if AY38910_SSE2
+    uint32_t values[4];
+    _mm_storeu_si128( reinterpret_cast<__m128i *>(values), counter );
+    m_counter[0] = values[0];
+    m_counter[1] = values[1];
+    m_counter[2] = values[2];
+    m_counterNoise = values[3];
+#elif AY38910_NEON
+    m_counter[0] = vgetq_lane_u32( counter, 0 );
+    m_counter[1] = vgetq_lane_u32( counter, 1 );
+    m_counter[2] = vgetq_lane_u32( counter, 2 );
+    m_counterNoise = vgetq_lane_u32( counter, 3 );
+#endif
+    for (int chan = 0; chan < 3; chan++)
+    {
+        m_channelOutput[chan] = (toneOutput >> chan) & 1;
+    }
+    m_rng = (noiseSequence >> noiseSteps) & ((1 << AY38910_RNG_WIDTH) - 1);
+    if ( mutedNoiseSteps )
+    {
+        m_rng = lfsrAdvance( m_rng, AY38910_RNG_WIDTH, AY38910_RNG_TAP, mutedNoiseSteps );
+        noiseOutput = m_rng & 1;
+    }
+    m_noiseHigh = noiseOutput;
+}
+
+void AY38910::mixSamples(const uint8_t *outputs, const uint8_t *envelope, uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    // Output bits, which enable the channel: tone bit if tone is not disabled by mixer, noise bit (3)
+    uint32_t enableMask[3];
+    // Volume of the channel is either fixed amplitude or envelope level (0xFF mask selects envelope)
+    uint8_t envelopeMask[3];
+    uint8_t amplitude[3];
+    // Stem buffers of mixed channels, levels are written there before they are summed
+    uint16_t *stem[3];
+    // Only channels, which are not muted and not disabled by mixer, are mixed
+    int channels = 0;
+    const uint32_t noiseBit = (m_channelMask & AY38910_CHANNEL_NOISE) ? 8 : 0;
+    for (int chan = 0; chan < 3; chan++)
+    {
+        uint32_t mask = ( ((m_mixer >> chan) & 1) ? 0 : (1 << chan) ) | ( ((m_mixer >> (3 + chan)) & 1) ? 0 : noiseBit );
+        if ( !(m_channelMask & (1 << chan)) || !mask )
+        {
+            if ( stems && stems[chan] ) memset( stems[chan], 0, count * sizeof(uint16_t) );
+            continue;
+        }
+        stem[channels] = stems ? stems[chan] : nullptr;
+        enableMask[channels] = mask;
+        envelopeMask[channels] = m_useEnvelope[chan] ? 0xFF : 0x00;
+        amplitude[channels] = m_amplitude[chan];
+        channels++;
+    }
+    uint32_t i = 0;
+#if AY38910_AVX2
+    const __m256i maxLevel = _mm256_set1_epi32( 65535 );
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i output = _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i *>(outputs + i) ) );
+        __m256i env = _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i *>(envelope + i) ) );
+        __m256i sum = zero;
+        for (int chan = 0; chan < channels; chan++)
+        {
+            __m256i disabled = _mm256_cmpeq_epi32( _mm256_and_si256( output, _mm256_set1_epi32( enableMask[chan] ) ), zero );
+            __m256i volume = envelopeMask[chan] ? env : _mm256_set1_epi32( amplitude[chan] );
+            __m256i index = _mm256_andnot_si256( disabled, volume );
+            // Level table has extra entry, so 32-bit reads of the last level stay inside the table
+            __m256i level = _mm256_and_si256( _mm256_i32gather_epi32( reinterpret_cast<const int *>(m_levelTable), index, 2 ),
+                                              maxLevel );
+            if ( stem[chan] )
+            {
+                _mm_storeu_si128( reinterpret_cast<__m128i *>(stem[chan] + i),
+                                  _mm_packus_epi32( _mm256_castsi256_si128( level ), _mm256_extracti128_si256( level, 1 ) ) );
+            }
+            sum = _mm256_add_epi32( sum, level );
+        }
+        sum = _mm256_min_epi32( sum, maxLevel );
+        sum = _mm256_or_si256( _mm256_slli_epi32( sum, 16 ), sum );
+        _mm256_storeu_si256( reinterpret_cast<__m256i *>(buffer + i), sum );
+    }
+#elif AY38910_SSE2
+    const __m128i maxLevel = _mm_set1_epi32( 65535 );
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i output = _mm_set_epi32( outputs[i + 3], outputs[i + 2], outputs[i + 1], outputs[i] );
+        __m128i env = _mm_set_epi32( envelope[i + 3], envelope[i + 2], envelope[i + 1], envelope[i] );
+        __m128i sum = zero;
+        for (int chan = 0; chan < channels; chan++)
+        {
+            __m128i disabled = _mm_cmpeq_epi32( _mm_and_si128( output, _mm_set1_epi32( enableMask[chan] ) ), zero );
+            __m128i volume = envelopeMask[chan] ? env : _mm_set1_epi32( amplitude[chan] );
+            uint32_t index[4];
+            _mm_storeu_si128( reinterpret_cast<__m128i *>(index), _mm_andnot_si128( disabled, volume ) );
+            // SSE2 has no gather instruction
+            sum = _mm_add_epi32( sum, _mm_set_epi32( m_levelTable[index[3]], m_levelTable[index[2]],
+                                                     m_levelTable[index[1]], m_levelTable[index[0]] ) );
+            for (int n = 0; stem[chan] && n < 4; n++) stem[chan][i + n] = m_levelTable[index[n]];
+        }
+        __m128i clip = _mm_cmpgt_epi32( sum, maxLevel );
+        sum = _mm_or_si128( _mm_and_si128( clip, maxLevel ), _mm_andnot_si128( clip, sum ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i *>(buffer + i), _mm_or_si128( _mm_slli_epi32( sum, 16 ), sum ) );
+    }
+#elif AY38910_NEON
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint32x4_t output = { outputs[i], outputs[i + 1], outputs[i + 2], outputs[i + 3] };
+        const uint32x4_t env = { envelope[i], envelope[i + 1], envelope[i + 2], envelope[i + 3] };
+        uint32x4_t sum = vdupq_n_u32( 0 );
+        for (int chan = 0; chan < channels; chan++)
+        {
+            uint32x4_t enabled = vtstq_u32( output, vdupq_n_u32( enableMask[chan] ) );
+            uint32x4_t volume = envelopeMask[chan] ? env : vdupq_n_u32( amplitude[chan] );
+            uint32_t index[4];
+            vst1q_u32( index, vandq_u32( enabled, volume ) );
+            const uint32x4_t level = { m_levelTable[index[0]], m_levelTable[index[1]],
+                                       m_levelTable[index[2]], m_levelTable[index[3]] };
+            for (int n = 0; stem[chan] && n < 4; n++) stem[chan][i + n] = m_levelTable[index[n]];
+            sum = vaddq_u32( sum, level );
+        }
+        sum = vminq_u32( sum, vdupq_n_u32( 65535 ) );
+        vst1q_u32( buffer + i, vorrq_u32( vshlq_n_u32( sum, 16 ), sum ) );
+    }
+#endif
+    for (; i < count; i++)
+    {
+        uint32_t sum = 0;
+        for (int chan = 0; chan < channels; chan++)
+        {
+            uint32_t index = (outputs[i] & enableMask[chan]) ? ((envelope[i] & envelopeMask[chan]) |
+                                                                (amplitude[chan] & ~envelopeMask[chan])) : 0;
+            if ( stem[chan] ) stem[chan][i] = m_levelTable[index];
+            sum += m_levelTable[index];
+        }
+        if ( sum > 65535 ) sum = 65535;
+        buffer[i] = (sum << 16) | sum;
+    }
+}
@@ -0,0 +1,416 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chips/ay-3-8910_batch.h"
+
+#include <string.h>
+
+#define AY38910_BATCH_DEBUG 1
+
+#if AY38910_BATCH_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER 1
+#endif
+#include "../vgm_logger.h"
+
+/*
+ * Lane vectors: all lanes of the vector run the same operation. Comparisons return masks
+ * (0 or 0xFFFFFFFF in each lane). Scalar build uses vectors of one lane.
+ */
+#if !defined(AY38910_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+
+#define AY38910_BATCH_WIDTH 8
+typedef __m256i LaneVector;
+
+static inline LaneVector laneLoad(const uint32_t *p) { return _mm256_loadu_si256( reinterpret_cast<const __m256i *>(p) ); }
+static inline void laneStore(uint32_t *p, LaneVector a) { _mm256_storeu_si256( reinterpret_cast<__m256i *>(p), a ); }
+static inline LaneVector laneSet(uint32_t value) { return _mm256_set1_epi32( value ); }
+static inline LaneVector laneAdd(LaneVector a, LaneVector b) { return _mm256_add_epi32( a, b ); }
+static inline LaneVector laneSub(LaneVector a, LaneVector b) { return _mm256_sub_epi32( a, b ); }
+static inline LaneVector laneAnd(LaneVector a, LaneVector b) { return _mm256_and_si256( a, b ); }
+static inline LaneVector laneAndNot(LaneVector a, LaneVector b) { return _mm256_andnot_si256( a, b ); }
+static inline LaneVector laneOr(LaneVector a, LaneVector b) { return _mm256_or_si256( a, b ); }
+static inline LaneVector laneXor(LaneVector a, LaneVector b) { return _mm256_xor_si256( a, b ); }
+template <int bits> static inline LaneVector laneShiftLeft(LaneVector a) { return _mm256_slli_epi32( a, bits ); }
+template <int bits> static inline LaneVector laneShiftRight(LaneVector a) { return _mm256_srli_epi32( a, bits ); }
+/** Unsigned a >= b */
+static inline LaneVector laneGreaterEqual(LaneVector a, LaneVector b) { return _mm256_cmpeq_epi32( _mm256_max_epu32( a, b ), a ); }
+static inline LaneVector laneMin(LaneVector a, LaneVector b) { return _mm256_min_epu32( a, b ); }
+static inline LaneVector laneLookup(const uint32_t *table, LaneVector index)
+{
+    return _mm256_i32gather_epi32( reinterpret_cast<const int *>(table), index, 4 );
+}
+static inline bool laneAny(LaneVector mask) { return !_mm256_testz_si256( mask, mask ); }
+
+#elif !defined(AY38910_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+
+#define AY38910_BATCH_WIDTH 4
+typedef __m128i LaneVector;
+
+static inline LaneVector laneLoad(const uint32_t *p) { return _mm_loadu_si128( reinterpret_cast<const __m128i *>(p) ); }
+static inline void laneStore(uint32_t *p, LaneVector a) { _mm_storeu_si128( reinterpret_cast<__m128i *>(p), a ); }
+static inline LaneVector laneSet(uint32_t value) { return _mm_set1_epi32( value ); }
+static inline LaneVector laneAdd(LaneVector a, LaneVector b) { return _mm_add_epi32( a, b ); }
+static inline LaneVector laneSub(LaneVector a, LaneVector b) { return _mm_sub_epi32( a, b ); }
+static inline LaneVector laneAnd(LaneVector a, LaneVector b) { return _mm_and_si128( a, b ); }
+static inline LaneVector laneAndNot(LaneVector a, LaneVector b) { return _mm_andnot_si128( a, b ); }
+static inline LaneVector laneOr(LaneVector a, LaneVector b) { return _mm_or_si128( a, b ); }
+static inline LaneVector laneXor(LaneVector a, LaneVector b) { return _mm_xor_si128( a, b ); }
+template <int bits> static inline LaneVector laneShiftLeft(LaneVector a) { return _mm_slli_epi32( a, bits ); }
+template <int bits> static inline LaneVector laneShiftRight(LaneVector a) { return _mm_srli_epi32( a, bits ); }
+/** Unsigned a >= b, SSE2 has signed compare only, so sign bits are flipped */
+static inline LaneVector laneGreaterEqual(LaneVector a, LaneVector b)
+{
+    const __m128i sign = _mm_set1_epi32( 0x80000000 );
+    return _mm_xor_si128( _mm_cmpgt_epi32( _mm_xor_si128( b, sign ), _mm_xor_si128( a, sign ) ), _mm_set1_epi32( -1 ) );
+}
+/** Minimum of values below 2^31 */
+static inline LaneVector laneMin(LaneVector a, LaneVector b)
+{
+    __m128i greater = _mm_cmpgt_epi32( a, b );
+    return _mm_or_si128( _mm_and_si128( greater, b ), _mm_andnot_si128( greater, a ) );
+}
+static inline LaneVector laneLookup(const uint32_t *table, LaneVector index)
+{
+    // SSE2 has no gather instruction
+    uint32_t values[4];
+    _mm_storeu_si128( reinterpret_cast<__m128i *>(values), index );
+    return _mm_set_epi32( table[values[3]], table[values[2]], table[values[1]], table[values[0]] );
+}
+static inline bool laneAny(LaneVector mask) { return _mm_movemask_epi8( mask ) != 0; }
+
+#elif !defined(AY38910_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+
+#define AY38910_BATCH_WIDTH 4
+typedef uint32x4_t LaneVector;
+
+static inline LaneVector laneLoad(const uint32_t *p) { return vld1q_u32( p ); }
+static inline void laneStore(uint32_t *p, LaneVector a) { vst1q_u32( p, a ); }
+static inline LaneVector laneSet(uint32_t value) { return vdupq_n_u32( value ); }
+static inline LaneVector laneAdd(LaneVector a, LaneVector b) { return vaddq_u32( a, b ); }
+static inline LaneVector laneSub(LaneVector a, LaneVector b) { return vsubq_u32( a, b ); }
+static inline LaneVector laneAnd(LaneVector a, LaneVector b) { return vandq_u32( a, b ); }
+static inline LaneVector laneAndNot(LaneVector a, LaneVector b) { return vbicq_u32( b, a ); }
+static inline LaneVector laneOr(LaneVector a, LaneVector b) { return vorrq_u32( a, b ); }
+static inline LaneVector laneXor(LaneVector a, LaneVector b) { return veorq_u32( a, b ); }
+template <int bits> static inline LaneVector laneShiftLeft(LaneVector a) { return vshlq_n_u32( a, bits ); }
+template <int bits> static inline LaneVector laneShiftRight(LaneVector a) { return vshrq_n_u32( a, bits ); }
+static inline LaneVector laneGreaterEqual(LaneVector a, LaneVector b) { return vcgeq_u32( a, b ); }
+static inline LaneVector laneMin(LaneVector a, LaneVector b) { return vminq_u32( a, b ); }
+static inline LaneVector laneLookup(const uint32_t *table, LaneVector index)
+{
+    uint32_t values[4];
+    vst1q_u32( values, index );
+    const uint32x4_t result = { table[values[0]], table[values[1]], table[values[2]], table[values[3]] };
+    return result;
+}
+static inline bool laneAny(LaneVector mask) { return vmaxvq_u32( mask ) != 0; }
+
+#else
+
+#define AY38910_BATCH_WIDTH 1
+typedef uint32_t LaneVector;
+
+static inline LaneVector laneLoad(const uint32_t *p) { return *p; }
+static inline void laneStore(uint32_t *p, LaneVector a) { *p = a; }
+static inline LaneVector laneSet(uint32_t value) { return value; }
+static inline LaneVector laneAdd(LaneVector a, LaneVector b) { return a + b; }
+static inline LaneVector laneSub(LaneVector a, LaneVector b) { return a - b; }
+static inline LaneVector laneAnd(LaneVector a, LaneVector b) { return a & b; }
+static inline LaneVector laneAndNot(LaneVector a, LaneVector b) { return ~a & b; }
+static inline LaneVector laneOr(LaneVector a, LaneVector b) { return a | b; }
+static inline LaneVector laneXor(LaneVector a, LaneVector b) { return a ^ b; }
+template <int bits> static inline LaneVector laneShiftLeft(LaneVector a) { return a << bits; }
+template <int bits> static inline LaneVector laneShiftRight(LaneVector a) { return a >> bits; }
+static inline LaneVector laneGreaterEqual(LaneVector a, LaneVector b) { return a >= b ? 0xFFFFFFFF : 0; }
+static inline LaneVector laneMin(LaneVector a, LaneVector b) { return a < b ? a : b; }
+static inline LaneVector laneLookup(const uint32_t *table, LaneVector index) { return table[index]; }
+static inline bool laneAny(LaneVector mask) { return mask != 0; }
+
+#endif
+
+#if AY38910_BATCH_LANES % AY38910_BATCH_WIDTH
+#error AY38910_BATCH_LANES must be a multiple of SIMD width
+#endif
+
+/** Selects a where mask is set, b otherwise */
+static inline LaneVector laneSelect(LaneVector mask, LaneVector a, LaneVector b)
+{
+    return laneOr( laneAnd( mask, a ), laneAndNot( mask, b ) );
+}
+
+/** Same as advancePhase() of AY38910: returns mask of lanes, where period is passed */
+static inline LaneVector laneAdvancePhase(LaneVector &counter, LaneVector scale, LaneVector period)
+{
+    counter = laneAdd( counter, scale );
+    LaneVector overflow = laneGreaterEqual( counter, period );
+    counter = laneSub( counter, laneAnd( overflow, period ) );
+    counter = laneAndNot( laneGreaterEqual( counter, period ), counter );
+    return overflow;
+}
+
+static inline uint32_t laneMask(bool value)
+{
+    return value ? 0xFFFFFFFF : 0;
+}
+
+AY38910Batch::AY38910Batch()
+{
+    for (int lane = 0; lane < AY38910_BATCH_LANES; lane++)
+    {
+        m_levelBase[lane] = lane * 32;
+    }
+}
+
+bool AY38910Batch::setChip(int lane, AY38910 *chip)
+{
+    if ( chip && chip->m_decimator.isEnabled() )
+    {
+        LOGE( "Only CHIP_QUALITY_FAST chips can be rendered in batch\n" );
+        return false;
+    }
+    m_chips[lane] = chip;
+    loadLane( lane );
+    return true;
+}
+
+void AY38910Batch::saveLane(int lane)
+{
+    AY38910 *chip = m_chips[lane];
+    if ( !chip )
+    {
+        return;
+    }
+    for (int chan = 0; chan < 3; chan++)
+    {
+        chip->m_counter[chan] = m_counter[chan][lane];
+        chip->m_channelOutput[chan] = m_toneOutput[chan][lane] != 0;
+    }
+    chip->m_counterNoise = m_counterNoise[lane];
+    chip->m_noiseRecalc = m_noiseRecalc[lane] != 0;
+    chip->m_noiseHigh = m_noiseHigh[lane] != 0;
+    chip->m_rng = m_rng[lane];
+    chip->m_counterEnv = m_counterEnv[lane];
+    chip->m_holding = m_holding[lane] != 0;
+    chip->m_envStep = m_envStep[lane];
+    chip->m_envVolume = m_envVolume[lane];
+}
+
+void AY38910Batch::loadLane(int lane)
+{
+    const AY38910 *chip = m_chips[lane];
+    if ( !chip )
+    {
+        // Silent lane: level table is empty
+        memset( m_levelTable + m_levelBase[lane], 0, 32 * sizeof(uint32_t) );
+        return;
+    }
+    const uint8_t mask = chip->m_channelMask;
+    for (int chan = 0; chan < 3; chan++)
+    {
+        const bool enabled = mask & (1 << chan);
+        m_counter[chan][lane] = chip->m_counter[chan];
+        m_period[chan][lane] = chip->m_period[chan] << AY38910_PHASE_BITS;
+        m_toneOutput[chan][lane] = laneMask( chip->m_channelOutput[chan] );
+        m_toneEnable[chan][lane] = laneMask( enabled && !((chip->m_mixer >> chan) & 1) );
+        m_noiseEnable[chan][lane] = laneMask( enabled && (mask & AY38910_CHANNEL_NOISE) &&
+                                              !((chip->m_mixer >> (3 + chan)) & 1) );
+        m_useEnvelope[chan][lane] = laneMask( chip->m_useEnvelope[chan] );
+        m_amplitude[chan][lane] = chip->m_amplitude[chan];
+    }
+    m_counterNoise[lane] = chip->m_counterNoise;
+    m_periodNoise[lane] = chip->m_periodNoise << AY38910_PHASE_BITS;
+    m_noiseRecalc[lane] = laneMask( chip->m_noiseRecalc );
+    m_noiseHigh[lane] = laneMask( chip->m_noiseHigh );
+    m_rng[lane] = chip->m_rng;
+    m_toneScale[lane] = chip->m_toneFrequencyScale;
+    m_envScale[lane] = chip->m_envFrequencyScale;
+
+    m_counterEnv[lane] = static_cast<uint32_t>( chip->m_counterEnv );
+    m_periodE[lane] = chip->m_periodE << AY38910_PHASE_BITS;
+    m_holding[lane] = laneMask( chip->m_holding );
+    m_envStep[lane] = chip->m_envStep;
+    m_envVolume[lane] = chip->m_envVolume;
+    m_envStepSize[lane] = chip->m_ymFamily ? 1 : 2;
+    m_envHalfLevel[lane] = laneMask( !chip->m_ymFamily );
+    for (int segment = 0; segment < 2; segment++)
+    {
+        // Segments either go down, go up, or hold the level
+        uint8_t first = AY38910::envelopeLevel( chip->m_envelopeReg, segment * 32 );
+        uint8_t last = AY38910::envelopeLevel( chip->m_envelopeReg, segment * 32 + 31 );
+        m_segmentXor[segment][lane] = first;
+        m_segmentAnd[segment][lane] = first != last ? 31 : 0;
+        m_segmentOr[segment][lane] = first == last ? first : 0;
+        m_segmentHold[segment][lane] = laneMask( first == last );
+    }
+    for (int level = 0; level < 32; level++)
+    {
+        m_levelTable[ m_levelBase[lane] + level ] = chip->m_levelTable[level];
+    }
+}
+
+void AY38910Batch::getSamples(uint32_t *const *buffers, uint32_t count)
+{
+    for (int first = 0; first < AY38910_BATCH_LANES; first += AY38910_BATCH_WIDTH)
+    {
+        for (int lane = first; lane < first + AY38910_BATCH_WIDTH; lane++)
+        {
+            if ( m_chips[lane] )
+            {
+                renderLanes( first, buffers, count );
+                break;
+            }
+        }
+    }
+}
+
+void AY38910Batch::renderLanes(int first, uint32_t *const *buffers, uint32_t count)
+{
+    const LaneVector levelBase = laneLoad( m_levelBase + first );
+    LaneVector counter[3], period[3], toneOutput[3];
+    LaneVector toneEnable[3], noiseEnable[3], useEnvelope[3], amplitudeLevel[3];
+    for (int chan = 0; chan < 3; chan++)
+    {
+        counter[chan] = laneLoad( m_counter[chan] + first );
+        period[chan] = laneLoad( m_period[chan] + first );
+        toneOutput[chan] = laneLoad( m_toneOutput[chan] + first );
+        toneEnable[chan] = laneLoad( m_toneEnable[chan] + first );
+        noiseEnable[chan] = laneLoad( m_noiseEnable[chan] + first );
+        useEnvelope[chan] = laneLoad( m_useEnvelope[chan] + first );
+        // Amplitude does not change between register writes, so its level is taken once
+        amplitudeLevel[chan] = laneLookup( m_levelTable, laneAdd( levelBase, laneLoad( m_amplitude[chan] + first ) ) );
+    }
+    LaneVector counterNoise = laneLoad( m_counterNoise + first );
+    const LaneVector periodNoise = laneLoad( m_periodNoise + first );
+    LaneVector noiseRecalc = laneLoad( m_noiseRecalc + first );
+    LaneVector noiseHigh = laneLoad( m_noiseHigh + first );
+    LaneVector rng = laneLoad( m_rng + first );
+    const LaneVector toneScale = laneLoad( m_toneScale + first );
+    const LaneVector envScale = laneLoad( m_envScale + first );
+
+    LaneVector counterEnv = laneLoad( m_counterEnv + first );
+    const LaneVector periodE = laneLoad( m_periodE + first );
+    LaneVector holding = laneLoad( m_holding + first );
+    LaneVector envStep = laneLoad( m_envStep + first );
+    LaneVector envVolume = laneLoad( m_envVolume + first );
+    LaneVector envLevel = laneLookup( m_levelTable, laneAdd( levelBase, envVolume ) );
+    const LaneVector envStepSize = laneLoad( m_envStepSize + first );
+    const LaneVector envHalfLevel = laneLoad( m_envHalfLevel + first );
+    LaneVector segmentXor[2], segmentAnd[2], segmentOr[2], segmentHold[2];
+    for (int segment = 0; segment < 2; segment++)
+    {
+        segmentXor[segment] = laneLoad( m_segmentXor[segment] + first );
+        segmentAnd[segment] = laneLoad( m_segmentAnd[segment] + first );
+        segmentOr[segment] = laneLoad( m_segmentOr[segment] + first );
+        segmentHold[segment] = laneLoad( m_segmentHold[segment] + first );
+    }
+
+    const LaneVector zero = laneSet( 0 );
+    const LaneVector one = laneSet( 1 );
+    // Envelope is not updated, if its period is 0
+    const LaneVector envEnabled = laneAndNot( laneGreaterEqual( zero, periodE ), laneSet( 0xFFFFFFFF ) );
+    uint32_t *output[AY38910_BATCH_WIDTH];
+    for (int n = 0; n < AY38910_BATCH_WIDTH; n++)
+    {
+        output[n] = m_chips[first + n] ? buffers[first + n] : nullptr;
+    }
+
+    // Samples of all lanes are stored together, and copied to lane buffers after each block
+    uint32_t block[AY38910_BLOCK_SAMPLES][AY38910_BATCH_WIDTH];
+    for (uint32_t position = 0; position < count; position += AY38910_BLOCK_SAMPLES)
+    {
+        uint32_t size = count - position < AY38910_BLOCK_SAMPLES ? count - position : AY38910_BLOCK_SAMPLES;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            for (int chan = 0; chan < 3; chan++)
+            {
+                toneOutput[chan] = laneXor( toneOutput[chan], laneAdvancePhase( counter[chan], toneScale, period[chan] ) );
+            }
+
+            // Noise generator steps on every second noise period: 17-bit LFSR, bit0 XOR bit3 is shifted in
+            LaneVector noiseStep = laneAdvancePhase( counterNoise, toneScale, periodNoise );
+            noiseRecalc = laneXor( noiseRecalc, noiseStep );
+            noiseStep = laneAnd( noiseStep, noiseRecalc );
+            if ( laneAny( noiseStep ) )
+            {
+                LaneVector feedback = laneAnd( laneXor( rng, laneShiftRight<3>( rng ) ), one );
+                rng = laneSelect( noiseStep, laneOr( laneShiftRight<1>( rng ), laneShiftLeft<16>( feedback ) ), rng );
+                noiseHigh = laneSelect( noiseStep, laneSub( zero, laneAnd( rng, one ) ), noiseHigh );
+            }
+
+            // Envelope counter may pass 2^32, carry means that period is passed
+            LaneVector active = laneAndNot( holding, envEnabled );
+            LaneVector envAdd = laneAnd( envScale, active );
+            counterEnv = laneAdd( counterEnv, envAdd );
+            LaneVector carry = laneAndNot( laneGreaterEqual( counterEnv, envAdd ), active );
+            LaneVector envTick = laneAnd( laneOr( carry, laneGreaterEqual( counterEnv, periodE ) ), active );
+            if ( laneAny( envTick ) )
+            {
+                counterEnv = laneSub( counterEnv, laneAnd( envTick, periodE ) );
+                counterEnv = laneAndNot( laneAnd( envTick, laneGreaterEqual( counterEnv, periodE ) ), counterEnv );
+                envStep = laneAnd( laneAdd( envStep, laneAnd( envTick, envStepSize ) ), laneSet( 63 ) );
+                LaneVector second = laneGreaterEqual( envStep, laneSet( 32 ) );
+                LaneVector level = laneOr( laneAnd( laneXor( laneAnd( envStep, laneSet( 31 ) ),
+                                                             laneSelect( second, segmentXor[1], segmentXor[0] ) ),
+                                                    laneSelect( second, segmentAnd[1], segmentAnd[0] ) ),
+                                           laneSelect( second, segmentOr[1], segmentOr[0] ) );
+                level = laneSelect( envHalfLevel, laneShiftRight<1>( level ), level );
+                envVolume = laneSelect( envTick, level, envVolume );
+                envLevel = laneLookup( m_levelTable, laneAdd( levelBase, envVolume ) );
+                holding = laneOr( holding, laneAnd( envTick, laneSelect( second, segmentHold[1], segmentHold[0] ) ) );
+            }
+
+            // Level 0 of the level table is silence, so disabled channels are masked out
+            LaneVector sum = zero;
+            for (int chan = 0; chan < 3; chan++)
+            {
+                LaneVector enabled = laneOr( laneAnd( toneOutput[chan], toneEnable[chan] ),
+                                             laneAnd( noiseHigh, noiseEnable[chan] ) );
+                sum = laneAdd( sum, laneAnd( enabled, laneSelect( useEnvelope[chan], envLevel, amplitudeLevel[chan] ) ) );
+            }
+            sum = laneMin( sum, laneSet( 65535 ) );
+            laneStore( block[i], laneOr( laneShiftLeft<16>( sum ), sum ) );
+        }
+        for (int n = 0; n < AY38910_BATCH_WIDTH; n++)
+        {
+            for (uint32_t i = 0; output[n] && i < size; i++) output[n][position + i] = block[i][n];
+        }
+    }
+
+    for (int chan = 0; chan < 3; chan++)
+    {
+        laneStore( m_counter[chan] + first, counter[chan] );
+        laneStore( m_toneOutput[chan] + first, toneOutput[chan] );
+    }
+    laneStore( m_counterNoise + first, counterNoise );
+    laneStore( m_noiseRecalc + first, noiseRecalc );
+    laneStore( m_noiseHigh + first, noiseHigh );
+    laneStore( m_rng + first, rng );
+    laneStore( m_counterEnv + first, counterEnv );
+    laneStore( m_holding + first, holding );
+    laneStore( m_envStep + first, envStep );
+    laneStore( m_envVolume + first, envVolume );
+}
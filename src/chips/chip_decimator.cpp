@@ -0,0 +1,283 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chips/chip_decimator.h"
+#include "chips/state_hash.h"
+
+#include <math.h>
+#include <new>
+#include <string.h>
+
+enum
+{
+    DECIMATOR_OFF = 0,
+    DECIMATOR_HALFBAND = 1,
+    DECIMATOR_BOX = 2,
+    DECIMATOR_SINC = 3,
+};
+
+/** Cutoff of sinc filter in output rate units and Kaiser window beta (about 70 dB stopband) */
+#define SINC_CUTOFF 0.47
+#define SINC_KAISER_BETA 7.0
+
+static double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/**
+ * Creates step response table of the sinc filter: entry [phase][slot] is the response minus 1
+ * (16 fraction bits) of output sample in slot, when input steps by 1 at the position phase /
+ * CHIP_DECIMATOR_SINC_PHASES before the end of current output sample period. Slot 0 is the
+ * output, completed with current period, and it is delayed by CHIP_DECIMATOR_SINC_TAPS / 2.
+ */
+static int32_t *createStepTable()
+{
+    const int taps = CHIP_DECIMATOR_SINC_TAPS;
+    const int phases = CHIP_DECIMATOR_SINC_PHASES;
+    const int points = taps * phases;
+    int32_t *table = new (std::nothrow) int32_t[(phases + 1) * taps];
+    double *response = new (std::nothrow) double[points + 1];
+    if ( table == nullptr || response == nullptr )
+    {
+        delete[] table;
+        delete[] response;
+        return nullptr;
+    }
+    // Integrate impulse response over [-taps / 2, taps / 2] output samples
+    const int substeps = 16;
+    const double pi = 3.14159265358979323846;
+    response[0] = 0.0;
+    for (int i = 0; i < points; i++)
+    {
+        double sum = 0.0;
+        for (int k = 0; k < substeps; k++)
+        {
+            double t = (i + (k + 0.5) / substeps) / phases - taps / 2.0;
+            double x = 2.0 * pi * SINC_CUTOFF * t;
+            double sinc = x == 0.0 ? 1.0 : sin( x ) / x;
+            double r = 2.0 * t / taps;
+            sum += sinc * besselI0( SINC_KAISER_BETA * sqrt( 1.0 - r * r ) );
+        }
+        response[i + 1] = response[i] + sum;
+    }
+    for (int phase = 0; phase <= phases; phase++)
+    {
+        for (int slot = 0; slot < taps; slot++)
+        {
+            int index = slot * phases + phase;
+            if ( index > points ) index = points;
+            table[phase * taps + slot] = static_cast<int32_t>( lround( (response[index] / response[points] - 1.0) * 65536.0 ) );
+        }
+    }
+    delete[] response;
+    return table;
+}
+
+static const int32_t *stepTable()
+{
+    static const int32_t *table = createStepTable();
+    return table;
+}
+
+static inline uint32_t stereoSample(int32_t level)
+{
+    if ( level < 0 ) level = 0;
+    if ( level > 65535 ) level = 65535;
+    return (static_cast<uint32_t>(level) << 16) | static_cast<uint32_t>(level);
+}
+
+void ChipDecimator::disable()
+{
+    m_mode = DECIMATOR_OFF;
+    reset();
+}
+
+void ChipDecimator::setHalfband(uint8_t stages)
+{
+    if ( stages > CHIP_DECIMATOR_HALFBAND_STAGES ) stages = CHIP_DECIMATOR_HALFBAND_STAGES;
+    m_mode = stages ? DECIMATOR_HALFBAND : DECIMATOR_OFF;
+    m_stages = stages;
+    reset();
+}
+
+void ChipDecimator::setRates(uint32_t inputRate, uint32_t outputRate)
+{
+    m_mode = DECIMATOR_OFF;
+    if ( inputRate > outputRate )
+    {
+        m_mode = stepTable() ? DECIMATOR_SINC : DECIMATOR_BOX;
+    }
+    m_inputRate = inputRate;
+    m_outputRate = outputRate;
+    reset();
+}
+
+void ChipDecimator::reset()
+{
+    memset( m_history, 0, sizeof(m_history) );
+    m_phase = 0;
+    m_remain = m_inputRate;
+    m_sum = 0;
+    m_level = 0;
+    memset( m_deviation, 0, sizeof(m_deviation) );
+}
+
+void ChipDecimator::follow(const ChipDecimator &source)
+{
+    *this = source;
+    memset( m_history, 0, sizeof(m_history) );
+    m_sum = 0;
+    m_level = 0;
+    memset( m_deviation, 0, sizeof(m_deviation) );
+}
+
+uint32_t ChipDecimator::getInputCount(uint32_t count) const
+{
+    if ( m_mode == DECIMATOR_HALFBAND )
+    {
+        return count << m_stages;
+    }
+    if ( (m_mode == DECIMATOR_BOX || m_mode == DECIMATOR_SINC) && count )
+    {
+        uint64_t units = m_remain + static_cast<uint64_t>( count - 1 ) * m_inputRate;
+        return static_cast<uint32_t>( (units + m_outputRate - 1) / m_outputRate );
+    }
+    return count;
+}
+
+uint32_t ChipDecimator::process(const uint32_t *input, uint32_t count, uint32_t *output)
+{
+    uint32_t written = 0;
+    switch ( m_mode )
+    {
+        case DECIMATOR_HALFBAND:
+            for (uint32_t i = 0; i < count; i++)
+            {
+                written += putHalfband( input[i] & 0xFFFF, output + written );
+            }
+            break;
+        case DECIMATOR_BOX:
+            for (uint32_t i = 0; i < count; i++)
+            {
+                written += putBox( input[i] & 0xFFFF, output + written );
+            }
+            break;
+        case DECIMATOR_SINC:
+            for (uint32_t i = 0; i < count; i++)
+            {
+                written += putSinc( input[i] & 0xFFFF, output + written );
+            }
+            break;
+        default:
+            if ( output != input ) memcpy( output, input, count * sizeof(uint32_t) );
+            written = count;
+            break;
+    }
+    return written;
+}
+
+uint32_t ChipDecimator::putHalfband(int32_t sample, uint32_t *output)
+{
+    for (uint8_t stage = 0; stage < m_stages; stage++)
+    {
+        int32_t *h = m_history[stage];
+        memmove( h, h + 1, 6 * sizeof(int32_t) );
+        h[6] = sample;
+        m_phase ^= 1 << stage;
+        if ( m_phase & (1 << stage) )
+        {
+            // Every second input sample gives output sample
+            return 0;
+        }
+        // Halfband filter [-1, 0, 9, 16, 9, 0, -1] / 32
+        sample = (16 * h[3] + 9 * (h[2] + h[4]) - h[0] - h[6]) >> 5;
+    }
+    *output = stereoSample( sample );
+    return 1;
+}
+
+uint32_t ChipDecimator::putBox(uint32_t sample, uint32_t *output)
+{
+    if ( m_remain > m_outputRate )
+    {
+        m_sum += static_cast<uint64_t>( sample ) * m_outputRate;
+        m_remain -= m_outputRate;
+        return 0;
+    }
+    // Input sample crosses the end of output sample period, split it between two outputs
+    m_sum += static_cast<uint64_t>( sample ) * m_remain;
+    *output = stereoSample( static_cast<int32_t>( (m_sum + m_inputRate / 2) / m_inputRate ) );
+    uint32_t rest = m_outputRate - m_remain;
+    m_sum = static_cast<uint64_t>( sample ) * rest;
+    m_remain = m_inputRate - rest;
+    return 1;
+}
+
+uint32_t ChipDecimator::putSinc(int32_t sample, uint32_t *output)
+{
+    int32_t delta = sample - m_level;
+    if ( delta )
+    {
+        // Input steps at the start of the sample: m_remain units before the end of output period
+        const int32_t *step = stepTable() + static_cast<uint32_t>(
+            (static_cast<uint64_t>( m_remain ) * CHIP_DECIMATOR_SINC_PHASES + m_inputRate / 2) / m_inputRate ) *
+            CHIP_DECIMATOR_SINC_TAPS;
+        for (int slot = 0; slot < CHIP_DECIMATOR_SINC_TAPS; slot++)
+        {
+            m_deviation[slot] += static_cast<int64_t>( delta ) * step[slot];
+        }
+        m_level = sample;
+    }
+    if ( m_remain > m_outputRate )
+    {
+        m_remain -= m_outputRate;
+        return 0;
+    }
+    m_remain = m_inputRate - (m_outputRate - m_remain);
+    *output = stereoSample( m_level + static_cast<int32_t>( (m_deviation[0] + 32768) >> 16 ) );
+    memmove( m_deviation, m_deviation + 1, (CHIP_DECIMATOR_SINC_TAPS - 1) * sizeof(int64_t) );
+    m_deviation[CHIP_DECIMATOR_SINC_TAPS - 1] = 0;
+    return 1;
+}
+
+uint64_t ChipDecimator::getStateHash(uint64_t hash) const
+{
+    if ( m_mode == DECIMATOR_OFF )
+    {
+        return hash;
+    }
+    hash = stateHash( m_history, sizeof(m_history), hash );
+    hash = stateHash( &m_phase, sizeof(m_phase), hash );
+    hash = stateHash( &m_remain, sizeof(m_remain), hash );
+    hash = stateHash( &m_level, sizeof(m_level), hash );
+    hash = stateHash( m_deviation, sizeof(m_deviation), hash );
+    return stateHash( &m_sum, sizeof(m_sum), hash );
+}
@@ -24,8 +24,11 @@ SOFTWARE.
 
 #include "chips/nes_apu.h"
 #include "chips/nes_cpu.h"
+#include "chips/state_hash.h"
+#include "chips/noise_lfsr.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #define NES_APU_DEBUG 1
 //#define DEBUG_NES_CPU
@@ -37,11 +40,17 @@ SOFTWARE.
 
 #define NES_CPU_FREQUENCY (1789773)
 #define SAMPLING_RATE  (44100)
-#define CONST_SHIFT_BITS (4)
+/** Fraction bits of channel counters (fixed point cpu ticks) */
+#define CONST_SHIFT_BITS (10)
 
-static constexpr uint32_t counterScaler = ((NES_CPU_FREQUENCY << CONST_SHIFT_BITS) / SAMPLING_RATE);
 static constexpr uint32_t frameCounterPeriod = ((NES_CPU_FREQUENCY << CONST_SHIFT_BITS) / 240 );
 
+static constexpr uint8_t triangleTable[] =
+{
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+};
+
 static constexpr uint8_t lengthLut[] =
 {
     10, 254, 20, 2, 40, 4, 80, 6,
@@ -152,6 +161,7 @@ NesApu::NesApu(NesCpu *cpu)
    : m_cpu( cpu )
 {
     m_volume = 100;
+    setSampleFrequency( SAMPLING_RATE );
     reset();
 }
 
@@ -160,10 +170,43 @@ NesApu::~NesApu()
 }
 
 
+void NesApu::setSampleFrequency(uint32_t sampleFrequency)
+{
+    m_sampleFrequency = sampleFrequency;
+    uint32_t renderFrequency = sampleFrequency;
+    if ( m_quality == CHIP_QUALITY_BALANCED )
+    {
+        renderFrequency <<= CHIP_DECIMATOR_HALFBAND_STAGES;
+        m_decimator.setHalfband( CHIP_DECIMATOR_HALFBAND_STAGES );
+    }
+    else if ( m_quality == CHIP_QUALITY_ACCURATE && NES_CPU_FREQUENCY > sampleFrequency )
+    {
+        // One step per cpu tick
+        renderFrequency = NES_CPU_FREQUENCY;
+        m_decimator.setRates( renderFrequency, sampleFrequency );
+    }
+    else
+    {
+        m_decimator.disable();
+    }
+    m_stemsSynced = false;
+    m_counterScaler = ( (static_cast<uint64_t>(NES_CPU_FREQUENCY) << CONST_SHIFT_BITS) +
+                        renderFrequency / 2 ) / renderFrequency;
+}
+
+void NesApu::setQuality(uint8_t quality)
+{
+    m_quality = quality;
+    setSampleFrequency( m_sampleFrequency );
+}
+
 void NesApu::reset()
 {
     m_shiftNoise = 0x0001;
     m_lastFrameCounter = 0;
+    m_dmcSpanLength = 0;
+    m_decimator.reset();
+    m_stemsSynced = false;
     setVolume( m_volume );
 }
 
@@ -171,15 +214,78 @@ void NesApu::power()
 {
     m_shiftNoise = 0x0001;
     m_lastFrameCounter = 0;
+    m_dmcSpanLength = 0;
+    m_decimator.reset();
+    m_stemsSynced = false;
     setVolume( m_volume );
 }
 
+void NesApu::saveState(NesApuState &state) const
+{
+    memcpy( state.regs, m_regs, sizeof(m_regs) );
+    memcpy( state.chan, m_chan, sizeof(m_chan) );
+    state.lastFrameCounter = m_lastFrameCounter;
+    state.apuFrames = m_apuFrames;
+    state.shiftNoise = m_shiftNoise;
+}
+
+void NesApu::loadState(const NesApuState &state)
+{
+    memcpy( m_regs, state.regs, sizeof(m_regs) );
+    memcpy( m_chan, state.chan, sizeof(m_chan) );
+    m_lastFrameCounter = state.lastFrameCounter;
+    m_apuFrames = state.apuFrames;
+    m_shiftNoise = state.shiftNoise;
+    m_dmcSpanLength = 0;
+}
+
+uint64_t NesApu::getRegistersHash(uint64_t hash) const
+{
+    return stateHash( m_regs, sizeof(m_regs), hash );
+}
+
+uint64_t NesApu::getStateHash() const
+{
+    uint64_t hash = getRegistersHash( STATE_HASH_INIT );
+    // Channel fields are hashed one by one, since padding bytes of the structure are undefined
+    for (const ChannelInfo &chan: m_chan)
+    {
+        const uint32_t values[] =
+        {
+            chan.lenCounter, chan.linearCounter, chan.linearReloadFlag, chan.period, chan.counter,
+            chan.decayCounter, chan.divider, chan.updateEnvelope, chan.envVolume, chan.sequencer,
+            chan.volume, chan.output, chan.sweepCounter, chan.dmcActive, chan.dmcAddr, chan.dmcLen,
+            chan.dmcBuffer, chan.dmcIrqFlag, chan.pendingSamples,
+        };
+        hash = stateHash( values, sizeof(values), hash );
+    }
+    const uint32_t values[] = { m_lastFrameCounter, m_apuFrames, m_shiftNoise };
+    return m_decimator.getStateHash( stateHash( values, sizeof(values), hash ) );
+}
+
+void NesApu::notifyRegisters()
+{
+    if ( !m_observer )
+    {
+        return;
+    }
+    for (uint8_t reg = APU_RECT_VOL1; reg <= APU_DMC_LEN; reg++)
+    {
+        if ( reg != 0x09 && reg != 0x0D ) m_observer->onWrite( CHIP_WRITE_NES_APU, reg, m_regs[reg] );
+    }
+    m_observer->onWrite( CHIP_WRITE_NES_APU, APU_STATUS, m_regs[APU_STATUS] );
+    m_observer->onWrite( CHIP_WRITE_NES_APU, APU_LOW_TIMER, m_regs[APU_LOW_TIMER] );
+}
+
 void NesApu::write(uint16_t reg, uint8_t val)
 {
     uint16_t originReg = reg;
     uint8_t oldVal = val;
     LOGI( "Write 0x%02X to [%04X] reg\n", val, getRegAddress( reg ) );
     reg = getRegIndex(reg);
+    if ( m_observer ) m_observer->onWrite( CHIP_WRITE_NES_APU, reg, val );
+    // Timers of muted channels must be up to date before their registers are changed
+    syncChannels();
     if ( reg < APU_MAX_REG )
     {
         oldVal = m_regs[reg];
@@ -255,8 +361,8 @@ void NesApu::write(uint16_t reg, uint8_t val)
             m_chan[4].volume = val & 0x7F;
             break;
         case APU_DMC_ADDR:
-            break;
         case APU_DMC_LEN:
+            m_dmcSpanLength = 0;
             break;
         case APU_STATUS:
             for(int i=0; i<4; i++)
@@ -273,6 +379,7 @@ void NesApu::write(uint16_t reg, uint8_t val)
                 m_chan[4].dmcAddr = m_regs[APU_DMC_ADDR] * 0x40 + 0xC000;
                 m_chan[4].dmcLen = m_regs[APU_DMC_LEN] * 16 + 1;
                 m_chan[4].dmcIrqFlag = false;
+                m_dmcSpanLength = 0;
             }
             else if (!(m_regs[APU_STATUS] & 0x10))
             {
@@ -325,26 +432,164 @@ uint8_t NesApu::read(uint16_t reg)
 
 uint32_t NesApu::getSample()
 {
-//    m_apuIncrement = counterScaler; /* 40.5 cpu ticks */
+    if ( !m_decimator.isEnabled() )
+    {
+        return renderSample();
+    }
+    m_stemsSynced = false;
+    uint32_t sample = 0;
+    for (uint32_t count = m_decimator.getInputCount( 1 ); count; count--)
+    {
+        uint32_t input = renderSample();
+        m_decimator.process( &input, 1, &sample );
+    }
+    return sample;
+}
+
+void NesApu::getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    if ( !m_decimator.isEnabled() )
+    {
+        for (uint32_t n = 0; n < count; n++)
+        {
+            buffer[n] = renderSample();
+            for (int i = 0; i < NES_APU_STEMS; i++)
+            {
+                if ( stems[i] ) stems[i][n] = getStemLevel( i );
+            }
+        }
+        return;
+    }
+    if ( !m_stemsSynced )
+    {
+        for (int i = 0; i < NES_APU_STEMS; i++) m_stemDecimator[i].follow( m_decimator );
+        m_stemsSynced = true;
+    }
+    for (uint32_t n = 0; n < count; n++)
+    {
+        uint32_t stemSample[NES_APU_STEMS]{};
+        for (uint32_t inputCount = m_decimator.getInputCount( 1 ); inputCount; inputCount--)
+        {
+            uint32_t input = renderSample();
+            m_decimator.process( &input, 1, &buffer[n] );
+            for (int i = 0; i < NES_APU_STEMS; i++)
+            {
+                input = getStemLevel( i );
+                m_stemDecimator[i].process( &input, 1, &stemSample[i] );
+            }
+        }
+        for (int i = 0; i < NES_APU_STEMS; i++)
+        {
+            if ( stems[i] ) stems[i][n] = static_cast<uint16_t>( stemSample[i] );
+        }
+    }
+}
+
+uint32_t NesApu::getStemLevel(int index) const
+{
+    if ( !(m_channelMask & (1 << index)) )
+    {
+        return 0;
+    }
+    return m_chan[index].output > 65535 ? 65535 : m_chan[index].output;
+}
+
+uint32_t NesApu::renderSample()
+{
     updateFrameCounter();
 
-    updateRectChannel(0);
-    updateRectChannel(1);
-    updateTriangleChannel(m_chan[2]);
-    updateNoiseChannel(m_chan[3]);
+    if ( !skipMutedChannel(0) ) updateRectChannel(0);
+    if ( !skipMutedChannel(1) ) updateRectChannel(1);
+    if ( !skipMutedChannel(2) ) updateTriangleChannel(m_chan[2]);
+    if ( !skipMutedChannel(3) ) updateNoiseChannel(m_chan[3]);
     updateDmcChannel(m_chan[4]);
 
     uint32_t sample = 0;
-    sample += m_chan[0].output; // chan 1
-    sample += m_chan[1].output; // chan 2
-    sample += m_chan[2].output; // tri
-    sample += m_chan[3].output; // noise
-    sample += m_chan[4].output; // dmc
+    for (int i = 0; i < 5; i++) // chan 1, chan 2, tri, noise, dmc
+    {
+        if ( m_channelMask & (1 << i) ) sample += m_chan[i].output;
+    }
 
     if ( sample > 65535 ) sample = 65535;
     return sample | (sample << 16);
 }
 
+void NesApu::setChannelMask(uint8_t mask)
+{
+    syncChannels();
+    m_channelMask = mask;
+}
+
+bool NesApu::skipMutedChannel(int index)
+{
+    if ( m_channelMask & (1 << index) )
+    {
+        return false;
+    }
+    // Envelope, length and linear counters change only on frame counter clocks
+    if ( !m_quaterSignal && !m_halfSignal )
+    {
+        m_chan[index].pendingSamples++;
+        return true;
+    }
+    syncChannel( index );
+    return false;
+}
+
+void NesApu::syncChannels()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if ( m_chan[i].pendingSamples ) syncChannel( i );
+    }
+}
+
+void NesApu::syncChannel(int index)
+{
+    ChannelInfo &chan = m_chan[index];
+    uint32_t samples = chan.pendingSamples;
+    if ( !samples )
+    {
+        return;
+    }
+    chan.pendingSamples = 0;
+    // Same conditions, as update functions check before running the timer
+    bool running = (m_regs[APU_STATUS] & (1 << index)) && chan.lenCounter;
+    uint32_t increment = m_counterScaler << 3;
+    if ( index < 2 )
+    {
+        running = running && chan.period >= (8 << (CONST_SHIFT_BITS + 4)) &&
+                  chan.period <= (0x7FF << (CONST_SHIFT_BITS + 4));
+    }
+    else if ( index == 2 )
+    {
+        running = running && chan.linearCounter;
+        increment = m_counterScaler << 4;
+    }
+    if ( !running )
+    {
+        return;
+    }
+    uint32_t period = chan.period + (1 << (CONST_SHIFT_BITS + 4));
+    uint64_t counter = chan.counter + static_cast<uint64_t>( increment ) * samples;
+    uint64_t steps = counter / period;
+    chan.counter = static_cast<uint32_t>( counter - steps * period );
+    if ( index < 2 )
+    {
+        chan.sequencer = (chan.sequencer + steps) & 0x07;
+    }
+    else if ( index == 2 )
+    {
+        chan.sequencer = (chan.sequencer + steps) & 0x1F;
+        if ( steps ) chan.volume = triangleTable[ chan.sequencer ];
+    }
+    else
+    {
+        m_shiftNoise = lfsrAdvance( m_shiftNoise, 15, ( m_regs[APU_NOISE_FREQ] & NOISE_MODE_MASK ) ? 6 : 1,
+                                    static_cast<uint32_t>( steps ) );
+    }
+}
+
 //--------------
 //Square Channel
 //--------------
@@ -468,7 +713,7 @@ void NesApu::updateRectChannel(int i)
         return;
     }
 
-    chan.counter += counterScaler << 3;
+    chan.counter += m_counterScaler << 3;
     while ( chan.counter >= chan.period + (1 <<  (CONST_SHIFT_BITS + 4)) )
     {
         chan.sequencer++;
@@ -498,11 +743,6 @@ void NesApu::updateRectChannel(int i)
 
 void NesApu::updateTriangleChannel(ChannelInfo &chan)
 {
-    static constexpr uint8_t triangleTable[] =
-    {
-        0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
-        15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
-    };
     bool disabled = !(m_regs[APU_STATUS] & TRI_ENABLE_MASK);
 
     if (disabled)
@@ -535,7 +775,7 @@ void NesApu::updateTriangleChannel(ChannelInfo &chan)
         return;
     }
 
-    chan.counter += counterScaler << 4;
+    chan.counter += m_counterScaler << 4;
     while ( chan.counter >= ( chan.period + (1 <<  (CONST_SHIFT_BITS + 4))) )
     {
         chan.sequencer++;
@@ -622,23 +862,15 @@ void NesApu::updateNoiseChannel(ChannelInfo &chan)
         return;
     }
 
-    chan.counter += counterScaler << 3;
-    while ( chan.counter >= chan.period + (1 <<  (CONST_SHIFT_BITS + 4)) )
+    chan.counter += m_counterScaler << 3;
+    uint32_t period = chan.period + (1 <<  (CONST_SHIFT_BITS + 4));
+    if ( chan.counter >= period )
     {
-        uint8_t temp;
-        if ( m_regs[APU_NOISE_FREQ] & NOISE_MODE_MASK )
-        {
-            // 93-bits
-            temp = ((m_shiftNoise >> 6)^m_shiftNoise) & 1;
-        }
-        else
-        {
-            // 32768-bits
-            temp = ((m_shiftNoise >> 1)^m_shiftNoise) & 1;
-        }
-        m_shiftNoise >>= 1;
-        m_shiftNoise |= (temp << 14);
-        chan.counter -= (chan.period + (1 <<  (CONST_SHIFT_BITS + 4)));
+        // All shift register steps of the sample are done at once
+        uint32_t steps = chan.counter / period;
+        chan.counter -= steps * period;
+        // 93-bits sequence in short mode, 32767-bits otherwise
+        m_shiftNoise = lfsrAdvance( m_shiftNoise, 15, ( m_regs[APU_NOISE_FREQ] & NOISE_MODE_MASK ) ? 6 : 1, steps );
     }
     if ( m_shiftNoise & 0x01 )
     {
@@ -662,35 +894,22 @@ void NesApu::updateNoiseChannel(ChannelInfo &chan)
 
 void NesApu::updateDmcChannel(ChannelInfo &info)
 {
-    if ( info.dmcActive && !info.sequencer )
+    if ( info.dmcActive && !info.sequencer && !loadDmcByte( info ) )
     {
-        if ( info.dmcLen == 0 )
-        {
-            if ( m_regs[APU_DMC_DMA_FREQ] & DMC_LOOP_MASK )
-            {
-                info.dmcAddr = m_regs[APU_DMC_ADDR] * 0x40 + 0xC000;
-                info.dmcLen = m_regs[APU_DMC_LEN] * 16 + 1;
-            }
-            else
-            {
-                info.dmcIrqFlag = !!(m_regs[APU_DMC_DMA_FREQ] & DMC_IRQ_ENABLE_MASK);
-                info.dmcActive = false;
-                info.output = (static_cast<uint32_t>(m_dmcVolTable[15]) * info.volume) >> 7;
-                return;
-            }
-        }
-        info.dmcBuffer = m_cpu->read( info.dmcAddr );
-        info.sequencer = 8;
-        info.dmcAddr++;
-        info.dmcLen--;
-        if ( info.dmcAddr == 0x0000 ) info.dmcAddr = 0x8000;
+        info.output = (static_cast<uint32_t>(m_dmcVolTable[15]) * info.volume) >> 7;
+        return;
     }
 
     if ( info.sequencer )
     {
-        info.counter += counterScaler;
+        info.counter += m_counterScaler;
         while ( info.counter >= info.period )
         {
+            // At low sample frequencies one sample can take more than the whole byte
+            if ( !info.sequencer && !(info.dmcActive && loadDmcByte( info )) )
+            {
+                break;
+            }
             if ( info.dmcBuffer & 1 )
             {
                 if ( info.volume <= 125 ) info.volume += 2;
@@ -708,13 +927,62 @@ void NesApu::updateDmcChannel(ChannelInfo &info)
     return;
 }
 
+bool NesApu::loadDmcByte(ChannelInfo &info)
+{
+    if ( info.dmcLen == 0 )
+    {
+        if ( m_regs[APU_DMC_DMA_FREQ] & DMC_LOOP_MASK )
+        {
+            info.dmcAddr = m_regs[APU_DMC_ADDR] * 0x40 + 0xC000;
+            info.dmcLen = m_regs[APU_DMC_LEN] * 16 + 1;
+            m_dmcSpanLength = 0;
+        }
+        else
+        {
+            info.dmcIrqFlag = !!(m_regs[APU_DMC_DMA_FREQ] & DMC_IRQ_ENABLE_MASK);
+            info.dmcActive = false;
+            return false;
+        }
+    }
+    info.dmcBuffer = fetchDmcByte( info.dmcAddr );
+    info.sequencer = 8;
+    info.dmcAddr++;
+    info.dmcLen--;
+    if ( info.dmcAddr == 0x0000 ) info.dmcAddr = 0x8000;
+    return true;
+}
+
+uint8_t NesApu::fetchDmcByte(uint16_t address)
+{
+    // Sample address range is resolved to the cartridge data once, and not on every byte
+    if ( !m_dmcSpanLength || m_dmcCartridgeVersion != m_cpu->getCartridgeVersion() ||
+         m_dmcMappingVersion != m_dmcCartridge->getMappingVersion() )
+    {
+        m_dmcSpanLength = 0;
+        m_dmcCartridge = m_cpu->getCartridge();
+        m_dmcCartridgeVersion = m_cpu->getCartridgeVersion();
+        if ( m_dmcCartridge )
+        {
+            m_dmcMappingVersion = m_dmcCartridge->getMappingVersion();
+            m_dmcSpan = m_dmcCartridge->getDataSpan( address, m_dmcSpanLength );
+            if ( !m_dmcSpan ) m_dmcSpanLength = 0;
+        }
+    }
+    if ( m_dmcSpanLength )
+    {
+        m_dmcSpanLength--;
+        return *m_dmcSpan++;
+    }
+    return m_cpu->read( address );
+}
+
 void NesApu::updateFrameCounter()
 {
     const uint8_t upperThreshold = (m_regs[APU_LOW_TIMER] & PAL_MODE_MASK) ? 5: 4;
     m_quaterSignal = false;
     m_halfSignal = false;
     m_fullSignal = false;
-    m_lastFrameCounter += counterScaler;
+    m_lastFrameCounter += m_counterScaler;
     if ( m_lastFrameCounter >= frameCounterPeriod )
     {
         m_lastFrameCounter -= frameCounterPeriod;
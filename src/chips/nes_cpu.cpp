@@ -24,9 +24,11 @@ SOFTWARE.
 
 #include "chips/nes_apu.h"
 #include "chips/nes_cpu.h"
+#include "chips/state_hash.h"
 
 #include <malloc.h>
 #include <stdio.h>
+#include <string.h>
 
 #define NES_CPU_DEBUG 1
 //#define DEBUG_NES_CPU
@@ -67,6 +69,7 @@ void NesCpu::insertCartridge( NesCartridge * cartridge )
         m_cartridge = nullptr;
     }
     m_cartridge = cartridge;
+    m_cartridgeVersion++;
 }
 
 NesCartridge *NesCpu::getCartridge()
@@ -90,7 +93,7 @@ uint8_t NesCpu::read(uint16_t address)
 {
     if ( address < 0x2000 )
     {
-        if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(2048));
+        if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(NES_CPU_RAM_SIZE));
         LOGM("[%04X] ==> %02X\n", address, m_ram[address & 0x07FF]);
         return m_ram[address & 0x07FF];
     }
@@ -111,11 +114,17 @@ uint8_t NesCpu::readInternal(uint16_t address)
     return read( address );
 }
 
+uint32_t NesCpu::mapAddress(uint16_t address)
+{
+    return ( address >= 0x4020 && m_cartridge ) ? m_cartridge->mapAddress( address ) : address;
+}
+
 bool NesCpu::write(uint16_t address, uint8_t data)
 {
+    m_writeCount++;
     if ( address < 0x2000 )
     {
-        if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(2048));
+        if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(NES_CPU_RAM_SIZE));
         m_ram[address & 0x07FF] = data;
         LOGM("[%04X] <== %02X\n", address, data);
         return true;
@@ -133,11 +142,56 @@ bool NesCpu::write(uint16_t address, uint8_t data)
     return false;
 }
 
+uint64_t NesCpu::getStateHash()
+{
+    if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(NES_CPU_RAM_SIZE));
+    const uint8_t regs[] = { m_cpu.a, m_cpu.x, m_cpu.y, m_cpu.flags, m_cpu.sp };
+    uint64_t hash = stateHash( regs, sizeof(regs) );
+    hash = stateHash( m_ram, NES_CPU_RAM_SIZE, hash );
+    hash = m_apu.getRegistersHash( hash );
+    if ( m_cartridge ) hash = m_cartridge->getStateHash( hash );
+    return hash;
+}
+
 NesCpuState &NesCpu::cpuState()
 {
     return m_cpu;
 }
 
+uint32_t NesCpu::getStateSize()
+{
+    return sizeof(NesCpuState) + NES_CPU_RAM_SIZE + sizeof(NesApuState) +
+           ( m_cartridge ? m_cartridge->getStateSize() : 0 );
+}
+
+void NesCpu::saveState(uint8_t *buffer)
+{
+    if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(NES_CPU_RAM_SIZE));
+    NesApuState apu{};
+    m_apu.saveState( apu );
+    memcpy( buffer, &m_cpu, sizeof(NesCpuState) );
+    buffer += sizeof(NesCpuState);
+    memcpy( buffer, m_ram, NES_CPU_RAM_SIZE );
+    buffer += NES_CPU_RAM_SIZE;
+    memcpy( buffer, &apu, sizeof(NesApuState) );
+    buffer += sizeof(NesApuState);
+    if ( m_cartridge ) m_cartridge->saveState( buffer );
+}
+
+void NesCpu::loadState(const uint8_t *buffer)
+{
+    if ( m_ram == nullptr ) m_ram = static_cast<uint8_t *>(malloc(NES_CPU_RAM_SIZE));
+    NesApuState apu;
+    memcpy( &m_cpu, buffer, sizeof(NesCpuState) );
+    buffer += sizeof(NesCpuState);
+    memcpy( m_ram, buffer, NES_CPU_RAM_SIZE );
+    buffer += NES_CPU_RAM_SIZE;
+    memcpy( &apu, buffer, sizeof(NesApuState) );
+    buffer += sizeof(NesApuState);
+    m_apu.loadState( apu );
+    if ( m_cartridge ) m_cartridge->loadState( buffer );
+}
+
 void NesCpu::IMD()
 {
     m_cpu.absAddr = m_cpu.pc;
@@ -393,17 +447,27 @@ bool NesCpu::executeInstruction()
         LOGE("Unknown instruction (0x%02X) detected at [0x%04X]\n", opcode, m_cpu.pc - 1);
         return false;
     }
+#if NES_CPU_PROFILER
+    if ( m_profiler ) m_profiler->instruction( mapAddress( m_cpu.pc - 1 ), opcode );
+#endif
     m_cpu.implied = false;
     (this->*commands[ opcode ].addrmode)();
 #ifdef DEBUG_NES_CPU
     printCpuState( commands[ opcode ], commandPc );
 #endif
     (this->*commands[ opcode ].opcode)();
-    return true;
+#if NES_CPU_PROFILER
+    if ( m_profiler && opcode == 0x20 ) m_profiler->enterSubroutine( mapAddress( m_cpu.pc ) );
+    else if ( m_profiler && opcode == 0x60 ) m_profiler->leaveSubroutine();
+#endif
+    return !m_idleLoop;
 }
 
 int NesCpu::callSubroutine(uint16_t addr, int maxInstructions)
 {
+#if NES_CPU_PROFILER
+    if ( m_profiler ) m_profiler->beginCall( mapAddress( addr ) );
+#endif
     m_stopSp = m_cpu.sp;
     m_cpu.absAddr = addr;
     JSR();
@@ -412,28 +476,63 @@ int NesCpu::callSubroutine(uint16_t addr, int maxInstructions)
 
 int NesCpu::continueSubroutine(int maxInstructions)
 {
+    m_idleLoop = false;
+    m_loopState.pc = m_cpu.pc;
+    m_loopWriteCount = m_writeCount - 1;
     while ( m_stopSp != m_cpu.sp && executeInstruction( ) && maxInstructions )
     {
         if ( maxInstructions > 0 ) maxInstructions--;
     }
+    // If instruction limit is reached, inform that there are more commands to execute
+    if ( m_stopSp != m_cpu.sp && !m_idleLoop && maxInstructions == 0 )
+    {
+        return 0;
+    }
+#if NES_CPU_PROFILER
+    if ( m_profiler ) m_profiler->endCall();
+#endif
     // Exit if we returned from subroutine call
     if ( m_stopSp == m_cpu.sp )
     {
         return 1;
     }
-    // If instruction limit is reached, inform that there are more commands to execute
-    if ( maxInstructions == 0 )
+    if ( m_idleLoop )
     {
-        return 0;
+        LOGI("Idle loop detected at [0x%04X]\n", m_cpu.pc);
+        return NES_CPU_IDLE_LOOP;
     }
     // Error occured, set pc to problem instruction
     m_cpu.pc--;
     return -1;
 }
 
+void NesCpu::branch()
+{
+    uint16_t target = m_cpu.pc + m_cpu.relAddr;
+    if ( target < m_cpu.pc ) checkIdleLoop( target );
+    m_cpu.pc = target;
+}
+
+void NesCpu::checkIdleLoop(uint16_t target)
+{
+    // Cpu reads are side-effect free and there are no interrupts during subroutine call,
+    // so if the same backward jump is made with the same registers and no memory was
+    // modified since last time, the cpu will spin in this loop forever.
+    if ( m_loopState.pc == target && m_loopWriteCount == m_writeCount &&
+         m_loopState.a == m_cpu.a && m_loopState.x == m_cpu.x && m_loopState.y == m_cpu.y &&
+         m_loopState.flags == m_cpu.flags && m_loopState.sp == m_cpu.sp )
+    {
+        m_idleLoop = true;
+        return;
+    }
+    m_loopState = m_cpu;
+    m_loopState.pc = target;
+    m_loopWriteCount = m_writeCount;
+}
+
 void NesCpu::BPL()
 {
-    if ( !(m_cpu.flags & N_FLAG) ) m_cpu.pc += m_cpu.relAddr;
+    if ( !(m_cpu.flags & N_FLAG) ) branch();
 }
 
 void NesCpu::ADC()
@@ -560,6 +659,7 @@ void NesCpu::PLA()
 
 void NesCpu::JMP()
 {
+    if ( m_cpu.absAddr < m_cpu.pc ) checkIdleLoop( m_cpu.absAddr );
     m_cpu.pc = m_cpu.absAddr;
 }
 
@@ -610,7 +710,7 @@ void NesCpu::BEQ()
 {
     if ( m_cpu.flags & Z_FLAG )
     {
-        m_cpu.pc += m_cpu.relAddr;
+        branch();
     }
 }
 
@@ -618,7 +718,19 @@ void NesCpu::BNE()
 {
     if ( !(m_cpu.flags & Z_FLAG) )
     {
-        m_cpu.pc += m_cpu.relAddr;
+        // Delay loop (DEX/DEY; BNE back to DEX/DEY) runs until register is zero,
+        // so fast-forward it to the end instead of spinning
+        if ( m_cpu.relAddr == 0xFFFD )
+        {
+            uint8_t opcode = read( m_cpu.pc - 3 );
+            if ( opcode == 0xCA || opcode == 0x88 )
+            {
+                if ( opcode == 0xCA ) m_cpu.x = 0; else m_cpu.y = 0;
+                modifyFlags( 0 );
+                return;
+            }
+        }
+        branch();
     }
 }
 
@@ -626,7 +738,7 @@ void NesCpu::BMI()
 {
     if ( m_cpu.flags & N_FLAG )
     {
-        m_cpu.pc += m_cpu.relAddr;
+        branch();
     }
 }
 
@@ -634,7 +746,7 @@ void NesCpu::BCC()
 {
     if ( !(m_cpu.flags & C_FLAG) )
     {
-        m_cpu.pc += m_cpu.relAddr;
+        branch();
     }
 }
 
@@ -642,7 +754,7 @@ void NesCpu::BCS()
 {
     if ( m_cpu.flags & C_FLAG )
     {
-        m_cpu.pc += m_cpu.relAddr;
+        branch();
     }
 }
 
@@ -0,0 +1,207 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chips/nes_cpu_profiler.h"
+
+#if NES_CPU_PROFILER
+
+#include <algorithm>
+#include <string>
+
+// Base 6502 cycles, no page crossing and branch taken penalties
+static constexpr uint8_t cyclesLut[256] =
+{
+/*      0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
+/* 0 */ 7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+/* 1 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 2 */ 6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+/* 3 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 4 */ 6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+/* 5 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 6 */ 6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+/* 7 */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* 8 */ 2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+/* 9 */ 2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+/* A */ 2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+/* B */ 2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+/* C */ 2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+/* D */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+/* E */ 2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+/* F */ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+};
+
+static const char *mnemonicLut[256] =
+{
+/*        0      1      2      3      4      5      6      7      8      9      A      B      C      D      E      F */
+/* 0 */ "BRK", "ORA", "???", "???", "???", "ORA", "ASL", "???", "PHP", "ORA", "ASL", "???", "???", "ORA", "ASL", "???",
+/* 1 */ "BPL", "ORA", "???", "???", "???", "ORA", "ASL", "???", "CLC", "ORA", "???", "???", "???", "ORA", "ASL", "???",
+/* 2 */ "JSR", "AND", "???", "???", "BIT", "AND", "ROL", "???", "PLP", "AND", "ROL", "???", "BIT", "AND", "ROL", "???",
+/* 3 */ "BMI", "AND", "???", "???", "???", "AND", "ROL", "???", "SEC", "AND", "???", "???", "???", "AND", "ROL", "???",
+/* 4 */ "RTI", "EOR", "???", "???", "???", "EOR", "LSR", "???", "PHA", "EOR", "LSR", "???", "JMP", "EOR", "LSR", "???",
+/* 5 */ "BVC", "EOR", "???", "???", "???", "EOR", "LSR", "???", "CLI", "EOR", "???", "???", "???", "EOR", "LSR", "???",
+/* 6 */ "RTS", "ADC", "???", "???", "???", "ADC", "ROR", "???", "PLA", "ADC", "ROR", "???", "JMP", "ADC", "ROR", "???",
+/* 7 */ "BVS", "ADC", "???", "???", "???", "ADC", "ROR", "???", "SEI", "ADC", "???", "???", "???", "ADC", "ROR", "???",
+/* 8 */ "???", "STA", "???", "???", "STY", "STA", "STX", "???", "DEY", "???", "TXA", "???", "STY", "STA", "STX", "???",
+/* 9 */ "BCC", "STA", "???", "???", "STY", "STA", "STX", "???", "TYA", "STA", "TXS", "???", "???", "STA", "???", "???",
+/* A */ "LDY", "LDA", "LDX", "???", "LDY", "LDA", "LDX", "???", "TAY", "LDA", "TAX", "???", "LDY", "LDA", "LDX", "???",
+/* B */ "BCS", "LDA", "???", "???", "LDY", "LDA", "LDX", "???", "CLV", "LDA", "TSX", "???", "LDY", "LDA", "LDX", "???",
+/* C */ "CPY", "CMP", "???", "???", "CPY", "CMP", "DEC", "???", "INY", "CMP", "DEX", "???", "CPY", "CMP", "DEC", "???",
+/* D */ "BNE", "CMP", "???", "???", "???", "CMP", "DEC", "???", "CLD", "CMP", "???", "???", "???", "CMP", "DEC", "???",
+/* E */ "CPX", "SBC", "???", "???", "CPX", "SBC", "INC", "???", "INX", "SBC", "NOP", "???", "CPX", "SBC", "INC", "???",
+/* F */ "BEQ", "SBC", "???", "???", "???", "SBC", "INC", "???", "SED", "SBC", "???", "???", "???", "SBC", "INC", "???",
+};
+
+static const char *getMnemonic(uint8_t opcode)
+{
+    return mnemonicLut[opcode];
+}
+
+void NesCpuProfiler::clear()
+{
+    m_nodes.clear();
+    m_children.clear();
+    m_pcCounts.clear();
+    m_calls.clear();
+    for (int i = 0; i < 256; i++) m_opcodeCounts[i] = 0;
+    m_totalInstructions = 0;
+    m_node = -1;
+}
+
+int NesCpuProfiler::getNode(int parent, uint32_t addr)
+{
+    uint64_t key = (static_cast<uint64_t>(parent + 1) << 32) | addr;
+    auto it = m_children.find( key );
+    if ( it != m_children.end() )
+    {
+        return it->second;
+    }
+    m_nodes.push_back( CallNode{ addr, parent, 0 } );
+    m_children[key] = static_cast<int>(m_nodes.size() - 1);
+    return static_cast<int>(m_nodes.size() - 1);
+}
+
+void NesCpuProfiler::beginCall(uint32_t addr)
+{
+    if ( m_node >= 0 ) endCall();
+    m_node = getNode( -1, addr );
+    m_callAddr = addr;
+    m_callCycles = 0;
+    m_callInstructions = 0;
+}
+
+void NesCpuProfiler::endCall()
+{
+    if ( m_node < 0 )
+    {
+        return;
+    }
+    CallStats &stats = m_calls[m_callAddr];
+    stats.calls++;
+    stats.cycles += m_callCycles;
+    stats.instructions += m_callInstructions;
+    if ( m_callCycles > stats.maxCycles ) stats.maxCycles = m_callCycles;
+    m_node = -1;
+}
+
+void NesCpuProfiler::instruction(uint32_t pc, uint8_t opcode)
+{
+    m_pcCounts[pc]++;
+    m_opcodeCounts[opcode]++;
+    m_totalInstructions++;
+    m_callInstructions++;
+    m_callCycles += cyclesLut[opcode];
+    if ( m_node >= 0 ) m_nodes[m_node].cycles += cyclesLut[opcode];
+}
+
+void NesCpuProfiler::enterSubroutine(uint32_t addr)
+{
+    if ( m_node >= 0 ) m_node = getNode( m_node, addr );
+}
+
+void NesCpuProfiler::leaveSubroutine()
+{
+    // RTS from the called routine itself completes the call, keep the root frame
+    if ( m_node >= 0 && m_nodes[m_node].parent >= 0 ) m_node = m_nodes[m_node].parent;
+}
+
+void NesCpuProfiler::writeReport(FILE *file, int maxPcs)
+{
+    fprintf( file, "Subroutine calls:\n" );
+    fprintf( file, "%8s %10s %12s %12s %14s\n", "addr", "calls", "avg cycles", "max cycles", "instructions" );
+    for (auto &call: m_calls)
+    {
+        fprintf( file, "%8X %10llu %12llu %12llu %14llu\n", call.first,
+                 static_cast<unsigned long long>( call.second.calls ),
+                 static_cast<unsigned long long>( call.second.cycles / call.second.calls ),
+                 static_cast<unsigned long long>( call.second.maxCycles ),
+                 static_cast<unsigned long long>( call.second.instructions ) );
+    }
+
+    std::vector<std::pair<uint32_t, uint64_t>> pcs( m_pcCounts.begin(), m_pcCounts.end() );
+    std::sort( pcs.begin(), pcs.end(), [](const std::pair<uint32_t, uint64_t> &a, const std::pair<uint32_t, uint64_t> &b)
+               { return a.second > b.second || (a.second == b.second && a.first < b.first); } );
+    fprintf( file, "\nHot PCs (%llu instructions total):\n", static_cast<unsigned long long>( m_totalInstructions ) );
+    fprintf( file, "%8s %12s %7s\n", "pc", "count", "%" );
+    for (int i = 0; i < static_cast<int>(pcs.size()) && i < maxPcs; i++)
+    {
+        fprintf( file, "%8X %12llu %7.2f\n", pcs[i].first, static_cast<unsigned long long>( pcs[i].second ),
+                 100.0 * pcs[i].second / m_totalInstructions );
+    }
+
+    std::vector<std::pair<uint64_t, int>> opcodes;
+    for (int i = 0; i < 256; i++)
+    {
+        if ( m_opcodeCounts[i] ) opcodes.push_back( std::make_pair( m_opcodeCounts[i], i ) );
+    }
+    std::sort( opcodes.begin(), opcodes.end(), [](const std::pair<uint64_t, int> &a, const std::pair<uint64_t, int> &b)
+               { return a.first > b.first || (a.first == b.first && a.second < b.second); } );
+    fprintf( file, "\nOpcodes:\n" );
+    fprintf( file, "%6s %4s %12s %7s\n", "opcode", "name", "count", "%" );
+    for (auto &op: opcodes)
+    {
+        fprintf( file, "  0x%02X %4s %12llu %7.2f\n", op.second, getMnemonic( op.second ),
+                 static_cast<unsigned long long>( op.first ), 100.0 * op.first / m_totalInstructions );
+    }
+}
+
+void NesCpuProfiler::writeFoldedStacks(FILE *file)
+{
+    for (int i = 0; i < static_cast<int>(m_nodes.size()); i++)
+    {
+        if ( !m_nodes[i].cycles )
+        {
+            continue;
+        }
+        std::string stack;
+        for (int node = i; node >= 0; node = m_nodes[node].parent)
+        {
+            char name[16];
+            snprintf( name, sizeof(name), "sub_%X", m_nodes[node].addr );
+            stack = stack.empty() ? name : std::string(name) + ";" + stack;
+        }
+        fprintf( file, "%s %llu\n", stack.c_str(), static_cast<unsigned long long>( m_nodes[i].cycles ) );
+    }
+}
+
+#endif
@@ -23,6 +23,7 @@ SOFTWARE.
 */
 
 #include "chips/nsf_cartridge.h"
+#include "chips/state_hash.h"
 
 #include <malloc.h>
 #include <stdio.h>
@@ -68,6 +69,57 @@ void NsfCartridge::power()
 {
 }
 
+typedef struct
+{
+    uint8_t bank[8];
+    uint16_t mapper031BaseAddress;
+    bool bankingEnabled;
+    bool bbRamUsed;
+} NsfCartridgeState;
+
+uint32_t NsfCartridge::getStateSize()
+{
+    return sizeof(NsfCartridgeState) + (m_bbRam ? BBRAM_SIZE : 0);
+}
+
+void NsfCartridge::saveState(uint8_t *buffer)
+{
+    NsfCartridgeState state{};
+    memcpy( state.bank, m_bank, sizeof(m_bank) );
+    state.mapper031BaseAddress = m_mapper031BaseAddress;
+    state.bankingEnabled = m_bankingEnabled;
+    state.bbRamUsed = m_bbRam != nullptr;
+    memcpy( buffer, &state, sizeof(state) );
+    if ( m_bbRam ) memcpy( buffer + sizeof(state), m_bbRam, BBRAM_SIZE );
+}
+
+void NsfCartridge::loadState(const uint8_t *buffer)
+{
+    NsfCartridgeState state;
+    memcpy( &state, buffer, sizeof(state) );
+    memcpy( m_bank, state.bank, sizeof(m_bank) );
+    m_mapper031BaseAddress = state.mapper031BaseAddress;
+    m_bankingEnabled = state.bankingEnabled;
+    m_mappingVersion++;
+    if ( state.bbRamUsed && allocBbRam() )
+    {
+        memcpy( m_bbRam, buffer + sizeof(state), BBRAM_SIZE );
+    }
+    else if ( !state.bbRamUsed && m_bbRam )
+    {
+        free( m_bbRam );
+        m_bbRam = nullptr;
+    }
+}
+
+uint64_t NsfCartridge::getStateHash(uint64_t hash)
+{
+    hash = stateHash( m_bank, sizeof(m_bank), hash );
+    hash = stateHash( &m_bankingEnabled, sizeof(m_bankingEnabled), hash );
+    if ( m_bbRam ) hash = stateHash( m_bbRam, BBRAM_SIZE, hash );
+    return hash;
+}
+
 bool NsfCartridge::allocBbRam()
 {
     if ( m_bbRam == nullptr )
@@ -94,6 +146,7 @@ bool NsfCartridge::write(uint16_t address, uint8_t data)
     {
         m_bankingEnabled = true;
         m_bank[ address & 0x07] = data;
+        m_mappingVersion++;
         LOGI( "BANK %d [%04X] = %02X (%d) 0x%08X\n", address & 0x07, address,
                data, 0x8000 + data * 4096, 0x8000 + data * 4096 );
         return true;
@@ -155,6 +208,33 @@ uint8_t NsfCartridge::read(uint16_t address)
     return CLR_VALUE;
 }
 
+const uint8_t *NsfCartridge::getDataSpan(uint16_t address, uint32_t &length)
+{
+    if ( address < 0x8000 )
+    {
+        return nullptr;
+    }
+    // Banks are 4 KiB, and vectors at 0xFFFA are not banked
+    uint32_t limit = 0x10000 - address;
+    if ( m_bankingEnabled && address < 0xFFFA )
+    {
+        limit = 0x1000 - (address & 0x0FFF);
+        if ( limit > 0xFFFAu - address ) limit = 0xFFFA - address;
+    }
+    uint32_t mappedAddr = mapper031( address );
+    for (int i=0; i<APU_MAX_MEMORY_BLOCKS && m_mem[i].data != nullptr; i++)
+    {
+        if ( mappedAddr >= m_mem[i].addr &&
+             mappedAddr < m_mem[i].addr + m_mem[i].size )
+        {
+            uint32_t addr = mappedAddr - m_mem[i].addr;
+            length = m_mem[i].size - addr < limit ? m_mem[i].size - addr : limit;
+            return m_mem[i].data + addr;
+        }
+    }
+    return nullptr;
+}
+
 void NsfCartridge::setDataBlock( const uint8_t *data, uint32_t len )
 {
     if ( len < 2 )
@@ -192,6 +272,7 @@ void NsfCartridge::setDataBlock( uint32_t addr, const uint8_t *data, uint32_t le
     m_mem[ blockNumber ].data = data;
     m_mem[ blockNumber ].size = len;
     m_mem[ blockNumber ].addr = addr;
+    m_mappingVersion++;
     LOGI("New data block [0x%04X] (len=%d)\n", addr, len);
 }
 
@@ -0,0 +1,350 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "frame_decoder.h"
+#include "formats/frame_format.h"
+#include "chips/nsf_cartridge.h"
+
+#include <stdlib.h>
+
+#define FRAME_DECODER_DEBUG 1
+
+#if FRAME_DECODER_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER FRAME_DECODER_DEBUG
+#endif
+#include "../vgm_logger.h"
+
+/** Frame files are played at 44.1kHz rate */
+#define FRAME_SAMPLE_RATE 44100
+
+FrameMusicDecoder::FrameMusicDecoder()
+{
+}
+
+FrameMusicDecoder::~FrameMusicDecoder()
+{
+    deleteChips();
+}
+
+void FrameMusicDecoder::deleteChips()
+{
+    if ( m_msxChip )
+    {
+        delete m_msxChip;
+        m_msxChip = nullptr;
+    }
+    if ( m_nesChip )
+    {
+        delete m_nesChip;
+        m_nesChip = nullptr;
+    }
+}
+
+FrameMusicDecoder *FrameMusicDecoder::tryOpen(const uint8_t *data, int size)
+{
+    FrameMusicDecoder *decoder = new FrameMusicDecoder();
+    if ( !decoder->open( data, size ) )
+    {
+        delete decoder;
+        decoder = nullptr;
+    }
+    return decoder;
+}
+
+bool FrameMusicDecoder::open(const uint8_t *data, int size)
+{
+    close();
+    if ( size < static_cast<int>(sizeof(FrameHeader)) )
+    {
+        return false;
+    }
+    const FrameHeader *header = reinterpret_cast<const FrameHeader *>(data);
+    if ( header->ident != FRAME_IDENT )
+    {
+        return false;
+    }
+    if ( header->version != FRAME_FORMAT_VERSION )
+    {
+        LOGE( "Unsupported frame format version %d\n", header->version );
+        return false;
+    }
+    if ( (header->chip != CHIP_WRITE_AY38910 && header->chip != CHIP_WRITE_NES_APU) ||
+         header->rate == 0 || header->rate > FRAME_SAMPLE_RATE ||
+         (header->loopFrame != FRAME_NO_LOOP && header->loopFrame >= header->frameCount) ||
+         header->loopOffset > header->streamSize || header->dataBlocks > APU_MAX_MEMORY_BLOCKS )
+    {
+        LOGE( "Invalid frame file header\n" );
+        return false;
+    }
+    uint32_t offset = sizeof(FrameHeader);
+    const uint8_t *blocks = data + offset;
+    for (int i = 0; i < header->dataBlocks; i++)
+    {
+        if ( offset + 4 > static_cast<uint32_t>(size) )
+        {
+            LOGE( "Data block %d is out of file\n", i );
+            return false;
+        }
+        uint32_t length = data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16) |
+                          (static_cast<uint32_t>(data[offset + 3]) << 24);
+        if ( length > size - offset - 4 )
+        {
+            LOGE( "Data block %d is out of file\n", i );
+            return false;
+        }
+        offset += 4 + length;
+    }
+    if ( header->streamSize > size - offset )
+    {
+        LOGE( "Frame stream is out of file\n" );
+        return false;
+    }
+    m_header = header;
+    m_stream = data + offset;
+    if ( header->chip == CHIP_WRITE_AY38910 )
+    {
+        m_msxChip = new AY38910( header->ay8910Type, header->ay8910Flags );
+        m_msxChip->setFrequency( header->clock );
+    }
+    else
+    {
+        m_nesChip = new NesCpu();
+        NsfCartridge *cartridge = new NsfCartridge();
+        m_nesChip->insertCartridge( cartridge );
+        for (int i = 0; i < header->dataBlocks; i++)
+        {
+            uint32_t length = blocks[0] | (blocks[1] << 8) | (blocks[2] << 16) | (static_cast<uint32_t>(blocks[3]) << 24);
+            cartridge->setDataBlock( blocks + 4, length );
+            blocks += 4 + length;
+        }
+    }
+    m_loops = header->loopFrame != FRAME_NO_LOOP ? 2 : 1;
+    seek( 0, 0 );
+    setObserver( m_observer );
+    LOG( "Frame rate: %d\n", header->rate );
+    LOG( "Frames: %u, loop frame: %u\n", header->frameCount, header->loopFrame );
+    LOG( "Stream size: %u%s\n", header->streamSize, (header->flags & FRAME_FLAG_LZ) ? " (LZ)" : "" );
+    return true;
+}
+
+void FrameMusicDecoder::close()
+{
+    m_header = nullptr;
+    m_stream = nullptr;
+    deleteChips();
+}
+
+void FrameMusicDecoder::seek(uint32_t frame, uint32_t offset)
+{
+    m_frame = frame;
+    m_streamPos = offset;
+    m_emptyFrames = 0;
+    m_literals = 0;
+    m_matchLength = 0;
+}
+
+int FrameMusicDecoder::readByte()
+{
+    if ( !m_literals && !m_matchLength && (m_header->flags & FRAME_FLAG_LZ) )
+    {
+        if ( m_streamPos >= m_header->streamSize )
+        {
+            return -1;
+        }
+        uint8_t token = m_stream[ m_streamPos++ ];
+        if ( token & 0x80 )
+        {
+            if ( m_streamPos >= m_header->streamSize )
+            {
+                return -1;
+            }
+            m_matchLength = (token & 0x7F) + FRAME_LZ_MIN_MATCH;
+            m_matchDistance = m_stream[ m_streamPos++ ];
+        }
+        else
+        {
+            m_literals = token + 1;
+        }
+    }
+    uint8_t value;
+    if ( m_matchLength )
+    {
+        // Distance is stored minus one, window index wraps at 256 bytes
+        value = m_window[ static_cast<uint8_t>(m_windowPos - m_matchDistance - 1) ];
+        m_matchLength--;
+    }
+    else
+    {
+        if ( m_streamPos >= m_header->streamSize )
+        {
+            return -1;
+        }
+        value = m_stream[ m_streamPos++ ];
+        if ( m_literals ) m_literals--;
+    }
+    m_window[ m_windowPos++ ] = value;
+    return value;
+}
+
+uint32_t FrameMusicDecoder::getFrameStart(uint32_t frame) const
+{
+    return static_cast<uint64_t>(frame) * FRAME_SAMPLE_RATE / m_header->rate;
+}
+
+void FrameMusicDecoder::setObserver(ChipWriteObserver *observer)
+{
+    m_observer = observer;
+    if ( m_msxChip ) m_msxChip->setObserver( m_observer );
+    if ( m_nesChip ) m_nesChip->getApu()->setObserver( m_observer );
+}
+
+void FrameMusicDecoder::setVolume( uint16_t volume )
+{
+    if ( m_msxChip ) m_msxChip->setVolume( volume );
+    if ( m_nesChip ) m_nesChip->getApu()->setVolume( volume );
+}
+
+void FrameMusicDecoder::setQuality( uint8_t quality )
+{
+    if ( m_msxChip ) m_msxChip->setQuality( quality );
+    if ( m_nesChip ) m_nesChip->getApu()->setQuality( quality );
+}
+
+void FrameMusicDecoder::setSampleFrequency( uint32_t frequency )
+{
+    if ( m_msxChip ) m_msxChip->setSampleFrequency( frequency );
+    if ( m_nesChip ) m_nesChip->getApu()->setSampleFrequency( frequency );
+}
+
+void FrameMusicDecoder::setChannelMask( uint8_t mask )
+{
+    if ( m_msxChip ) m_msxChip->setChannelMask( mask );
+    if ( m_nesChip ) m_nesChip->getApu()->setChannelMask( mask );
+}
+
+uint32_t FrameMusicDecoder::getSample()
+{
+    if ( m_msxChip ) return m_msxChip->getSample();
+    if ( m_nesChip ) return m_nesChip->getApu()->getSample();
+    return 0;
+}
+
+void FrameMusicDecoder::getSamples(uint32_t *buffer, uint32_t count)
+{
+    if ( m_msxChip ) m_msxChip->getSamples( buffer, count );
+    else BaseMusicDecoder::getSamples( buffer, count );
+}
+
+int FrameMusicDecoder::getStemCount()
+{
+    if ( m_msxChip ) return AY38910_STEMS;
+    if ( m_nesChip ) return NES_APU_STEMS;
+    return 0;
+}
+
+void FrameMusicDecoder::getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    if ( m_msxChip ) m_msxChip->getStems( buffer, stems, count );
+    else if ( m_nesChip ) m_nesChip->getApu()->getStems( buffer, stems, count );
+    else BaseMusicDecoder::getStems( buffer, stems, count );
+}
+
+bool FrameMusicDecoder::analyzeTrack(int track, MusicTrackInfo &info)
+{
+    if ( !m_header )
+    {
+        return false;
+    }
+    uint32_t total = getFrameStart( m_header->frameCount );
+    info.introSamples = m_header->loopFrame != FRAME_NO_LOOP ? getFrameStart( m_header->loopFrame ) : total;
+    info.loopSamples = total - info.introSamples;
+    return true;
+}
+
+int FrameMusicDecoder::decodeBlock()
+{
+    if ( m_frame >= m_header->frameCount )
+    {
+        if ( m_header->loopFrame == FRAME_NO_LOOP || m_loops == 1 )
+        {
+            return 0;
+        }
+        seek( m_header->loopFrame, m_header->loopOffset );
+        m_loops--;
+    }
+    if ( m_emptyFrames )
+    {
+        m_emptyFrames--;
+    }
+    else
+    {
+        int groups = readByte();
+        if ( groups < 0 )
+        {
+            LOGE( "Frame stream is truncated at frame %u\n", m_frame );
+            return -1;
+        }
+        if ( groups & FRAME_EMPTY_RUN )
+        {
+            m_emptyFrames = groups & ~FRAME_EMPTY_RUN;
+        }
+        else
+        {
+            uint32_t mask = 0;
+            for (int group = 0; group < FRAME_MAX_SLOTS / 8; group++)
+            {
+                int bits = (groups & (1 << group)) ? readByte() : 0;
+                if ( bits < 0 )
+                {
+                    LOGE( "Frame stream is truncated at frame %u\n", m_frame );
+                    return -1;
+                }
+                mask |= bits << (group * 8);
+            }
+            if ( mask >> (m_msxChip ? FRAME_AY8910_SLOTS : FRAME_NES_APU_SLOTS) )
+            {
+                LOGE( "Invalid register mask at frame %u\n", m_frame );
+                return -1;
+            }
+            for (int slot = 0; mask; slot++, mask >>= 1)
+            {
+                if ( !(mask & 1) )
+                {
+                    continue;
+                }
+                int value = readByte();
+                if ( value < 0 )
+                {
+                    LOGE( "Frame stream is truncated at frame %u\n", m_frame );
+                    return -1;
+                }
+                if ( m_msxChip ) m_msxChip->write( slot, value );
+                else m_nesChip->getApu()->write( frameNesApuRegisters[slot], value );
+            }
+        }
+    }
+    uint32_t samples = getFrameStart( m_frame + 1 ) - getFrameStart( m_frame );
+    m_frame++;
+    return samples;
+}
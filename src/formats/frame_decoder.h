@@ -0,0 +1,112 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "music_decoder.h"
+#include "chips/ay-3-8910.h"
+#include "chips/nes_cpu.h"
+
+typedef struct FrameHeader FrameHeader;
+
+/**
+ * Plays compact frame files (.vgr), built by VgmFrameConverter. Each decoded
+ * block is one frame: register values are applied to the chip, and the frame
+ * length in samples is returned. LZ compressed stream is decoded on the fly
+ * with 256 byte window, so no memory is allocated for the stream.
+ */
+class FrameMusicDecoder: public BaseMusicDecoder
+{
+public:
+    FrameMusicDecoder();
+    ~FrameMusicDecoder();
+
+    /** Allows to open frame data blocks */
+    bool open(const uint8_t *data, int size) override;
+
+    static FrameMusicDecoder *tryOpen(const uint8_t *data, int size);
+
+    /** Closes frame data */
+    void close();
+
+    uint32_t getSample() override;
+
+    /** Reads count samples to buffer, AY-3-8910 renders them in one block */
+    void getSamples(uint32_t *buffer, uint32_t count) override;
+
+    /** Returns number of chip channels: 3 for AY-3-8910, 5 for NES APU */
+    int getStemCount() override;
+
+    /** Reads count samples and chip channels in one pass */
+    void getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count) override;
+
+    /** Sets volume, default level is 64 */
+    void setVolume(uint16_t volume) override;
+
+    /** Sets synthesis quality of the chips */
+    void setQuality(uint8_t quality) override;
+
+    /** Sets output sample frequency of the chips */
+    void setSampleFrequency(uint32_t frequency) override;
+
+    /** Sets chip channels to play */
+    void setChannelMask(uint8_t mask) override;
+
+    /**
+     * Decodes next frame and returns number of samples to read from decoder.
+     * If it returns -1, then error occured, 0 means - nothing left.
+     */
+    int decodeBlock() override;
+
+    /** Returns intro and loop length, calculated from frame counts */
+    bool analyzeTrack(int track, MusicTrackInfo &info) override;
+
+    /** Sets observer for chip register writes, nullptr disables notifications */
+    void setObserver(ChipWriteObserver *observer) override;
+
+private:
+    AY38910 *m_msxChip = nullptr;
+    NesCpu  *m_nesChip = nullptr;
+    ChipWriteObserver *m_observer = nullptr;
+
+    const FrameHeader *m_header = nullptr;
+    const uint8_t *m_stream = nullptr;
+    uint32_t m_streamPos = 0;
+    uint32_t m_frame = 0;
+    uint32_t m_emptyFrames = 0;
+    uint8_t  m_loops = 0;
+
+    /** LZ decoder state: literal bytes or match bytes left, match distance and window */
+    uint8_t m_literals = 0;
+    uint8_t m_matchLength = 0;
+    uint8_t m_matchDistance = 0;
+    uint8_t m_windowPos = 0;
+    uint8_t m_window[256];
+
+    void deleteChips();
+    void seek(uint32_t frame, uint32_t offset);
+    int readByte();
+    uint32_t getFrameStart(uint32_t frame) const;
+};
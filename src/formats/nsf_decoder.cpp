@@ -26,6 +26,10 @@ SOFTWARE.
 #include "formats/nsf_format.h"
 #include "chips/nsf_cartridge.h"
 
+#include <stdlib.h>
+#include <new>
+#include <unordered_map>
+
 #define NSF_DECODER_DEBUG 1
 
 #if NSF_DECODER_DEBUG && !defined(VGM_DECODER_LOGGER)
@@ -59,23 +63,20 @@ NsfMusicDecoder *NsfMusicDecoder::tryOpen(const uint8_t *data, int size)
 bool NsfMusicDecoder::open(const uint8_t * data, int size)
 {
     close();
-    if ( size < sizeof(NsfHeader) )
+    if ( !m_metadata.parse( data, size ) )
     {
         return false;
     }
-    m_rawData = data;
-    m_size = size;
-    m_nsfHeader = reinterpret_cast<const NsfHeader *>(m_rawData);
-    m_dataPtr = m_rawData;
-    if ( m_nsfHeader->ident != 0x4D53454E )
+    m_nsfHeader = &m_metadata.getHeader();
+    m_songCount = m_metadata.getSongCount();
+    m_trackStates = new (std::nothrow) std::atomic<uint8_t *>[m_songCount];
+    if ( m_trackStates == nullptr )
     {
-        LOGE("%08X\n", m_nsfHeader->ident );
         m_nsfHeader = nullptr;
         return false;
     }
-    NsfCartridge *cartridge = new NsfCartridge();
-    cartridge->setDataBlock( m_nsfHeader->loadAddress, m_dataPtr + 0x80, m_size - 0x80 );
-    m_nesChip.insertCartridge( cartridge );
+    for (int i = 0; i < m_songCount; i++) m_trackStates[i].store( nullptr );
+    m_nesChip.insertCartridge( createCartridge() );
     if ( !setTrack( 0 ) )
     {
         return false;
@@ -88,11 +89,25 @@ bool NsfMusicDecoder::open(const uint8_t * data, int size)
 
 void NsfMusicDecoder::close()
 {
+    deleteTrackStates();
     m_nesChip.insertCartridge( nullptr );
     m_nsfHeader = nullptr;
-    m_rawData = nullptr;
+    m_metadata.clear();
+}
+
+void NsfMusicDecoder::setObserver(ChipWriteObserver *observer)
+{
+    m_nesChip.getApu()->setObserver( observer );
 }
 
+#if NES_CPU_PROFILER
+void NsfMusicDecoder::setProfiler(NesCpuProfiler *profiler)
+{
+    m_profiler = profiler;
+    m_nesChip.setProfiler( profiler );
+}
+#endif
+
 void NsfMusicDecoder::setVolume( uint16_t volume )
 {
     m_nesChip.getApu()->setVolume( volume );
@@ -101,16 +116,109 @@ void NsfMusicDecoder::setVolume( uint16_t volume )
 int NsfMusicDecoder::getTrackCount()
 {
     // read nsf track count
-    if ( m_nsfHeader ) return m_nsfHeader->songIndex;
+    if ( m_nsfHeader ) return m_metadata.getTrackCount();
     return 0;
 }
 
+bool NsfMusicDecoder::getTrackTime(int track, uint32_t &duration, uint32_t &fade)
+{
+    return m_nsfHeader && m_metadata.getTrackTime( track, duration, fade );
+}
+
+void NsfMusicDecoder::deleteTrackStates()
+{
+    if ( m_trackStates )
+    {
+        for (int i = 0; i < m_songCount; i++) free( m_trackStates[i].load() );
+        delete[] m_trackStates;
+        m_trackStates = nullptr;
+    }
+    m_songCount = 0;
+}
+
+NesCartridge *NsfMusicDecoder::createCartridge()
+{
+    NsfCartridge *cartridge = new NsfCartridge();
+    cartridge->setDataBlock( m_nsfHeader->loadAddress, m_metadata.getProgramData(), m_metadata.getProgramSize() );
+    return cartridge;
+}
+
 bool NsfMusicDecoder::setTrack(int track)
 {
     // For vgm files this is not supported
     if ( !m_nsfHeader ) return false;
 
-    m_nesChip.reset();
+    if ( track < 0 || track >= m_metadata.getTrackCount() ) track = 0;
+    int song = m_metadata.getSong( track );
+    if ( !prepareSong( song, true ) )
+    {
+        return false;
+    }
+    m_nesChip.loadState( m_trackStates[song].load( std::memory_order_acquire ) );
+    m_nesChip.getApu()->notifyRegisters();
+//    m_samplesPlayed = 0;
+    return true;
+}
+
+bool NsfMusicDecoder::prepareTrack(int track)
+{
+    return m_nsfHeader && prepareSong( m_metadata.getSong( track ) );
+}
+
+bool NsfMusicDecoder::prepareSong(int song, bool profile)
+{
+    if ( !m_nsfHeader || song < 0 || song >= m_songCount ) return false;
+    if ( m_trackStates[song].load( std::memory_order_acquire ) ) return true;
+
+    NesCpu cpu;
+    cpu.insertCartridge( createCartridge() );
+#if NES_CPU_PROFILER
+    // Init, run by setTrack() or analyzeTrack() on the caller thread, is a part of the track profile
+    if ( profile ) cpu.setProfiler( m_profiler );
+#endif
+    if ( !initTrack( cpu, song ) )
+    {
+        return false;
+    }
+    uint8_t *state = static_cast<uint8_t *>(malloc( cpu.getStateSize() ));
+    if ( state == nullptr )
+    {
+        LOGE( "Failed to allocate memory for song %d state\n", song );
+        return false;
+    }
+    cpu.saveState( state );
+    // Init may run for the same song in other thread, the state published first is kept
+    uint8_t *published = nullptr;
+    if ( !m_trackStates[song].compare_exchange_strong( published, state, std::memory_order_acq_rel ) )
+    {
+        free( state );
+    }
+    return true;
+}
+
+bool NsfMusicDecoder::startTrack(int track)
+{
+    int song = m_nsfHeader ? m_metadata.getSong( track ) : -1;
+    if ( song < 0 ) return false;
+
+    // Take power-up state of apu channels and cartridge from new cpu instance
+    NesCpu cpu;
+    cpu.insertCartridge( createCartridge() );
+    uint8_t *state = static_cast<uint8_t *>(malloc( cpu.getStateSize() ));
+    if ( state == nullptr )
+    {
+        LOGE( "Failed to allocate memory for track %d state\n", track );
+        return false;
+    }
+    cpu.saveState( state );
+    m_nesChip.loadState( state );
+    free( state );
+    return initTrack( m_nesChip, song );
+}
+
+bool NsfMusicDecoder::initTrack(NesCpu &nesChip, int song)
+{
+    nesChip.reset();
     bool useBanks = false;
     for (int i=0; i<8; i++)
         if ( m_nsfHeader->bankSwitch[i] )
@@ -118,36 +226,68 @@ bool NsfMusicDecoder::setTrack(int track)
     if ( useBanks )
     {
         for (int i=0; i<8; i++)
-            m_nesChip.write( 0x5FF8 + i, m_nsfHeader->bankSwitch[i] );
+            nesChip.write( 0x5FF8 + i, m_nsfHeader->bankSwitch[i] );
     }
     // Reset NES CPU memory and state
-    NesCpuState &cpu = m_nesChip.cpuState();
-    for (uint16_t i = 0; i < 0x07FF; i++) m_nesChip.write(i, 0);
-    for (uint16_t i = 0x4000; i < 0x4013; i++) m_nesChip.write(i, 0);
-    m_nesChip.write(0x4015, 0x00);
-    m_nesChip.write(0x4015, 0x0F);
-    m_nesChip.write(0x4017, 0x40);
+    NesCpuState &cpu = nesChip.cpuState();
+    for (uint16_t i = 0; i < NES_CPU_RAM_SIZE; i++) nesChip.write(i, 0);
+    for (uint16_t i = 0x4000; i < 0x4013; i++) nesChip.write(i, 0);
+    nesChip.write(0x4015, 0x00);
+    nesChip.write(0x4015, 0x0F);
+    nesChip.write(0x4017, 0x40);
     // if the tune is bank switched, load the bank values from $070-$077 into $5FF8-$5FFF.
     cpu.x = 0; // ntsc
-    cpu.a = track < m_nsfHeader->songIndex ? track: 0;
+    cpu.a = song;
     cpu.sp = 0xEF;
-    if ( m_nesChip.callSubroutine( m_nsfHeader->initAddress ) < 0 )
+    int result = nesChip.callSubroutine( m_nsfHeader->initAddress );
+    if ( result == NES_CPU_IDLE_LOOP )
+    {
+        // Some init routines never return and wait for NMI to call play routine.
+        // Drop the return address and consider init as completed.
+        LOGI( "Init subroutine stays in idle loop, continue with play routine\n" );
+        cpu.sp = 0xEF;
+    }
+    else if ( result < 0 )
     {
         LOGE( "Failed to call init subroutine for NSF file\n" );
         return false;
     }
-//    m_samplesPlayed = 0;
     return true;
 }
 
+void NsfMusicDecoder::setQuality( uint8_t quality )
+{
+    m_nesChip.getApu()->setQuality( quality );
+}
+
+void NsfMusicDecoder::setSampleFrequency( uint32_t frequency )
+{
+    m_nesChip.getApu()->setSampleFrequency( frequency );
+}
+
+void NsfMusicDecoder::setChannelMask( uint8_t mask )
+{
+    m_nesChip.getApu()->setChannelMask( mask );
+}
+
 uint32_t NsfMusicDecoder::getSample()
 {
     return m_nesChip.getApu()->getSample();
 }
 
+void NsfMusicDecoder::getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    m_nesChip.getApu()->getStems( buffer, stems, count );
+}
+
 int NsfMusicDecoder::decodeBlock()
 {
     int result = m_nesChip.callSubroutine( m_nsfHeader->playAddress, 20000 );
+    if ( result == NES_CPU_IDLE_LOOP )
+    {
+        LOGE( "Play subroutine hangs in idle loop, stopping\n" );
+        return 0;
+    }
     if ( result < 0 )
     {
         LOGE( "Failed to call play subroutine due to CPU error, stopping\n" );
@@ -158,6 +298,70 @@ int NsfMusicDecoder::decodeBlock()
         LOGE( "Failed to call play subroutine, it looks infinite loop, stopping\n" );
         return 0;
     }
-    m_waitSamples = (VGM_SAMPLE_RATE * static_cast<uint64_t>( m_nsfHeader->ntscPlaySpeed )) / 1000000;
+    m_waitSamples = getPlaySamples();
     return m_waitSamples;
 }
+
+uint32_t NsfMusicDecoder::getPlaySamples()
+{
+    return (VGM_SAMPLE_RATE * static_cast<uint64_t>( m_nsfHeader->ntscPlaySpeed )) / 1000000;
+}
+
+bool NsfMusicDecoder::analyzeTrack(int track, MusicTrackInfo &info)
+{
+    int song = m_nsfHeader ? m_metadata.getSong( track ) : -1;
+    if ( !prepareSong( song, true ) )
+    {
+        return false;
+    }
+    NesCpu cpu;
+    cpu.insertCartridge( createCartridge() );
+    cpu.loadState( m_trackStates[song].load( std::memory_order_acquire ) );
+    // Maps state hash to the sample position, where the state was reached
+    std::unordered_map<uint64_t, uint32_t> states;
+    states[ cpu.getStateHash() ] = 0;
+    uint32_t samples = 0;
+    uint32_t silenceStart = 0;
+    uint32_t lastSample = cpu.getApu()->getSample();
+    bool sound = false;
+    while ( samples < NSF_ANALYSIS_MAX_SAMPLES )
+    {
+        int result = cpu.callSubroutine( m_nsfHeader->playAddress, 20000 );
+        if ( result <= 0 )
+        {
+            // Play routine hangs, decodeBlock() stops playback at this point
+            info.introSamples = samples;
+            info.loopSamples = 0;
+            return true;
+        }
+        uint32_t playSamples = getPlaySamples();
+        for (uint32_t i = 0; i < playSamples; i++)
+        {
+            uint32_t sample = cpu.getApu()->getSample();
+            if ( sample != lastSample )
+            {
+                lastSample = sample;
+                silenceStart = samples + i + 1;
+                sound = true;
+            }
+        }
+        samples += playSamples;
+        if ( sound && samples - silenceStart >= NSF_SILENCE_SAMPLES )
+        {
+            info.introSamples = silenceStart;
+            info.loopSamples = 0;
+            return true;
+        }
+        uint64_t hash = cpu.getStateHash();
+        auto it = states.find( hash );
+        if ( it != states.end() )
+        {
+            info.introSamples = it->second;
+            info.loopSamples = samples - it->second;
+            return true;
+        }
+        states[ hash ] = samples;
+    }
+    LOGI( "Track %d length is not detected\n", track );
+    return false;
+}
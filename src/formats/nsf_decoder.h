@@ -25,10 +25,20 @@ SOFTWARE.
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
 #include "music_decoder.h"
 #include "chips/nes_cpu.h"
+#include "formats/nsf_metadata.h"
 
-typedef struct NsfHeader NsfHeader;
+/** Silence length, which is considered as the end of NSF track */
+#ifndef NSF_SILENCE_SAMPLES
+#define NSF_SILENCE_SAMPLES (44100 * 3)
+#endif
+
+/** Maximum NSF track length, analyzed by analyzeTrack() */
+#ifndef NSF_ANALYSIS_MAX_SAMPLES
+#define NSF_ANALYSIS_MAX_SAMPLES (44100 * 60 * 10)
+#endif
 
 class NsfMusicDecoder: public BaseMusicDecoder
 {
@@ -36,7 +46,7 @@ public:
     NsfMusicDecoder();
     ~NsfMusicDecoder();
 
-    /** Allows to open NSF data blocks */
+    /** Allows to open NSF, NSF2 and NSFe data blocks */
     bool open(const uint8_t *data, int size) override;
 
     static NsfMusicDecoder *tryOpen(const uint8_t *data, int size);
@@ -46,34 +56,112 @@ public:
 
     uint32_t getSample() override;
 
-    /** Sets sampling frequency. ,Must be called before decodePcm */
-//    void setSampleFrequency( uint32_t frequency ) virtual;
+    /** Returns number of NES APU channels */
+    int getStemCount() override { return NES_APU_STEMS; }
+
+    /** Reads count samples and NES APU channels in one pass */
+    void getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count) override;
+
+    /** Sets output sample frequency of NES APU */
+    void setSampleFrequency(uint32_t frequency) override;
 
     /** Sets volume, default level is 64 */
     void setVolume(uint16_t volume) override;
 
-    /** Returns number of tracks in opened file */
+    /** Sets synthesis quality of the chips */
+    void setQuality(uint8_t quality) override;
+
+    /** Sets NES APU channels to play */
+    void setChannelMask(uint8_t mask) override;
+
+    /** Returns number of tracks in opened file (NSFe playlist length, if it is present) */
     int getTrackCount() override;
 
-    /** Sets track to play */
+    /** Returns track duration and fade length from NSFe or NSF2 time and fade chunks */
+    bool getTrackTime(int track, uint32_t &duration, uint32_t &fade) override;
+
+    /**
+     * Sets track to play. First call for each track runs NSF init routine,
+     * next calls restore the state, cached right after init.
+     */
     bool setTrack(int track) override;
 
+    /**
+     * Runs NSF init routine for the track and caches the state for setTrack().
+     * Separate cpu instance is used, so the track being played is not affected.
+     * The method can be called from background threads, while other tracks are
+     * prepared and played: if setTrack() needs the track before its init is complete,
+     * setTrack() runs init itself, and the state published first is kept. Background
+     * calls must be complete before open() or close().
+     */
+    bool prepareTrack(int track) override;
+
+    /**
+     * Starts the track like setTrack(), but runs NSF init routine on power-up state
+     * instead of restoring cached state, so the observer receives every apu write
+     * made by init routine. Used, when exact write sequence matters (VGM export).
+     */
+    bool startTrack(int track);
+
     /**
      * Decodes data block and returns number of samples to read from decoder.
      * If it returns -1, then error occured, 0 means - nothing left.
      */
     int decodeBlock() override;
 
+    /**
+     * Runs the track on separate cpu instance and finds its length. After each play
+     * routine call cpu registers, RAM, apu registers and cartridge banks are hashed:
+     * the first repeated state gives loop start and length. If there is no loop,
+     * the end of the track is the start of sustained silence (NSF_SILENCE_SAMPLES).
+     * Returns false if neither loop nor end is found during NSF_ANALYSIS_MAX_SAMPLES.
+     */
+    bool analyzeTrack(int track, MusicTrackInfo &info) override;
+
+    /**
+     * Sets observer for chip register writes, nullptr disables notifications.
+     * Since init routine state is cached, setTrack() reports apu registers after init
+     * instead of separate writes made by init routine.
+     */
+    void setObserver(ChipWriteObserver *observer) override;
+
+#if NES_CPU_PROFILER
+    /**
+     * Sets profiler for the cpu, which plays the track. Init routine is profiled, when
+     * setTrack() or analyzeTrack() runs it. prepareTrack(), which can run on other
+     * thread, and play routine calls of analyzeTrack() are not profiled.
+     */
+    void setProfiler(NesCpuProfiler *profiler) override;
+#endif
+
+    /**
+     * Returns hash of emulated NES state (cpu registers, RAM, apu registers, cartridge).
+     * Equal hashes after play routine calls mean that the music repeats.
+     */
+    uint64_t getStateHash() { return m_nesChip.getStateHash(); }
+
+    /** Reads byte from emulated NES memory, for example DMC sample data */
+    uint8_t readMemory(uint16_t address) { return m_nesChip.read( address ); }
+
 private:
     NesCpu m_nesChip{};
     uint32_t m_waitSamples;
 
-    const uint8_t * m_rawData = nullptr;
-    int m_size = 0;
-    int m_headerSize = 0;
-    const uint8_t * m_dataPtr = nullptr;
-
+    NsfMetadata m_metadata{};
     const NsfHeader *m_nsfHeader = nullptr;
+
+    /** Cpu states after init routine, one for each song, published by prepareSong() */
+    std::atomic<uint8_t *> *m_trackStates = nullptr;
+    int m_songCount = 0;
+#if NES_CPU_PROFILER
+    NesCpuProfiler *m_profiler = nullptr;
+#endif
+
+    NesCartridge *createCartridge();
+    uint32_t getPlaySamples();
+    bool prepareSong(int song, bool profile = false);
+    bool initTrack(NesCpu &cpu, int song);
+    void deleteTrackStates();
 };
 
 
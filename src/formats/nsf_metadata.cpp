@@ -0,0 +1,257 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "formats/nsf_metadata.h"
+
+#include <string.h>
+
+#define NSF_METADATA_DEBUG 1
+
+#if NSF_METADATA_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER NSF_METADATA_DEBUG
+#endif
+#include "../vgm_logger.h"
+
+/** Default NTSC play rate for NSFe files without RATE chunk, 1/1000000 second ticks */
+#define NSFE_DEFAULT_PLAY_SPEED 16639
+
+static uint32_t readUint32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+static uint16_t readUint16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+void NsfMetadata::clear()
+{
+    *this = NsfMetadata();
+}
+
+bool NsfMetadata::parse(const uint8_t *data, int size)
+{
+    clear();
+    if ( size < 4 )
+    {
+        return false;
+    }
+    if ( readUint32( data ) == NSFE_IDENT )
+    {
+        return parseNsfe( data + 4, size - 4 );
+    }
+    if ( readUint32( data ) != NSF_IDENT || size < static_cast<int>(sizeof(NsfHeader)) )
+    {
+        return false;
+    }
+    memcpy( &m_header, data, sizeof(NsfHeader) );
+    m_program = data + sizeof(NsfHeader);
+    m_programSize = size - sizeof(NsfHeader);
+    // Starting song (1 based) is stored right after total songs
+    m_startTrack = data[7] ? data[7] - 1 : 0;
+    uint32_t dataLength = m_header.dataLength[0] | (m_header.dataLength[1] << 8) | (m_header.dataLength[2] << 16);
+    // NSF2 stores program size, if it is not zero, metadata chunks can follow program data
+    if ( m_header.version >= 2 && dataLength && dataLength <= static_cast<uint32_t>(m_programSize) )
+    {
+        m_programSize = dataLength;
+        if ( (m_header.nsf2Reserved & NSF2_FLAG_METADATA) &&
+             !parseChunks( m_program + dataLength, size - sizeof(NsfHeader) - dataLength, true ) )
+        {
+            clear();
+            return false;
+        }
+    }
+    if ( m_startTrack >= getTrackCount() ) m_startTrack = 0;
+    return true;
+}
+
+bool NsfMetadata::parseNsfe(const uint8_t *data, int size)
+{
+    m_header.ident = NSF_IDENT;
+    m_header.version = 1;
+    m_header.ntscPlaySpeed = NSFE_DEFAULT_PLAY_SPEED;
+    m_header.palPlaySpeed = NSFE_DEFAULT_PLAY_SPEED;
+    if ( !parseChunks( data, size, false ) )
+    {
+        clear();
+        return false;
+    }
+    // INFO chunk sets number of songs
+    if ( !m_header.songIndex || !m_program )
+    {
+        LOGE( "NSFe file has no INFO or DATA chunk\n" );
+        clear();
+        return false;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        const char *text = getAuthString( i );
+        uint8_t *field = i == 0 ? m_header.name : ( i == 1 ? m_header.artist : m_header.copyright );
+        if ( text && *text ) strncpy( reinterpret_cast<char *>(field), text, sizeof(m_header.name) );
+    }
+    if ( m_startTrack >= getTrackCount() ) m_startTrack = 0;
+    return true;
+}
+
+bool NsfMetadata::parseChunks(const uint8_t *data, int size, bool nsf2)
+{
+    const uint8_t *ptr = data;
+    const uint8_t *end = data + size;
+    while ( end - ptr >= 8 )
+    {
+        uint32_t length = readUint32( ptr );
+        uint32_t id = readUint32( ptr + 4 );
+        ptr += 8;
+        if ( length > static_cast<uint32_t>(end - ptr) )
+        {
+            LOGE( "NSFe chunk %08X is truncated\n", id );
+            return false;
+        }
+        const uint8_t *chunk = ptr;
+        ptr += length;
+        switch ( id )
+        {
+            case NSFE_CHUNK_INFO:
+                // NSF2 trailer takes program description from the header
+                if ( nsf2 ) break;
+                if ( length < 8 )
+                {
+                    LOGE( "NSFe INFO chunk is too short\n" );
+                    return false;
+                }
+                m_header.loadAddress = readUint16( chunk );
+                m_header.initAddress = readUint16( chunk + 2 );
+                m_header.playAddress = readUint16( chunk + 4 );
+                m_header.palNtscBits = chunk[6];
+                m_header.extraSoundChip = chunk[7];
+                m_header.songIndex = length > 8 && chunk[8] ? chunk[8] : 1;
+                m_startTrack = length > 9 ? chunk[9] : 0;
+                break;
+            case NSFE_CHUNK_DATA:
+                if ( nsf2 ) break;
+                m_program = chunk;
+                m_programSize = length;
+                break;
+            case NSFE_CHUNK_BANK:
+                if ( nsf2 ) break;
+                memcpy( m_header.bankSwitch, chunk, length < 8 ? length : 8 );
+                break;
+            case NSFE_CHUNK_RATE:
+                if ( nsf2 ) break;
+                if ( length >= 2 ) m_header.ntscPlaySpeed = readUint16( chunk );
+                if ( length >= 4 ) m_header.palPlaySpeed = readUint16( chunk + 2 );
+                break;
+            case NSFE_CHUNK_TIME:
+                m_times = chunk;
+                m_timeCount = length / 4;
+                break;
+            case NSFE_CHUNK_FADE:
+                m_fades = chunk;
+                m_fadeCount = length / 4;
+                break;
+            case NSFE_CHUNK_PLST:
+                m_playlist = chunk;
+                m_playlistSize = length;
+                break;
+            case NSFE_CHUNK_TLBL:
+                m_labels = reinterpret_cast<const char *>(chunk);
+                m_labelsSize = length;
+                break;
+            case NSFE_CHUNK_AUTH:
+                m_auth = reinterpret_cast<const char *>(chunk);
+                m_authSize = length;
+                break;
+            case NSFE_CHUNK_NEND:
+                return true;
+            default:
+                // Chunks with upper case first letter must be supported to play the file
+                if ( (id & 0xFF) >= 'A' && (id & 0xFF) <= 'Z' )
+                {
+                    LOGE( "Unsupported required NSFe chunk %08X\n", id );
+                    return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+int NsfMetadata::getSong(int track) const
+{
+    if ( track < 0 || track >= getTrackCount() )
+    {
+        return -1;
+    }
+    int song = m_playlistSize ? m_playlist[track] : track;
+    return song < getSongCount() ? song : -1;
+}
+
+bool NsfMetadata::getTrackTime(int track, uint32_t &duration, uint32_t &fade) const
+{
+    int song = getSong( track );
+    if ( song < 0 || song >= m_timeCount )
+    {
+        return false;
+    }
+    int32_t time = static_cast<int32_t>(readUint32( m_times + song * 4 ));
+    if ( time <= 0 )
+    {
+        return false;
+    }
+    int32_t fadeTime = song < m_fadeCount ? static_cast<int32_t>(readUint32( m_fades + song * 4 )) : -1;
+    duration = time;
+    fade = fadeTime < 0 ? NSFE_DEFAULT_FADE_MS : fadeTime;
+    return true;
+}
+
+const char *NsfMetadata::getTrackLabel(int track) const
+{
+    int song = getSong( track );
+    return song < 0 ? nullptr : getString( m_labels, m_labelsSize, song );
+}
+
+const char *NsfMetadata::getAuthString(int index) const
+{
+    return getString( m_auth, m_authSize, index );
+}
+
+const char *NsfMetadata::getString(const char *strings, int size, int index) const
+{
+    const char *end = strings + size;
+    while ( strings && strings < end )
+    {
+        const char *next = static_cast<const char *>(memchr( strings, 0, end - strings ));
+        if ( !next )
+        {
+            break;
+        }
+        if ( !index-- )
+        {
+            return strings;
+        }
+        strings = next + 1;
+    }
+    return nullptr;
+}
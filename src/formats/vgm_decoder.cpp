@@ -26,6 +26,9 @@ SOFTWARE.
 #include "formats/vgm_format.h"
 #include "chips/nsf_cartridge.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #define VGM_DECODER_DEBUG 1
 
 #if VGM_DECODER_DEBUG && !defined(VGM_DECODER_LOGGER)
@@ -36,6 +39,38 @@ SOFTWARE.
 /** Vgm file are always based on 44.1kHz rate */
 #define VGM_SAMPLE_RATE 44100
 
+enum
+{
+    LOOP_CACHE_IDLE,      // waiting for the loop start
+    LOOP_CACHE_RECORD,    // first loop pass, output is recorded
+    LOOP_CACHE_REPLAY,    // next loop passes, output is taken from the cache
+    LOOP_CACHE_DISABLED,
+};
+
+/**
+ * Length of each VGM command in bytes including command byte, 0 for unknown commands.
+ * 0x67 data block length is the length of data block header.
+ */
+static constexpr uint8_t commandLength[256] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x20
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 0x30
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, // 0x40
+    2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0x50
+    0, 3, 1, 1, 0, 0, 1, 7, 12, 0, 0, 0, 0, 0, 0, 0, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    5, 5, 6, 11, 2, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x90
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0xA0
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0xB0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xC0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xD0
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // 0xE0
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // 0xF0
+};
+
 VgmMusicDecoder::VgmMusicDecoder()
 {
 }
@@ -130,6 +165,17 @@ bool VgmMusicDecoder::open(const uint8_t * data, int size)
         m_nesChip->insertCartridge( cartridge );
 //        m_nesChip->setFrequency( m_header->nesApuClock );
     }
+    if ( !validate() )
+    {
+        close();
+        return false;
+    }
+    setObserver( m_observer );
+    if ( !compile() )
+    {
+        close();
+        return false;
+    }
 
     LOG( "Rate: %d\n", m_rate );
     LOG( "ay8910 frequency: %dHz\n", m_header->ay8910Clock );
@@ -148,12 +194,132 @@ void VgmMusicDecoder::close()
 {
     m_header = nullptr;
     m_rawData = nullptr;
+    m_nesDataCount = 0;
     m_samplesPlayed = 0;
+    if ( m_events )
+    {
+        free( m_events );
+        m_events = nullptr;
+    }
+    m_eventCount = 0;
+    m_eventIndex = 0;
+    stopLoopCache( LOOP_CACHE_IDLE );
     deleteChips();
 }
 
+bool VgmMusicDecoder::validate()
+{
+    if ( m_vgmDataOffset >= static_cast<uint32_t>(m_size) )
+    {
+        LOGE( "Vgm data offset 0x%08X is out of file\n", m_vgmDataOffset );
+        return false;
+    }
+    bool loopFound = m_loopOffset == 0;
+    uint32_t offset = m_vgmDataOffset;
+    while ( offset < static_cast<uint32_t>(m_size) )
+    {
+        const uint8_t *ptr = m_rawData + offset;
+        uint32_t left = m_size - offset;
+        if ( offset == m_loopOffset )
+        {
+            loopFound = true;
+        }
+        if ( *ptr == 0x66 )
+        {
+            if ( !loopFound )
+            {
+                LOGE( "Loop offset 0x%08X does not point to the command\n", m_loopOffset );
+                return false;
+            }
+            return true;
+        }
+        uint32_t length = commandLength[ *ptr ];
+        if ( length == 0 )
+        {
+            LOGE( "Unknown command (0x%02X) is detected at position 0x%08X \n", *ptr, offset );
+            return false;
+        }
+        if ( *ptr == 0x67 && length <= left )
+        {
+            if ( ptr[1] != 0x66 )
+            {
+                LOGE( "Data block at position 0x%08X has no 0x66 compatibility byte\n", offset );
+                return false;
+            }
+            uint32_t dataLength = ptr[3] | (ptr[4] << 8) | (ptr[5] << 16) | (static_cast<uint32_t>(ptr[6]) << 24);
+            if ( dataLength > left - length )
+            {
+                LOGE( "Data block at position 0x%08X is out of file\n", offset );
+                return false;
+            }
+            length += dataLength;
+        }
+        if ( length > left )
+        {
+            LOGE( "Command (0x%02X) at position 0x%08X is truncated\n", *ptr, offset );
+            return false;
+        }
+        offset += length;
+    }
+    LOGE( "End of sound data command is not found\n" );
+    return false;
+}
+
+bool VgmMusicDecoder::compile()
+{
+    // The first pass counts events, so no memory is wasted on growing the array
+    m_eventCount = compileEvents( nullptr );
+    m_events = static_cast<VgmEvent *>(malloc( (m_eventCount ? m_eventCount : 1) * sizeof(VgmEvent) ));
+    if ( m_events == nullptr )
+    {
+        LOGE( "Failed to allocate memory for %u vgm events\n", m_eventCount );
+        return false;
+    }
+    compileEvents( m_events );
+    m_eventIndex = 0;
+    m_loopSamples = 0;
+    for (uint32_t i = m_loopEvent; m_loopOffset && i < m_eventCount; i++)
+    {
+        m_loopSamples += m_events[i].wait;
+    }
+    LOG( "Compiled %u events, loop event %u\n", m_eventCount, m_loopEvent );
+    return true;
+}
+
+uint32_t VgmMusicDecoder::compileEvents(VgmEvent *events)
+{
+    uint32_t count = 0;
+    // Waits are not merged to the event before loop start and to the first event
+    bool newEvent = true;
+    m_dataPtr = m_rawData + m_vgmDataOffset;
+    for(;;)
+    {
+        if ( m_loopOffset && m_dataPtr == m_rawData + m_loopOffset )
+        {
+            m_loopEvent = count;
+            newEvent = true;
+        }
+        VgmEvent event{};
+        if ( !nextCommand( event, events != nullptr ) )
+        {
+            break;
+        }
+        if ( event.chip == VGM_EVENT_WAIT && !newEvent )
+        {
+            if ( events ) events[count - 1].wait += event.wait;
+        }
+        else if ( event.chip != VGM_EVENT_WAIT || event.wait )
+        {
+            if ( events ) events[count] = event;
+            count++;
+            newEvent = false;
+        }
+    }
+    return count;
+}
+
 
-bool VgmMusicDecoder::nextCommand()
+bool VgmMusicDecoder::nextCommand(VgmEvent &event, bool registerData)
 {
     uint8_t cmd = *m_dataPtr;
     LOG( "[0x%08X] command: 0x%02X", static_cast<uint32_t>(m_dataPtr - m_rawData), cmd);
@@ -194,49 +360,52 @@ bool VgmMusicDecoder::nextCommand()
         case 0x61: // nn nn : Wait n samples, n can range from 0 to 65535 (approx 1.49
                    // seconds). Longer pauses than this are represented by multiple
                    // wait commands.
-            m_waitSamples = ( m_dataPtr[1] | (m_dataPtr[2] << 8) ) + 1;
-            LOG( " [wait %d samples]", m_waitSamples);
+            event.wait = m_dataPtr[1] | (m_dataPtr[2] << 8);
+            LOG( " [wait %d samples]", event.wait);
             m_dataPtr += 3;
             break;
         case 0x62: //       : wait 735 samples (60th of a second), a shortcut for 0x61 0xdf 0x02
-            m_waitSamples = 735;
+            event.wait = 735;
             LOG( " [wait 735 samples]");
             m_dataPtr += 1;
             break;
         case 0x63: //       : wait 882 samples (50th of a second), a shortcut for 0x61 0x72 0x03
-            m_waitSamples = 882;
+            event.wait = 882;
             m_dataPtr += 1;
             break;
         case 0x66: //       : end of sound data
-            if ( m_loopOffset && m_loops != 1  )
-            {
-                m_dataPtr = m_rawData + m_loopOffset;
-                if ( m_loops ) m_loops--;
-            }
-            else
-            {
-                LOG( " [stop]\n" );
-                return false;
-            }
-            break;
+            LOG( " [stop]\n" );
+            return false;
         case 0x67: // ...   : data block: see below
             // 0x67 0x66 tt ss ss ss ss
         {
             LOG( " [DATA BLOCK type=0x%02X, len=0x%02X%02X%02X%02X]\n", m_dataPtr[2], m_dataPtr[6], m_dataPtr[5], m_dataPtr[4], m_dataPtr[3] );
             uint32_t dataLength = (m_dataPtr[3] + (m_dataPtr[4] << 8) + (m_dataPtr[5] << 16) + (m_dataPtr[6] << 24));
-            if ( m_nesChip && m_nesChip->getCartridge() )
+            // Type 0xC2 is NES APU RAM write
+            if ( registerData && m_dataPtr[2] == 0xC2 && m_nesChip && m_nesChip->getCartridge() )
             {
                 reinterpret_cast<NsfCartridge *>(m_nesChip->getCartridge())->setDataBlock( m_dataPtr + 7, dataLength );
+                if ( m_nesDataCount < APU_MAX_MEMORY_BLOCKS )
+                {
+                    m_nesData[m_nesDataCount] = m_dataPtr + 7;
+                    m_nesDataSize[m_nesDataCount++] = dataLength;
+                }
             }
             m_dataPtr += 7 + dataLength;
             break;
         }
         case 0x68: // ...   : PCM RAM write: see below
             LOG( " [PCM RAM WRITE]\n" );
+            m_dataPtr += commandLength[cmd];
             break;
         case 0xA0: // aa dd : AY8910, write value dd to register aa
             LOG( " [write ay8910 reg [0x%02X] = 0x%02X ]", m_dataPtr[1], m_dataPtr[2]);
-            m_msxChip->write( m_dataPtr[1], m_dataPtr[2] );
+            if ( m_msxChip )
+            {
+                event.chip = CHIP_WRITE_AY38910;
+                event.reg = m_dataPtr[1];
+                event.value = m_dataPtr[2];
+            }
             m_dataPtr += 3;
             break;
         case 0xB4: // aa dd : NES APU, write value dd to register aa
@@ -245,7 +414,12 @@ bool VgmMusicDecoder::nextCommand()
                    //       register 3F equals NES address 4023,
                    //       registers 40-7F equal NES address 4040-407F.
             LOG( " [write nesAPU reg [0x%02X] = 0x%02X ]", m_dataPtr[1], m_dataPtr[2]);
-            m_nesChip->getApu()->write( m_dataPtr[1], m_dataPtr[2] );
+            if ( m_nesChip )
+            {
+                event.chip = CHIP_WRITE_NES_APU;
+                event.reg = m_dataPtr[1];
+                event.value = m_dataPtr[2];
+            }
             m_dataPtr += 3;
             break;
         case 0xB0: // aa dd : RF5C68, write value dd to register aa
@@ -301,7 +475,7 @@ bool VgmMusicDecoder::nextCommand()
             if ( cmd >= 0x70 && cmd <= 0x7F )
             {
                 LOG( " [wait %d samples]", (cmd & 0x0F) + 1);
-                m_waitSamples = (cmd & 0x0F) + 1;
+                event.wait = (cmd & 0x0F) + 1;
                 //       : wait n+1 samples, n can range from 0 to 15.
                 m_dataPtr += 1;
                 break;
@@ -317,6 +491,7 @@ bool VgmMusicDecoder::nextCommand()
             else if ( cmd >= 0x90 && cmd <= 0x95 )
             {
                 //  : DAC Stream Control Write: see below
+                m_dataPtr += commandLength[cmd];
                 break;
             }
             else if ( cmd >= 0x32 && cmd <= 0x3E )
@@ -357,29 +532,231 @@ bool VgmMusicDecoder::nextCommand()
     return true;
 }
 
+void VgmMusicDecoder::setObserver(ChipWriteObserver *observer)
+{
+    m_observer = observer;
+    if ( m_msxChip ) m_msxChip->setObserver( m_observer );
+    if ( m_nesChip ) m_nesChip->getApu()->setObserver( m_observer );
+}
+
 void VgmMusicDecoder::setVolume( uint16_t volume )
 {
+    leaveLoopCache();
     if ( m_msxChip ) m_msxChip->setVolume( volume );
     if ( m_nesChip ) m_nesChip->getApu()->setVolume( volume );
 }
 
+void VgmMusicDecoder::setQuality( uint8_t quality )
+{
+    leaveLoopCache();
+    if ( m_msxChip ) m_msxChip->setQuality( quality );
+    if ( m_nesChip ) m_nesChip->getApu()->setQuality( quality );
+}
+
+void VgmMusicDecoder::setSampleFrequency( uint32_t frequency )
+{
+    leaveLoopCache();
+    m_sampleFrequency = frequency;
+    if ( m_msxChip ) m_msxChip->setSampleFrequency( frequency );
+    if ( m_nesChip ) m_nesChip->getApu()->setSampleFrequency( frequency );
+}
+
+void VgmMusicDecoder::setChannelMask( uint8_t mask )
+{
+    leaveLoopCache();
+    if ( m_msxChip ) m_msxChip->setChannelMask( mask );
+    if ( m_nesChip ) m_nesChip->getApu()->setChannelMask( mask );
+}
+
 uint32_t VgmMusicDecoder::getSample()
 {
     m_samplesPlayed++;
-    if ( m_msxChip ) return m_msxChip->getSample();
-    if ( m_nesChip ) return m_nesChip->getApu()->getSample();
+    if ( m_loopCacheState == LOOP_CACHE_REPLAY && m_loopCachePos < m_loopSamples ) return m_loopCache[ m_loopCachePos++ ];
+    uint32_t sample = 0;
+    if ( m_msxChip ) sample = m_msxChip->getSample();
+    else if ( m_nesChip ) sample = m_nesChip->getApu()->getSample();
+    if ( m_loopCacheState == LOOP_CACHE_RECORD && m_loopCachePos < m_loopSamples ) m_loopCache[ m_loopCachePos++ ] = sample;
+    return sample;
+}
+
+void VgmMusicDecoder::getSamples(uint32_t *buffer, uint32_t count)
+{
+    if ( !m_msxChip || m_loopCacheState == LOOP_CACHE_REPLAY )
+    {
+        BaseMusicDecoder::getSamples( buffer, count );
+        return;
+    }
+    m_msxChip->getSamples( buffer, count );
+    m_samplesPlayed += count;
+    for (uint32_t i = 0; m_loopCacheState == LOOP_CACHE_RECORD && i < count && m_loopCachePos < m_loopSamples; i++)
+    {
+        m_loopCache[ m_loopCachePos++ ] = buffer[i];
+    }
+}
+
+int VgmMusicDecoder::getStemCount()
+{
+    if ( m_msxChip ) return AY38910_STEMS;
+    if ( m_nesChip ) return NES_APU_STEMS;
+    return 0;
+}
+
+void VgmMusicDecoder::getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count)
+{
+    if ( m_loopCacheState == LOOP_CACHE_REPLAY )
+    {
+        stopLoopReplay();
+    }
+    else if ( m_loopCacheState == LOOP_CACHE_IDLE || m_loopCacheState == LOOP_CACHE_RECORD )
+    {
+        stopLoopCache( LOOP_CACHE_DISABLED );
+    }
+    if ( m_msxChip ) m_msxChip->getStems( buffer, stems, count );
+    else if ( m_nesChip ) m_nesChip->getApu()->getStems( buffer, stems, count );
+    else BaseMusicDecoder::getStems( buffer, stems, count );
+    m_samplesPlayed += count;
+}
+
+bool VgmMusicDecoder::analyzeTrack(int track, MusicTrackInfo &info)
+{
+    if ( !m_header || !m_header->totalSamples )
+    {
+        return false;
+    }
+    info.loopSamples = m_loopOffset ? m_header->loopSamples : 0;
+    if ( info.loopSamples > m_header->totalSamples ) info.loopSamples = m_header->totalSamples;
+    info.introSamples = m_header->totalSamples - info.loopSamples;
+    return true;
+}
+
+uint64_t VgmMusicDecoder::getChipsHash() const
+{
+    if ( m_msxChip ) return m_msxChip->getStateHash();
+    if ( m_nesChip ) return m_nesChip->getApu()->getStateHash();
     return 0;
 }
 
+void VgmMusicDecoder::startLoopCache()
+{
+    if ( m_observer || !m_loopCacheEnabled || m_loops == 1 || m_loopSamples == 0 || m_loopSamples > VGM_LOOP_CACHE_MAX_SAMPLES ||
+         m_sampleFrequency != VGM_SAMPLE_RATE )
+    {
+        m_loopCacheState = LOOP_CACHE_DISABLED;
+        return;
+    }
+    m_loopCache = static_cast<uint32_t *>(malloc( m_loopSamples * sizeof(uint32_t) ));
+    if ( m_loopCache == nullptr )
+    {
+        LOGI( "Not enough memory to cache the loop, it will be synthesized again\n" );
+        m_loopCacheState = LOOP_CACHE_DISABLED;
+        return;
+    }
+    m_loopStartHash = getChipsHash();
+    m_loopCachePos = 0;
+    m_loopCacheState = LOOP_CACHE_RECORD;
+}
+
+void VgmMusicDecoder::disableLoopCache()
+{
+    m_loopCacheEnabled = false;
+    if ( m_loopCacheState == LOOP_CACHE_REPLAY ) stopLoopReplay();
+    else stopLoopCache( LOOP_CACHE_DISABLED );
+}
+
+void VgmMusicDecoder::leaveLoopCache()
+{
+    // Cached output does not match the new chip settings, so the chips take over
+    // immediately, and the cache is not used until the file is opened again
+    if ( m_loopCacheState == LOOP_CACHE_REPLAY ) stopLoopReplay();
+    else if ( m_loopCacheState == LOOP_CACHE_RECORD ) stopLoopCache( LOOP_CACHE_DISABLED );
+}
+
+void VgmMusicDecoder::stopLoopReplay()
+{
+    // Chips keep the state of the loop start during replay, so loop events are rendered
+    // again up to the current position, and chips continue from there
+    uint32_t position = m_loopCachePos;
+    stopLoopCache( LOOP_CACHE_DISABLED );
+    uint32_t buffer[AY38910_BLOCK_SAMPLES];
+    for (uint32_t index = m_loopEvent; index < m_eventIndex; index++)
+    {
+        writeEvent( m_events[ index ] );
+        uint32_t wait = m_events[ index ].wait < position ? m_events[ index ].wait : position;
+        position -= wait;
+        while ( wait )
+        {
+            uint32_t size = wait < AY38910_BLOCK_SAMPLES ? wait : AY38910_BLOCK_SAMPLES;
+            if ( m_msxChip ) m_msxChip->getSamples( buffer, size );
+            for (uint32_t i = 0; m_nesChip && i < size; i++) m_nesChip->getApu()->getSample();
+            wait -= size;
+        }
+    }
+}
+
+void VgmMusicDecoder::writeEvent(const VgmEvent &event)
+{
+    switch ( event.chip )
+    {
+        case CHIP_WRITE_AY38910:
+            m_msxChip->write( event.reg, event.value );
+            break;
+        case CHIP_WRITE_NES_APU:
+            m_nesChip->getApu()->write( event.reg, event.value );
+            break;
+        default:
+            break;
+    }
+}
+
+void VgmMusicDecoder::stopLoopCache(uint8_t state)
+{
+    if ( m_loopCache )
+    {
+        free( m_loopCache );
+        m_loopCache = nullptr;
+    }
+    m_loopCachePos = 0;
+    m_loopCacheState = state;
+}
+
 int VgmMusicDecoder::decodeBlock()
 {
-    m_waitSamples = 0;
-    while ( !m_waitSamples )
+    for(;;)
     {
-        if (!nextCommand())
+        if ( m_eventIndex >= m_eventCount )
+        {
+            if ( !m_loopOffset || m_loops == 1 || m_loopEvent >= m_eventCount )
+            {
+                return 0;
+            }
+            if ( m_loopCacheState == LOOP_CACHE_RECORD )
+            {
+                // Same chip state at the loop start and end means that next pass gives the same output
+                if ( m_loopCachePos == m_loopSamples && getChipsHash() == m_loopStartHash )
+                {
+                    LOGI( "Loop output is replayed from the cache\n" );
+                    m_loopCacheState = LOOP_CACHE_REPLAY;
+                }
+                else
+                {
+                    stopLoopCache( LOOP_CACHE_DISABLED );
+                }
+            }
+            m_loopCachePos = 0;
+            m_eventIndex = m_loopEvent;
+            if ( m_loops ) m_loops--;
+        }
+        if ( m_eventIndex == m_loopEvent && m_loopCacheState == LOOP_CACHE_IDLE )
+        {
+            startLoopCache();
+        }
+        const VgmEvent &event = m_events[ m_eventIndex++ ];
+        // Chips are not updated during replay, cache contains their output
+        if ( m_loopCacheState != LOOP_CACHE_REPLAY ) writeEvent( event );
+        if ( event.wait )
         {
-            return 0;
+            m_waitSamples = event.wait;
+            return m_waitSamples;
         }
     }
-    return m_waitSamples;
 }
@@ -29,16 +29,44 @@ SOFTWARE.
 #include "music_decoder.h"
 #include "chips/ay-3-8910.h"
 #include "chips/nes_cpu.h"
+#include "chips/nsf_cartridge.h"
 
 typedef struct VgmHeader VgmHeader;
 
+/**
+ * Maximum loop length in samples, which output is cached to replay next loops
+ * without synthesis. 0 disables the cache.
+ */
+#ifndef VGM_LOOP_CACHE_MAX_SAMPLES
+#define VGM_LOOP_CACHE_MAX_SAMPLES (44100 * 180)
+#endif
+
+/** Event without chip write, only wait */
+#define VGM_EVENT_WAIT (0)
+
+/** Compiled VGM command: chip register write followed by the wait */
+typedef struct
+{
+    uint32_t wait;   // samples to wait after the write
+    uint8_t chip;    // CHIP_WRITE_AY38910, CHIP_WRITE_NES_APU or VGM_EVENT_WAIT
+    uint8_t reg;
+    uint8_t value;
+    uint8_t reserved;
+} VgmEvent;
+
 class VgmMusicDecoder: public BaseMusicDecoder
 {
 public:
     VgmMusicDecoder();
     ~VgmMusicDecoder();
 
-    /** Allows to open NSF and VGM data blocks */
+    /**
+     * Allows to open VGM data blocks. Command stream is validated and compiled
+     * to the array of events: commands for not emulated chips are dropped, waits
+     * are merged, and data blocks are registered once. Truncated command stream,
+     * unknown commands, data blocks outside of the file or without 0x66 compatibility
+     * byte and loop offset, not pointing to the command, make open() fail.
+     */
     bool open(const uint8_t *data, int size) override;
 
     static VgmMusicDecoder *tryOpen(const uint8_t *data, int size);
@@ -48,18 +76,89 @@ public:
 
     uint32_t getSample() override;
 
-    /** Sets volume, default level is 64 */
+    /** Reads count samples to buffer, AY-3-8910 renders them in one block */
+    void getSamples(uint32_t *buffer, uint32_t count) override;
+
+    /** Returns number of chip channels: 3 for AY-3-8910, 5 for NES APU */
+    int getStemCount() override;
+
+    /**
+     * Reads count samples and chip channels in one pass. Loop cache keeps only mixed
+     * output, so it is not used after the first getStems() call. If cached loop is already
+     * being replayed, chips render the loop again up to the current position (once).
+     */
+    void getStems(uint32_t *buffer, uint16_t *const *stems, uint32_t count) override;
+
+    /**
+     * Sets volume, default level is 100. Loop cache is not used after the change,
+     * if cached loop is being replayed, chips render the rest of it with new volume.
+     */
     void setVolume(uint16_t volume) override;
 
+    /**
+     * Sets synthesis quality of the chips. Like setVolume(), stops using loop cache,
+     * so the change is heard immediately.
+     */
+    void setQuality(uint8_t quality) override;
+
+    /**
+     * Sets output sample frequency of the chips. Loop cache is used only at 44100 Hz,
+     * since at other frequencies number of output samples in the loop varies.
+     */
+    void setSampleFrequency(uint32_t frequency) override;
+
+    /**
+     * Sets chip channels to play. Like setVolume(), stops using loop cache,
+     * so the change is heard immediately.
+     */
+    void setChannelMask(uint8_t mask) override;
+
     /**
      * Decodes data block and returns number of samples to read from decoder.
      * If it returns -1, then error occured, 0 means - nothing left.
      */
     int decodeBlock() override;
 
+    /** Returns intro and loop length from vgm header */
+    bool analyzeTrack(int track, MusicTrackInfo &info) override;
+
+    /**
+     * Sets observer for chip register writes, nullptr disables notifications.
+     * Loop cache is not used while observer is set, since all writes must be reported.
+     */
+    void setObserver(ChipWriteObserver *observer) override;
+
+    /** Returns AY-3-8910 chip of opened file, nullptr if the file has no AY-3-8910 */
+    AY38910 *getAY38910() const { return m_msxChip; }
+
+    /**
+     * Disables loop cache, so all loop passes write to the chips. Must be called before
+     * decoding, if chip output is rendered outside of the decoder (see VgmBatchDecoder).
+     */
+    void disableLoopCache();
+
+    /** Returns vgm header of opened file */
+    const VgmHeader *getHeader() const { return m_header; }
+
+    /** Returns compiled events of opened file */
+    const VgmEvent *getEvents() const { return m_events; }
+
+    /** Returns number of compiled events */
+    uint32_t getEventCount() const { return m_eventCount; }
+
+    /** Returns index of the first event in the loop, or -1 if there is no loop */
+    int getLoopEvent() const { return m_loopOffset ? static_cast<int>(m_loopEvent) : -1; }
+
+    /** Returns number of NES APU RAM data blocks (type 0xC2), used by DMC channel */
+    int getNesDataBlockCount() const { return m_nesDataCount; }
+
+    /** Returns NES APU RAM data block (address and data) */
+    const uint8_t *getNesDataBlock(int index, uint32_t &size) const { size = m_nesDataSize[index]; return m_nesData[index]; }
+
 private:
     AY38910 *m_msxChip = nullptr;
     NesCpu  *m_nesChip = nullptr;
+    ChipWriteObserver *m_observer = nullptr;
 
     const uint8_t * m_rawData = nullptr;
     int m_size = 0;
@@ -68,6 +167,9 @@ private:
     const uint8_t * m_dataPtr = nullptr;
 
     const VgmHeader *m_header = nullptr;
+    const uint8_t *m_nesData[APU_MAX_MEMORY_BLOCKS]{};
+    uint32_t m_nesDataSize[APU_MAX_MEMORY_BLOCKS]{};
+    int m_nesDataCount = 0;
 
     uint32_t m_rate;
     uint32_t m_vgmDataOffset;
@@ -75,9 +177,35 @@ private:
     uint8_t  m_loops;
     uint32_t m_waitSamples = 0;
     uint32_t m_samplesPlayed = 0;
+    uint32_t m_sampleFrequency = 44100;
 
-    uint8_t m_state = 0;
+    VgmEvent *m_events = nullptr;
+    uint32_t m_eventCount = 0;
+    uint32_t m_eventIndex = 0;
+    /** Index of the first event in the loop, valid if m_loopOffset is not zero */
+    uint32_t m_loopEvent = 0;
+    /** Loop length in samples */
+    uint32_t m_loopSamples = 0;
 
-    bool nextCommand();
+    /**
+     * Output of the first loop pass. If chip state at the end of the loop equals
+     * the state at the loop start, next passes are replayed from the cache.
+     */
+    uint32_t *m_loopCache = nullptr;
+    uint32_t m_loopCachePos = 0;
+    uint64_t m_loopStartHash = 0;
+    uint8_t m_loopCacheState = 0;
+    bool m_loopCacheEnabled = true;
+
+    bool validate();
+    bool nextCommand(VgmEvent &event, bool registerData);
+    uint32_t compileEvents(VgmEvent *events);
+    bool compile();
     void deleteChips();
+    uint64_t getChipsHash() const;
+    void startLoopCache();
+    void stopLoopCache(uint8_t state);
+    void stopLoopReplay();
+    void leaveLoopCache();
+    void writeEvent(const VgmEvent &event);
 };
@@ -0,0 +1,180 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "formats/vgm_writer.h"
+
+#include <string.h>
+
+#define VGM_WRITER_DEBUG 1
+
+#if VGM_WRITER_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER VGM_WRITER_DEBUG
+#endif
+#include "../vgm_logger.h"
+
+/** Maximum wait, which can be encoded by single 0x61 command */
+#define VGM_MAX_WAIT (65535)
+
+VgmWriter::VgmWriter()
+{
+    m_header.ident = 0x206D6756;
+    m_header.version = 0x00000171;
+    m_header.vgmDataOffset = sizeof(VgmHeader) - 0x34;
+}
+
+VgmWriter::~VgmWriter()
+{
+}
+
+void VgmWriter::setAy8910(uint32_t clock, uint8_t type, uint8_t flags)
+{
+    m_header.ay8910Clock = clock;
+    m_header.ay8910Type = type;
+    m_header.ay8910Flags = flags;
+}
+
+void VgmWriter::setNesApu(uint32_t clock)
+{
+    m_header.nesApuClock = clock;
+}
+
+void VgmWriter::clear()
+{
+    m_data.clear();
+    m_pendingWait = 0;
+    m_totalSamples = 0;
+    m_loop = false;
+    m_loopOffset = 0;
+    m_loopSample = 0;
+}
+
+void VgmWriter::write(uint8_t command, uint8_t reg, uint8_t value)
+{
+    flushWait();
+    m_data.push_back( command );
+    m_data.push_back( reg );
+    m_data.push_back( value );
+}
+
+void VgmWriter::wait(uint32_t samples)
+{
+    m_pendingWait += samples;
+    m_totalSamples += samples;
+}
+
+void VgmWriter::dataBlock(uint8_t type, const uint8_t *data, uint32_t size)
+{
+    flushWait();
+    const uint8_t header[] = { 0x67, 0x66, type,
+                               static_cast<uint8_t>(size), static_cast<uint8_t>(size >> 8),
+                               static_cast<uint8_t>(size >> 16), static_cast<uint8_t>(size >> 24) };
+    m_data.insert( m_data.end(), header, header + sizeof(header) );
+    m_data.insert( m_data.end(), data, data + size );
+}
+
+void VgmWriter::setGd3(const uint8_t *data, uint32_t size)
+{
+    m_gd3.assign( data, data + size );
+}
+
+void VgmWriter::setLoop()
+{
+    flushWait();
+    m_loop = true;
+    m_loopOffset = m_data.size();
+    m_loopSample = m_totalSamples;
+}
+
+/** Returns single byte command for the wait or -1 if there is no such command */
+static int shortWaitCommand(uint32_t samples)
+{
+    if ( samples == 735 ) return 0x62;
+    if ( samples == 882 ) return 0x63;
+    if ( samples >= 1 && samples <= 16 ) return 0x70 + samples - 1;
+    return -1;
+}
+
+void VgmWriter::flushWait()
+{
+    static const uint32_t shortWaits[] = { 735, 882, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+    while ( m_pendingWait )
+    {
+        int command = shortWaitCommand( m_pendingWait );
+        if ( command >= 0 )
+        {
+            m_data.push_back( command );
+            m_pendingWait = 0;
+            break;
+        }
+        // Two single byte commands are shorter than 0x61 nn nn
+        for ( uint32_t first: shortWaits )
+        {
+            if ( first < m_pendingWait && shortWaitCommand( m_pendingWait - first ) >= 0 )
+            {
+                m_data.push_back( shortWaitCommand( first ) );
+                m_data.push_back( shortWaitCommand( m_pendingWait - first ) );
+                m_pendingWait = 0;
+                break;
+            }
+        }
+        if ( !m_pendingWait )
+        {
+            break;
+        }
+        uint32_t samples = m_pendingWait > VGM_MAX_WAIT ? VGM_MAX_WAIT : m_pendingWait;
+        m_data.push_back( 0x61 );
+        m_data.push_back( samples & 0xFF );
+        m_data.push_back( samples >> 8 );
+        m_pendingWait -= samples;
+    }
+}
+
+bool VgmWriter::save(FILE *file)
+{
+    flushWait();
+    VgmHeader header = m_header;
+    uint32_t size = sizeof(VgmHeader) + m_data.size() + 1;
+    if ( m_gd3.size() )
+    {
+        header.gd3Offset = size - 0x14;
+        size += m_gd3.size();
+    }
+    header.eofOffset = size - 4;
+    header.totalSamples = m_totalSamples;
+    if ( m_loop )
+    {
+        header.loopOffset = sizeof(VgmHeader) + m_loopOffset - 0x1C;
+        header.loopSamples = m_totalSamples - m_loopSample;
+    }
+    const uint8_t end = 0x66;
+    if ( fwrite( &header, sizeof(header), 1, file ) != 1 ||
+         ( m_data.size() && fwrite( m_data.data(), m_data.size(), 1, file ) != 1 ) ||
+         fwrite( &end, sizeof(end), 1, file ) != 1 ||
+         ( m_gd3.size() && fwrite( m_gd3.data(), m_gd3.size(), 1, file ) != 1 ) )
+    {
+        LOGE( "Failed to write VGM data\n" );
+        return false;
+    }
+    return true;
+}
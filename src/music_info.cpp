@@ -0,0 +1,347 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "music_info.h"
+#include "formats/vgm_format.h"
+#include "formats/nsf_metadata.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define MUSIC_INFO_DEBUG 1
+
+#if MUSIC_INFO_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER MUSIC_INFO_DEBUG
+#endif
+#include "vgm_logger.h"
+
+#define VGM_IDENT  0x206D6756 // "Vgm "
+#define GD3_IDENT  0x20336447 // "Gd3 "
+
+#define NES_NTSC_CLOCK 1789773
+#define NES_PAL_CLOCK  1662607
+
+/** Durations are in 44.1kHz samples, like VGM header */
+#define VGM_SAMPLE_RATE 44100
+
+/** Bits 30 and 31 of VGM clocks are flags (dual chip, chip variant) */
+#define VGM_CLOCK_MASK 0x3FFFFFFF
+
+/** Clock fields of VGM header for the chips, which are reported as MUSIC_CHIP_OTHER */
+static const uint8_t otherClockOffsets[] =
+{
+    offsetof(VgmHeader, segaPcmClock),  offsetof(VgmHeader, rf5c68Clock),
+    offsetof(VgmHeader, ym2203Clock),   offsetof(VgmHeader, ym2608Clock),
+    offsetof(VgmHeader, ym2610bClock),  offsetof(VgmHeader, ym3812Clock),
+    offsetof(VgmHeader, ym3526Clock),   offsetof(VgmHeader, y8950Clock),
+    offsetof(VgmHeader, ymf262Clock),   offsetof(VgmHeader, ymf278bClock),
+    offsetof(VgmHeader, ymf271Clock),   offsetof(VgmHeader, ymz280bClock),
+    offsetof(VgmHeader, rf5c164Clock),  offsetof(VgmHeader, pwmClock),
+    offsetof(VgmHeader, multiPcmClock), offsetof(VgmHeader, upd7759Clock),
+    offsetof(VgmHeader, okim6258Clock), offsetof(VgmHeader, oki6295Clock),
+    offsetof(VgmHeader, k051649Clock),  offsetof(VgmHeader, k054539Clock),
+    offsetof(VgmHeader, huc6280Clock),  offsetof(VgmHeader, c140Clock),
+    offsetof(VgmHeader, k053260Clock),  offsetof(VgmHeader, pokeyClock),
+    offsetof(VgmHeader, qsoundClock),   offsetof(VgmHeader, scspClock),
+    offsetof(VgmHeader, wswanClock),    offsetof(VgmHeader, vsuClock),
+    offsetof(VgmHeader, saa1090Clock),  offsetof(VgmHeader, es5503Clock),
+    offsetof(VgmHeader, es5506Clock),   offsetof(VgmHeader, x1010Clock),
+    offsetof(VgmHeader, c352Clock),     offsetof(VgmHeader, ga20Clock),
+};
+
+static uint32_t readUint32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+void MusicInfo::clear()
+{
+    m_format = MUSIC_FORMAT_UNKNOWN;
+    m_chips = 0;
+    m_ay8910Clock = 0;
+    m_ay8910Type = 0;
+    m_nesApuClock = 0;
+    m_trackCount = 0;
+    m_startTrack = 0;
+    m_totalSamples = 0;
+    m_loopSamples = 0;
+    m_nsf.clear();
+    for (int i = 0; i < MUSIC_TAG_COUNT; i++)
+    {
+        m_tags[i] = { nullptr, 0, MUSIC_TAG_ASCII };
+    }
+}
+
+bool MusicInfo::probe(const uint8_t *data, int size)
+{
+    clear();
+    if ( probeVgm( data, size ) || probeNsf( data, size ) )
+    {
+        return true;
+    }
+    clear();
+    return false;
+}
+
+const MusicTag &MusicInfo::getTag(int tag) const
+{
+    static const MusicTag empty{ nullptr, 0, MUSIC_TAG_ASCII };
+    if ( tag < 0 || tag >= MUSIC_TAG_COUNT )
+    {
+        return empty;
+    }
+    return m_tags[tag];
+}
+
+bool MusicInfo::probeVgm(const uint8_t *data, int size)
+{
+    if ( size < 0x40 || readUint32( data ) != VGM_IDENT )
+    {
+        return false;
+    }
+    uint32_t version = readUint32( data + offsetof(VgmHeader, version) );
+    // Fields after the end of the header belong to vgm data and must be read as 0
+    uint32_t headerSize = 0x40;
+    uint32_t dataOffset = readUint32( data + offsetof(VgmHeader, vgmDataOffset) );
+    if ( version >= 0x00000150 && dataOffset )
+    {
+        headerSize = dataOffset + offsetof(VgmHeader, vgmDataOffset);
+    }
+    if ( headerSize > sizeof(VgmHeader) ) headerSize = sizeof(VgmHeader);
+    if ( headerSize > static_cast<uint32_t>(size) ) headerSize = size;
+    VgmHeader header{};
+    memcpy( &header, data, headerSize );
+
+    m_format = MUSIC_FORMAT_VGM;
+    m_trackCount = 1;
+    m_totalSamples = header.totalSamples;
+    m_loopSamples = header.loopOffset ? header.loopSamples : 0;
+    if ( m_loopSamples > m_totalSamples ) m_loopSamples = m_totalSamples;
+
+    if ( header.sn76489Clock ) m_chips |= MUSIC_CHIP_SN76489;
+    if ( header.ym2413Clock ) m_chips |= MUSIC_CHIP_YM2413;
+    if ( version >= 0x00000110 )
+    {
+        if ( header.ym2612Clock ) m_chips |= MUSIC_CHIP_YM2612;
+        if ( header.ym2151Clock ) m_chips |= MUSIC_CHIP_YM2151;
+    }
+    if ( header.gbDmgClock ) m_chips |= MUSIC_CHIP_GB_DMG;
+    if ( header.ay8910Clock )
+    {
+        m_chips |= MUSIC_CHIP_AY38910;
+        m_ay8910Clock = header.ay8910Clock & VGM_CLOCK_MASK;
+        m_ay8910Type = header.ay8910Type;
+    }
+    if ( header.nesApuClock )
+    {
+        m_chips |= MUSIC_CHIP_NES_APU;
+        m_nesApuClock = header.nesApuClock & VGM_CLOCK_MASK;
+    }
+    for (uint8_t offset: otherClockOffsets)
+    {
+        if ( readUint32( reinterpret_cast<const uint8_t *>(&header) + offset ) )
+        {
+            m_chips |= MUSIC_CHIP_OTHER;
+            break;
+        }
+    }
+    if ( header.gd3Offset )
+    {
+        parseGd3( data, size, header.gd3Offset + offsetof(VgmHeader, gd3Offset) );
+    }
+    return true;
+}
+
+void MusicInfo::parseGd3(const uint8_t *data, int size, uint32_t offset)
+{
+    // English and Japanese versions of title, game, system and author, then date, ripper, notes
+    static const int8_t gd3Tags[] =
+    {
+        MUSIC_TAG_TITLE, MUSIC_TAG_TITLE, MUSIC_TAG_GAME, MUSIC_TAG_GAME,
+        MUSIC_TAG_SYSTEM, MUSIC_TAG_SYSTEM, MUSIC_TAG_AUTHOR, MUSIC_TAG_AUTHOR,
+        MUSIC_TAG_DATE, MUSIC_TAG_RIPPER, MUSIC_TAG_NOTES,
+    };
+    if ( offset >= static_cast<uint32_t>(size) || size - offset < 12 ||
+         readUint32( data + offset ) != GD3_IDENT )
+    {
+        LOGE( "GD3 tag is not found at 0x%08X\n", offset );
+        return;
+    }
+    uint32_t length = readUint32( data + offset + 8 );
+    const uint8_t *ptr = data + offset + 12;
+    if ( length > size - offset - 12 ) length = size - offset - 12;
+    const uint8_t *end = ptr + ( length & ~1 );
+    for (int8_t tag: gd3Tags)
+    {
+        const uint8_t *text = ptr;
+        while ( ptr < end && ( ptr[0] || ptr[1] ) ) ptr += 2;
+        // Japanese text is used only if there is no english one
+        if ( m_tags[tag].length == 0 )
+        {
+            m_tags[tag] = { text, static_cast<uint32_t>(ptr - text), MUSIC_TAG_UTF16LE };
+        }
+        if ( ptr >= end )
+        {
+            break;
+        }
+        ptr += 2;
+    }
+}
+
+bool MusicInfo::probeNsf(const uint8_t *data, int size)
+{
+    NsfMetadata &metadata = m_nsf;
+    if ( !metadata.parse( data, size ) )
+    {
+        return false;
+    }
+    // Header of NSFe file is built by the parser, tags are taken from auth chunk
+    const NsfHeader *header = readUint32( data ) == NSF_IDENT ? reinterpret_cast<const NsfHeader *>(data) : nullptr;
+    m_format = MUSIC_FORMAT_NSF;
+    m_trackCount = metadata.getTrackCount();
+    m_startTrack = metadata.getStartTrack();
+    const NsfHeader &info = metadata.getHeader();
+    m_chips = MUSIC_CHIP_NES_APU;
+    m_nesApuClock = ( info.palNtscBits & 0x03 ) == 0x01 ? NES_PAL_CLOCK : NES_NTSC_CLOCK;
+    static const uint32_t expansionChips[] =
+    {
+        MUSIC_CHIP_VRC6, MUSIC_CHIP_VRC7, MUSIC_CHIP_FDS, MUSIC_CHIP_MMC5, MUSIC_CHIP_N163, MUSIC_CHIP_S5B,
+    };
+    for (int i = 0; i < 6; i++)
+    {
+        if ( info.extraSoundChip & (1 << i) ) m_chips |= expansionChips[i];
+    }
+    if ( header )
+    {
+        m_tags[MUSIC_TAG_TITLE] = { header->name, static_cast<uint32_t>(strnlen( reinterpret_cast<const char *>(header->name), sizeof(header->name) )), MUSIC_TAG_ASCII };
+        m_tags[MUSIC_TAG_AUTHOR] = { header->artist, static_cast<uint32_t>(strnlen( reinterpret_cast<const char *>(header->artist), sizeof(header->artist) )), MUSIC_TAG_ASCII };
+        m_tags[MUSIC_TAG_COPYRIGHT] = { header->copyright, static_cast<uint32_t>(strnlen( reinterpret_cast<const char *>(header->copyright), sizeof(header->copyright) )), MUSIC_TAG_ASCII };
+    }
+    // NSFe auth chunk or NSF2 metadata
+    static const int authTags[] = { MUSIC_TAG_TITLE, MUSIC_TAG_AUTHOR, MUSIC_TAG_COPYRIGHT, MUSIC_TAG_RIPPER };
+    for (int i = 0; i < 4; i++)
+    {
+        const char *text = metadata.getAuthString( i );
+        if ( text && *text ) m_tags[authTags[i]] = { reinterpret_cast<const uint8_t *>(text), static_cast<uint32_t>(strlen( text )), MUSIC_TAG_ASCII };
+    }
+    return true;
+}
+
+bool MusicInfo::getTrackSamples(int track, uint32_t &totalSamples, uint32_t &fadeSamples) const
+{
+    if ( track < 0 || track >= m_trackCount )
+    {
+        return false;
+    }
+    if ( m_format == MUSIC_FORMAT_NSF )
+    {
+        uint32_t duration, fade;
+        if ( !m_nsf.getTrackTime( track, duration, fade ) )
+        {
+            return false;
+        }
+        // Same rounding, as VgmFile uses for track duration
+        totalSamples = static_cast<uint64_t>(duration + fade) * VGM_SAMPLE_RATE / 1000;
+        fadeSamples = static_cast<uint64_t>(fade) * VGM_SAMPLE_RATE / 1000;
+        return true;
+    }
+    totalSamples = m_totalSamples;
+    fadeSamples = 0;
+    return m_totalSamples != 0;
+}
+
+/** Appends UTF-8 encoded code point to the buffer, returns false if there is no space */
+static bool appendUtf8(char *buffer, int size, int &pos, uint32_t code)
+{
+    char bytes[4];
+    int count;
+    if ( code < 0x80 )
+    {
+        bytes[0] = code;
+        count = 1;
+    }
+    else if ( code < 0x800 )
+    {
+        bytes[0] = 0xC0 | (code >> 6);
+        bytes[1] = 0x80 | (code & 0x3F);
+        count = 2;
+    }
+    else if ( code < 0x10000 )
+    {
+        bytes[0] = 0xE0 | (code >> 12);
+        bytes[1] = 0x80 | ((code >> 6) & 0x3F);
+        bytes[2] = 0x80 | (code & 0x3F);
+        count = 3;
+    }
+    else
+    {
+        bytes[0] = 0xF0 | (code >> 18);
+        bytes[1] = 0x80 | ((code >> 12) & 0x3F);
+        bytes[2] = 0x80 | ((code >> 6) & 0x3F);
+        bytes[3] = 0x80 | (code & 0x3F);
+        count = 4;
+    }
+    if ( pos + count >= size )
+    {
+        return false;
+    }
+    memcpy( buffer + pos, bytes, count );
+    pos += count;
+    return true;
+}
+
+int MusicInfo::copyTag(const MusicTag &tag, char *buffer, int size)
+{
+    int pos = 0;
+    if ( size <= 0 )
+    {
+        return 0;
+    }
+    if ( tag.encoding == MUSIC_TAG_ASCII )
+    {
+        for (uint32_t i = 0; i < tag.length && tag.data[i]; i++)
+        {
+            if ( !appendUtf8( buffer, size, pos, tag.data[i] ) ) break;
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i + 1 < tag.length; i += 2)
+        {
+            uint32_t code = tag.data[i] | (tag.data[i + 1] << 8);
+            if ( code >= 0xD800 && code < 0xDC00 && i + 3 < tag.length )
+            {
+                uint32_t low = tag.data[i + 2] | (tag.data[i + 3] << 8);
+                if ( low >= 0xDC00 && low < 0xE000 )
+                {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    i += 2;
+                }
+            }
+            if ( !appendUtf8( buffer, size, pos, code ) ) break;
+        }
+    }
+    buffer[pos] = '\0';
+    return pos;
+}
@@ -0,0 +1,254 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "nsf_vgm_exporter.h"
+#include "formats/nsf_decoder.h"
+#include "formats/vgm_writer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+#define NSF_VGM_EXPORTER_DEBUG 1
+
+#if NSF_VGM_EXPORTER_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER NSF_VGM_EXPORTER_DEBUG
+#endif
+#include "vgm_logger.h"
+
+/** Vgm file are always based on 44.1kHz rate */
+#define VGM_SAMPLE_RATE 44100
+
+#define NES_APU_CLOCK   1789773
+
+/** DMC samples can be located at $C000-$FFFF only */
+#define DMC_MEMORY_BASE 0xC000
+#define DMC_MEMORY_SIZE 0x4000
+
+/** VGM data block type for NES APU RAM */
+#define VGM_NES_APU_DATA_BLOCK 0xC2
+
+NsfVgmExporter::NsfVgmExporter()
+{
+    setMaxDuration( 3 * 60 * 1000 );
+}
+
+NsfVgmExporter::~NsfVgmExporter()
+{
+    close();
+}
+
+bool NsfVgmExporter::open(const uint8_t *data, int size)
+{
+    close();
+    m_decoder = NsfMusicDecoder::tryOpen( data, size );
+    if ( m_decoder == nullptr )
+    {
+        return false;
+    }
+    m_decoder->setObserver( this );
+    return true;
+}
+
+void NsfVgmExporter::close()
+{
+    if ( m_decoder )
+    {
+        delete m_decoder;
+        m_decoder = nullptr;
+    }
+    clear();
+}
+
+void NsfVgmExporter::clear()
+{
+    m_events.clear();
+    memset( m_regs, 0, sizeof(m_regs) );
+    if ( m_dmcMemory )
+    {
+        free( m_dmcMemory );
+        m_dmcMemory = nullptr;
+    }
+    m_dmcUsed.clear();
+    m_dmcStart = DMC_MEMORY_SIZE;
+    m_dmcEnd = 0;
+    m_dmcConflict = false;
+    m_loop = false;
+    m_loopEvent = 0;
+    m_loopSample = 0;
+    m_totalSamples = 0;
+}
+
+int NsfVgmExporter::getTrackCount()
+{
+    return m_decoder ? m_decoder->getTrackCount() : 0;
+}
+
+void NsfVgmExporter::setMaxDuration(uint32_t milliseconds)
+{
+    m_maxSamples = static_cast<uint64_t>( milliseconds ) * VGM_SAMPLE_RATE / 1000;
+}
+
+bool NsfVgmExporter::convert(int track)
+{
+    clear();
+    if ( m_decoder == nullptr || track < 0 || track >= getTrackCount() )
+    {
+        return false;
+    }
+    setPosition( 0 );
+    if ( !m_decoder->startTrack( track ) )
+    {
+        return false;
+    }
+    // Maps state hash to the index of the play routine call, which starts from that state
+    std::unordered_map<uint64_t, uint32_t> states;
+    // First event index and sample position of each play routine call
+    std::vector<uint32_t> frameEvents;
+    std::vector<uint32_t> frameSamples;
+    states[ m_decoder->getStateHash() ] = 0;
+    uint32_t samples = 0;
+    while ( samples < m_maxSamples )
+    {
+        frameEvents.push_back( m_events.size() );
+        frameSamples.push_back( samples );
+        setPosition( samples );
+        int result = m_decoder->decodeBlock();
+        if ( result < 0 )
+        {
+            return false;
+        }
+        if ( result == 0 )
+        {
+            break;
+        }
+        samples += result;
+        uint64_t hash = m_decoder->getStateHash();
+        auto it = states.find( hash );
+        if ( it != states.end() )
+        {
+            m_loop = true;
+            m_loopEvent = frameEvents[ it->second ];
+            m_loopSample = frameSamples[ it->second ];
+            break;
+        }
+        states[ hash ] = frameEvents.size();
+    }
+    m_totalSamples = samples;
+    if ( m_dmcConflict )
+    {
+        LOGE( "DMC sample memory is changed by the track, VGM may sound different\n" );
+    }
+    LOGI( "Track %d: %u samples, loop %u samples\n", track, m_totalSamples, getLoopSamples() );
+    return true;
+}
+
+void NsfVgmExporter::onWrite(uint8_t chip, uint8_t reg, uint8_t value)
+{
+    if ( chip != CHIP_WRITE_NES_APU )
+    {
+        return;
+    }
+    m_events.push_back( { getPosition(), reg, value } );
+    if ( reg < sizeof(m_regs) )
+    {
+        m_regs[reg] = value;
+    }
+    // Writing 1 to DMC enable bit of $4015 starts the sample
+    if ( reg == 0x15 && ( value & 0x10 ) )
+    {
+        captureDmcSample();
+    }
+}
+
+void NsfVgmExporter::captureDmcSample()
+{
+    if ( m_dmcMemory == nullptr )
+    {
+        m_dmcMemory = static_cast<uint8_t *>(malloc( DMC_MEMORY_SIZE ));
+        if ( m_dmcMemory == nullptr )
+        {
+            LOGE( "Failed to allocate memory for DMC samples\n" );
+            return;
+        }
+        m_dmcUsed.assign( DMC_MEMORY_SIZE, false );
+    }
+    uint32_t offset = static_cast<uint32_t>( m_regs[0x12] ) * 64;
+    uint32_t length = static_cast<uint32_t>( m_regs[0x13] ) * 16 + 1;
+    if ( offset + length > DMC_MEMORY_SIZE )
+    {
+        // Samples wrap around to $8000 on real hardware, such data is not supported by VGM
+        length = DMC_MEMORY_SIZE - offset;
+    }
+    for (uint32_t i = offset; i < offset + length; i++)
+    {
+        uint8_t data = m_decoder->readMemory( DMC_MEMORY_BASE + i );
+        if ( m_dmcUsed[i] && m_dmcMemory[i] != data )
+        {
+            m_dmcConflict = true;
+        }
+        m_dmcMemory[i] = data;
+        m_dmcUsed[i] = true;
+    }
+    if ( offset < m_dmcStart ) m_dmcStart = offset;
+    if ( offset + length > m_dmcEnd ) m_dmcEnd = offset + length;
+}
+
+bool NsfVgmExporter::save(FILE *file)
+{
+    VgmWriter writer;
+    writer.setNesApu( NES_APU_CLOCK );
+    if ( m_dmcEnd > m_dmcStart )
+    {
+        // NES APU RAM data block starts with 2 bytes of memory address
+        std::vector<uint8_t> block( 2 + m_dmcEnd - m_dmcStart, 0 );
+        uint16_t address = DMC_MEMORY_BASE + m_dmcStart;
+        block[0] = address & 0xFF;
+        block[1] = address >> 8;
+        for (uint32_t i = m_dmcStart; i < m_dmcEnd; i++)
+        {
+            if ( m_dmcUsed[i] ) block[2 + i - m_dmcStart] = m_dmcMemory[i];
+        }
+        writer.dataBlock( VGM_NES_APU_DATA_BLOCK, block.data(), block.size() );
+    }
+    uint32_t position = 0;
+    for (uint32_t i = 0; i <= m_events.size(); i++)
+    {
+        if ( m_loop && i == m_loopEvent )
+        {
+            writer.wait( m_loopSample - position );
+            position = m_loopSample;
+            writer.setLoop();
+        }
+        if ( i == m_events.size() )
+        {
+            break;
+        }
+        writer.wait( m_events[i].sample - position );
+        position = m_events[i].sample;
+        writer.write( CHIP_WRITE_NES_APU, m_events[i].reg, m_events[i].value );
+    }
+    writer.wait( m_totalSamples - position );
+    return writer.save( file );
+}
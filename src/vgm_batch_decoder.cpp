@@ -0,0 +1,181 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "vgm_batch_decoder.h"
+#include "formats/vgm_decoder.h"
+
+#include <string.h>
+
+#define VGM_BATCH_DECODER_DEBUG 1
+
+#if VGM_BATCH_DECODER_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER VGM_BATCH_DECODER_DEBUG
+#endif
+#include "vgm_logger.h"
+
+/** Vgm file are always based on 44.1kHz rate */
+#define VGM_SAMPLE_RATE 44100
+
+VgmBatchDecoder::VgmBatchDecoder()
+{
+    setMaxDuration( 3 * 60 * 1000 );
+}
+
+VgmBatchDecoder::~VgmBatchDecoder()
+{
+    for (int lane = 0; lane < VGM_BATCH_DECODER_LANES; lane++)
+    {
+        close( lane );
+    }
+}
+
+bool VgmBatchDecoder::open(int lane, const uint8_t *data, int size)
+{
+    close( lane );
+    m_samplesPlayed[lane] = 0;
+    m_waitSamples[lane] = 0;
+    VgmMusicDecoder *decoder = VgmMusicDecoder::tryOpen( data, size );
+    if ( !decoder )
+    {
+        return false;
+    }
+    if ( !decoder->getAY38910() )
+    {
+        LOGE( "Only VGM files with AY-3-8910 chip can be decoded in batch\n" );
+        delete decoder;
+        return false;
+    }
+    // Chip output is not read from decoder, so the loop must be written to the chip each pass
+    decoder->disableLoopCache();
+    decoder->setVolume( m_volume );
+    if ( !m_batch.setChip( lane, decoder->getAY38910() ) )
+    {
+        delete decoder;
+        return false;
+    }
+    m_decoders[lane] = decoder;
+    return true;
+}
+
+void VgmBatchDecoder::close(int lane)
+{
+    m_batch.setChip( lane, nullptr );
+    if ( m_decoders[lane] )
+    {
+        delete m_decoders[lane];
+        m_decoders[lane] = nullptr;
+    }
+}
+
+void VgmBatchDecoder::setMaxDuration(uint32_t milliseconds)
+{
+    m_duration = static_cast<uint64_t>(milliseconds) * VGM_SAMPLE_RATE / 1000;
+}
+
+bool VgmBatchDecoder::decodeBlock(int lane)
+{
+    if ( m_duration && m_samplesPlayed[lane] >= m_duration )
+    {
+        return false;
+    }
+    // Decoder writes chip registers, so lane state is moved to the chip for the writes
+    m_batch.saveLane( lane );
+    int result = m_decoders[lane]->decodeBlock();
+    m_batch.loadLane( lane );
+    if ( result < 0 )
+    {
+        LOGE( "Failed to play melody in lane %d, stopping\n", lane );
+        return false;
+    }
+    if ( result == 0 )
+    {
+        LOGI( "No more samples to play in lane %d, stopping\n", lane );
+        return false;
+    }
+    m_waitSamples[lane] = result;
+    if ( m_duration && m_duration - m_samplesPlayed[lane] < m_waitSamples[lane] )
+    {
+        m_waitSamples[lane] = m_duration - m_samplesPlayed[lane];
+    }
+    return true;
+}
+
+int VgmBatchDecoder::decode(uint32_t *const *buffers, uint32_t count)
+{
+    uint32_t *output[VGM_BATCH_DECODER_LANES];
+    for (int lane = 0; lane < VGM_BATCH_DECODER_LANES; lane++)
+    {
+        output[lane] = buffers[lane];
+    }
+    uint32_t position = 0;
+    while ( position < count )
+    {
+        // All lanes are rendered together up to the nearest register writes of any lane
+        uint32_t size = count - position;
+        int playing = 0;
+        for (int lane = 0; lane < VGM_BATCH_DECODER_LANES; lane++)
+        {
+            if ( !m_decoders[lane] )
+            {
+                continue;
+            }
+            if ( !m_waitSamples[lane] && !decodeBlock( lane ) )
+            {
+                close( lane );
+                continue;
+            }
+            if ( m_waitSamples[lane] < size ) size = m_waitSamples[lane];
+            playing++;
+        }
+        if ( !playing )
+        {
+            break;
+        }
+        m_batch.getSamples( output, size );
+        for (int lane = 0; lane < VGM_BATCH_DECODER_LANES; lane++)
+        {
+            if ( m_decoders[lane] )
+            {
+                m_waitSamples[lane] -= size;
+                m_samplesPlayed[lane] += size;
+            }
+            else if ( output[lane] )
+            {
+                memset( output[lane], 0, size * sizeof(uint32_t) );
+            }
+            if ( output[lane] ) output[lane] += size;
+        }
+        position += size;
+    }
+    int playing = 0;
+    for (int lane = 0; lane < VGM_BATCH_DECODER_LANES; lane++)
+    {
+        if ( output[lane] && position < count )
+        {
+            memset( output[lane], 0, (count - position) * sizeof(uint32_t) );
+        }
+        if ( m_decoders[lane] ) playing++;
+    }
+    return playing;
+}
@@ -25,6 +25,7 @@ SOFTWARE.
 #include "vgm_file.h"
 #include "formats/vgm_decoder.h"
 #include "formats/nsf_decoder.h"
+#include "formats/frame_decoder.h"
 
 #define VGM_FILE_DEBUG 1
 
@@ -36,11 +37,14 @@ SOFTWARE.
 /** Vgm file are always based on 44.1kHz rate */
 #define VGM_SAMPLE_RATE 44100
 
+/** Default fade: last 2 seconds, shifter equals to samples left >> 7 (512 / 65536) */
+#define VGM_FILE_FADE_SAMPLES (VGM_SAMPLE_RATE * 2)
+#define VGM_FILE_FADE_SCALE 512
+
 VgmFile::VgmFile()
-    : m_readScaler( VGM_SAMPLE_RATE )
-    , m_writeScaler( VGM_SAMPLE_RATE )
 {
     setMaxDuration( 3 * 60 * 1000 );
+    resetFade();
 }
 
 VgmFile::~VgmFile()
@@ -57,19 +61,40 @@ void VgmFile::deleteDecoder()
     }
 }
 
-bool VgmFile::open(const uint8_t * data, int size)
+void VgmFile::resetPosition()
 {
-    close();
     m_samplesPlayed = 0;
+    m_blockEnd = 0;
     m_waitSamples = 0;
+    m_waitFraction = 0;
+    m_blockPos = 0;
+    m_blockSize = 0;
+    m_blockStems = false;
+}
+
+bool VgmFile::open(const uint8_t * data, int size)
+{
+    close();
+    resetPosition();
     m_decoder = VgmMusicDecoder::tryOpen( data, size );
     if ( !m_decoder )
     {
         m_decoder = NsfMusicDecoder::tryOpen( data, size );
     }
+    if ( !m_decoder )
+    {
+        m_decoder = FrameMusicDecoder::tryOpen( data, size );
+    }
     if ( m_decoder )
     {
         if ( m_volume != 100 ) m_decoder->setVolume( m_volume );
+        if ( m_quality != CHIP_QUALITY_FAST ) m_decoder->setQuality( m_quality );
+        if ( m_sampleFrequency != VGM_SAMPLE_RATE ) m_decoder->setSampleFrequency( m_sampleFrequency );
+        if ( m_channelMask != 0xFF ) m_decoder->setChannelMask( m_channelMask );
+        if ( m_observer ) m_decoder->setObserver( m_observer );
+#if NES_CPU_PROFILER
+        if ( m_profiler ) m_decoder->setProfiler( m_profiler );
+#endif
         return true;
     }
     return false;
@@ -86,6 +111,24 @@ void VgmFile::setVolume( uint16_t volume )
     if ( m_decoder ) m_decoder->setVolume( m_volume );
 }
 
+void VgmFile::setQuality( uint8_t quality )
+{
+    m_quality = quality;
+    if ( m_decoder ) m_decoder->setQuality( m_quality );
+}
+
+void VgmFile::setChannelMask( uint8_t mask )
+{
+    m_channelMask = mask;
+    if ( m_decoder ) m_decoder->setChannelMask( m_channelMask );
+}
+
+int VgmFile::getStemCount()
+{
+    if ( m_decoder ) return m_decoder->getStemCount();
+    return 0;
+}
+
 int VgmFile::getTrackCount()
 {
     if ( m_decoder ) return m_decoder->getTrackCount();
@@ -94,13 +137,66 @@ int VgmFile::getTrackCount()
 
 bool VgmFile::setTrack(int track)
 {
-    if ( m_decoder ) return m_decoder->setTrack( track );
+    if ( m_observer ) m_observer->setPosition( m_samplesPlayed );
+    if ( !m_decoder || !m_decoder->setTrack( track ) )
+    {
+        return false;
+    }
+    // New track starts from the beginning, samples of the previous track are dropped
+    resetPosition();
+    uint32_t duration, fade;
+    if ( m_decoder->getTrackTime( track, duration, fade ) )
+    {
+        m_duration = static_cast<uint64_t>(duration + fade) * VGM_SAMPLE_RATE / 1000;
+        m_fadeEffect = fade != 0;
+        if ( m_fadeEffect )
+        {
+            // Track fade goes from full volume (1024) to silence
+            m_fadeSamples = static_cast<uint64_t>(fade) * VGM_SAMPLE_RATE / 1000;
+            m_fadeScale = m_fadeSamples ? static_cast<uint32_t>( (1024ULL << 16) / m_fadeSamples ) : 0;
+        }
+    }
+    else
+    {
+        m_duration = m_defaultDuration;
+        m_fadeEffect = m_defaultFading;
+        resetFade();
+    }
+    return true;
+}
+
+bool VgmFile::prepareTrack(int track)
+{
+    return m_decoder && m_decoder->prepareTrack( track );
+}
+
+bool VgmFile::getTrackTime(int track, uint32_t &duration, uint32_t &fade)
+{
+    if ( m_decoder ) return m_decoder->getTrackTime( track, duration, fade );
+    return false;
+}
+
+bool VgmFile::analyzeTrack(int track, MusicTrackInfo &info)
+{
+    if ( m_decoder ) return m_decoder->analyzeTrack( track, info );
     return false;
 }
 
 void VgmFile::setMaxDuration( uint32_t milliseconds )
 {
-    m_duration = static_cast<uint64_t>(milliseconds) * VGM_SAMPLE_RATE / 1000;
+    setMaxSamples( static_cast<uint64_t>(milliseconds) * VGM_SAMPLE_RATE / 1000 );
+}
+
+void VgmFile::setMaxSamples( uint32_t samples )
+{
+    m_duration = samples;
+    m_defaultDuration = samples;
+}
+
+void VgmFile::resetFade()
+{
+    m_fadeSamples = VGM_FILE_FADE_SAMPLES;
+    m_fadeScale = VGM_FILE_FADE_SCALE;
 }
 
 typedef struct
@@ -108,45 +204,46 @@ typedef struct
     uint16_t left, right;
 } StereoChannels;
 
-void VgmFile::interpolateSample()
+void VgmFile::readBlock(int stemCount)
 {
-    uint32_t nextSample = m_decoder->getSample();
-    StereoChannels &source = reinterpret_cast<StereoChannels&>(nextSample);
-//    StereoChannels &dest = reinterpret_cast<StereoChannels&>(m_sampleSum);
-    if ( m_shifter )
+    m_blockSize = m_waitSamples < VGM_FILE_BLOCK_SAMPLES ? m_waitSamples : VGM_FILE_BLOCK_SAMPLES;
+    if ( stemCount )
     {
-        source.left = static_cast<uint32_t>(source.left) * m_shifter / 1024;
-        source.right = static_cast<uint32_t>(source.right) * m_shifter / 1024;
+        uint16_t *stems[VGM_FILE_MAX_STEMS];
+        for (int n = 0; n < VGM_FILE_MAX_STEMS; n++) stems[n] = m_stemBlock[n];
+        m_decoder->getStems( m_block, stems, m_blockSize );
     }
-
-    if ( !m_sampleSumValid ) // If no sample previously reached the mixer assign new sample
-    {
-        m_sampleSum = nextSample;
-        m_sampleSumValid = true;
-    }
-/*    if ( (source.left >= 8192 && source.left > dest.left) ||
-         (source.left < 8192 && source.left < dest.left) )
+    else
     {
-        dest.left = source.left;
+        m_decoder->getSamples( m_block, m_blockSize );
     }
-    if ( (source.right >= 8192 && source.right > dest.right) ||
-         (source.right < 8192 && source.right < dest.right) )
-    {
-        dest.right = source.right;
-    } */
+    m_blockStems = stemCount != 0;
+    m_blockPos = 0;
 }
 
 int VgmFile::decodePcm(uint8_t *outBuffer, int maxSize)
+{
+    return decode( outBuffer, nullptr, maxSize );
+}
+
+int VgmFile::decodeStems(uint8_t *outBuffer, uint16_t *const *stems, int maxSize)
+{
+    return decode( outBuffer, stems, maxSize );
+}
+
+int VgmFile::decode(uint8_t *outBuffer, uint16_t *const *stems, int maxSize)
 {
     int decoded = 0;
     if ( !m_decoder )
     {
         return 0;
     }
+    int stemCount = stems ? m_decoder->getStemCount() : 0;
     while ( decoded + 4 <= maxSize )
     {
         if ( !m_waitSamples )
         {
+            m_samplesPlayed = m_blockEnd;
             m_shifter = 0;
             if ( m_duration )
             {
@@ -155,11 +252,13 @@ int VgmFile::decodePcm(uint8_t *outBuffer, int maxSize)
                     LOGI("m_samplesPlayed: %d\n", m_samplesPlayed);
                     break;
                 }
-                if ( m_fadeEffect && (m_duration - m_samplesPlayed < VGM_SAMPLE_RATE * 2) )
+                uint32_t samplesLeft = m_duration - m_samplesPlayed;
+                if ( m_fadeEffect && samplesLeft < m_fadeSamples )
                 {
-                    m_shifter = (m_duration - m_samplesPlayed) >> 7;
+                    m_shifter = static_cast<uint16_t>( (static_cast<uint64_t>(samplesLeft) * m_fadeScale) >> 16 );
                 }
             }
+            if ( m_observer ) m_observer->setPosition( m_samplesPlayed );
             int result = m_decoder->decodeBlock();
             if ( result < 0 )
             {
@@ -171,28 +270,40 @@ int VgmFile::decodePcm(uint8_t *outBuffer, int maxSize)
                 LOGI( "No more samples to play, stopping\n" );
                 break;
             }
-            m_waitSamples = result;
-            LOGI( "Next block %d samples [%d.%03d - %d.%03d]\n", m_waitSamples,
+            m_blockEnd += result;
+            // Waits are 44100 Hz samples, the fraction of output sample is left for the next wait
+            uint64_t units = static_cast<uint64_t>( result ) * m_sampleFrequency + m_waitFraction;
+            m_waitSamples = static_cast<uint32_t>( units / VGM_SAMPLE_RATE );
+            m_waitFraction = static_cast<uint32_t>( units % VGM_SAMPLE_RATE );
+            LOGI( "Next block %d samples [%d.%03d - %d.%03d]\n", result,
                    m_samplesPlayed / VGM_SAMPLE_RATE, 1000 * (m_samplesPlayed % VGM_SAMPLE_RATE) / VGM_SAMPLE_RATE,
-                   (m_samplesPlayed + m_waitSamples) / VGM_SAMPLE_RATE,
-                   1000 * ((m_samplesPlayed + m_waitSamples) % VGM_SAMPLE_RATE) / VGM_SAMPLE_RATE );
+                   m_blockEnd / VGM_SAMPLE_RATE, 1000 * (m_blockEnd % VGM_SAMPLE_RATE) / VGM_SAMPLE_RATE );
         }
         while ( m_waitSamples && (decoded + 4 <= maxSize) )
         {
-            interpolateSample();
-
-            m_writeCounter += m_writeScaler;
-            m_samplesPlayed++;
-            m_waitSamples--;
-
-            if ( m_writeCounter >= VGM_SAMPLE_RATE )
+            if ( m_blockPos == m_blockSize )
             {
-                *(reinterpret_cast<uint32_t *>(outBuffer)) = m_sampleSum;
-                outBuffer += 4;
-                decoded += 4;
-                m_writeCounter -= VGM_SAMPLE_RATE;
-                m_sampleSumValid = false;
+                readBlock( stemCount );
             }
+            uint32_t sample = m_block[ m_blockPos ];
+            if ( m_shifter )
+            {
+                StereoChannels &source = reinterpret_cast<StereoChannels&>(sample);
+                source.left = static_cast<uint32_t>(source.left) * m_shifter / 1024;
+                source.right = static_cast<uint32_t>(source.right) * m_shifter / 1024;
+            }
+            *(reinterpret_cast<uint32_t *>(outBuffer)) = sample;
+            for (int n = 0; n < stemCount; n++)
+            {
+                uint32_t level = m_blockStems ? m_stemBlock[n][m_blockPos] : 0;
+                if ( stems[n] ) stems[n][decoded / 4] = m_shifter ? level * m_shifter / 1024 : level;
+            }
+            m_blockPos++;
+            outBuffer += 4;
+            decoded += 4;
+            m_waitSamples--;
+            m_samplesPlayed = m_blockEnd - static_cast<uint32_t>(
+                static_cast<uint64_t>( m_waitSamples ) * VGM_SAMPLE_RATE / m_sampleFrequency );
         }
     }
     return decoded;
@@ -200,10 +311,32 @@ int VgmFile::decodePcm(uint8_t *outBuffer, int maxSize)
 
 void VgmFile::setSampleFrequency( uint32_t frequency )
 {
-    m_writeScaler = frequency;
+    if ( frequency == 0 )
+    {
+        LOGE( "Invalid sample frequency\n" );
+        return;
+    }
+    m_sampleFrequency = frequency;
+    if ( m_decoder ) m_decoder->setSampleFrequency( m_sampleFrequency );
+}
+
+void VgmFile::setObserver(ChipWriteObserver *observer)
+{
+    m_observer = observer;
+    if ( m_decoder ) m_decoder->setObserver( m_observer );
 }
 
+#if NES_CPU_PROFILER
+void VgmFile::setProfiler(NesCpuProfiler *profiler)
+{
+    m_profiler = profiler;
+    if ( m_decoder ) m_decoder->setProfiler( m_profiler );
+}
+#endif
+
 void VgmFile::setFading(bool enable)
 {
     m_fadeEffect = enable;
+    m_defaultFading = enable;
+    resetFade();
 }
@@ -0,0 +1,374 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "vgm_frame_converter.h"
+#include "formats/vgm_decoder.h"
+#include "formats/vgm_format.h"
+#include "chips/chip_registers.h"
+
+#include <string.h>
+
+#define VGM_FRAME_CONVERTER_DEBUG 1
+
+#if VGM_FRAME_CONVERTER_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER VGM_FRAME_CONVERTER_DEBUG
+#endif
+#include "vgm_logger.h"
+
+/** Vgm file are always based on 44.1kHz rate */
+#define VGM_SAMPLE_RATE 44100
+
+VgmFrameConverter::VgmFrameConverter()
+{
+}
+
+VgmFrameConverter::~VgmFrameConverter()
+{
+    close();
+}
+
+bool VgmFrameConverter::open(const uint8_t *data, int size)
+{
+    close();
+    m_decoder = VgmMusicDecoder::tryOpen( data, size );
+    if ( m_decoder == nullptr )
+    {
+        return false;
+    }
+    const VgmHeader *header = m_decoder->getHeader();
+    if ( !header->ay8910Clock && !header->nesApuClock )
+    {
+        LOGE( "Vgm file has no AY-3-8910 or NES APU chips\n" );
+        close();
+        return false;
+    }
+    return true;
+}
+
+void VgmFrameConverter::close()
+{
+    delete m_decoder;
+    m_decoder = nullptr;
+    m_stream.clear();
+}
+
+int VgmFrameConverter::getSlot(uint8_t reg, uint32_t written) const
+{
+    if ( m_header.chip == CHIP_WRITE_AY38910 )
+    {
+        return reg < FRAME_AY8910_SLOTS ? reg : -1;
+    }
+    // $4015 goes to the second slot once channel registers are written in the frame
+    int first = reg == 0x15 && (written >> FRAME_NES_CHANNEL_FIRST_SLOT) ? FRAME_NES_CHANNEL_FIRST_SLOT : 0;
+    for (int slot = first; slot < FRAME_NES_APU_SLOTS; slot++)
+    {
+        if ( frameNesApuRegisters[slot] == reg ) return slot;
+    }
+    return -1;
+}
+
+uint32_t VgmFrameConverter::detectRate() const
+{
+    const VgmEvent *events = m_decoder->getEvents();
+    uint32_t count = m_decoder->getEventCount();
+    uint32_t ntsc = 0;
+    uint32_t pal = 0;
+    uint32_t wait = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if ( events[i].chip != VGM_EVENT_WAIT && wait )
+        {
+            if ( wait == VGM_SAMPLE_RATE / 60 ) ntsc++;
+            if ( wait == VGM_SAMPLE_RATE / 50 ) pal++;
+            wait = 0;
+        }
+        wait += events[i].wait;
+    }
+    return ntsc > pal ? 60 : 50;
+}
+
+uint32_t VgmFrameConverter::getFrame(uint64_t position, bool beforeLoop) const
+{
+    uint32_t frame = position * m_header.rate / VGM_SAMPLE_RATE;
+    if ( m_header.loopFrame != FRAME_NO_LOOP )
+    {
+        // Writes must stay on their side of the loop start
+        if ( beforeLoop && frame >= m_header.loopFrame && m_header.loopFrame ) frame = m_header.loopFrame - 1;
+        if ( !beforeLoop && frame < m_header.loopFrame ) frame = m_header.loopFrame;
+    }
+    return frame;
+}
+
+uint32_t VgmFrameConverter::encodeFrame(const uint8_t *values, uint32_t written, uint8_t *frame)
+{
+    uint32_t mask = 0;
+    for (int slot = 0; slot < FRAME_MAX_SLOTS; slot++)
+    {
+        if ( !(written & (1 << slot)) )
+        {
+            continue;
+        }
+        uint8_t reg = m_header.chip == CHIP_WRITE_AY38910 ? slot : frameNesApuRegisters[slot];
+        if ( (chipRegisterClass( m_header.chip, reg ) & REG_NOOP) && m_shadowValid[slot] && m_shadow[slot] == values[slot] )
+        {
+            m_stats.unchanged++;
+            continue;
+        }
+        mask |= 1 << slot;
+        m_shadow[slot] = values[slot];
+        m_shadowValid[slot] = true;
+    }
+    if ( !mask )
+    {
+        return 0;
+    }
+    uint32_t length = 1;
+    frame[0] = 0;
+    for (int group = 0; group < FRAME_MAX_SLOTS / 8; group++)
+    {
+        if ( (mask >> (group * 8)) & 0xFF )
+        {
+            frame[0] |= 1 << group;
+            frame[length++] = (mask >> (group * 8)) & 0xFF;
+        }
+    }
+    for (int slot = 0; slot < FRAME_MAX_SLOTS; slot++)
+    {
+        if ( mask & (1 << slot) ) frame[length++] = values[slot];
+    }
+    return length;
+}
+
+void VgmFrameConverter::compress(const uint8_t *data, uint32_t size, std::vector<uint8_t> &stream)
+{
+    uint32_t literal = 0;
+    uint32_t pos = 0;
+    while ( pos <= size )
+    {
+        uint32_t bestLength = 0;
+        uint32_t bestDistance = 0;
+        for (uint32_t distance = 1; pos < size && distance <= pos && distance <= FRAME_LZ_WINDOW; distance++)
+        {
+            uint32_t length = 0;
+            while ( length < FRAME_LZ_MAX_MATCH && pos + length < size &&
+                    data[pos + length] == data[pos + length - distance] ) length++;
+            if ( length > bestLength )
+            {
+                bestLength = length;
+                bestDistance = distance;
+            }
+        }
+        if ( bestLength < FRAME_LZ_MIN_MATCH && pos < size )
+        {
+            pos++;
+            continue;
+        }
+        // Flush pending literals before the match or at the end of data
+        while ( literal < pos )
+        {
+            uint32_t count = pos - literal < FRAME_LZ_MAX_LITERAL ? pos - literal : FRAME_LZ_MAX_LITERAL;
+            stream.push_back( count - 1 );
+            stream.insert( stream.end(), data + literal, data + literal + count );
+            literal += count;
+        }
+        if ( pos == size )
+        {
+            break;
+        }
+        stream.push_back( 0x80 | (bestLength - FRAME_LZ_MIN_MATCH) );
+        stream.push_back( bestDistance - 1 );
+        pos += bestLength;
+        literal = pos;
+    }
+}
+
+bool VgmFrameConverter::convert(uint32_t rate, bool compress)
+{
+    if ( m_decoder == nullptr )
+    {
+        return false;
+    }
+    const VgmHeader *header = m_decoder->getHeader();
+    if ( rate == 0 )
+    {
+        rate = header->rate ? header->rate : detectRate();
+    }
+    if ( rate > VGM_SAMPLE_RATE )
+    {
+        LOGE( "Frame rate %u is too high\n", rate );
+        return false;
+    }
+    m_stream.clear();
+    m_stats = Stats{};
+    memset( m_shadowValid, 0, sizeof(m_shadowValid) );
+    m_header = FrameHeader{};
+    m_header.ident = FRAME_IDENT;
+    m_header.version = FRAME_FORMAT_VERSION;
+    m_header.chip = header->ay8910Clock ? CHIP_WRITE_AY38910 : CHIP_WRITE_NES_APU;
+    m_header.clock = header->ay8910Clock ? header->ay8910Clock : header->nesApuClock;
+    m_header.ay8910Type = header->ay8910Type;
+    m_header.ay8910Flags = header->ay8910Flags;
+    m_header.dataBlocks = m_header.chip == CHIP_WRITE_NES_APU ? m_decoder->getNesDataBlockCount() : 0;
+    m_header.rate = rate;
+    m_header.loopFrame = FRAME_NO_LOOP;
+
+    const VgmEvent *events = m_decoder->getEvents();
+    uint32_t count = m_decoder->getEventCount();
+    int loop = m_decoder->getLoopEvent();
+    uint64_t position = 0;
+    uint64_t loopPosition = 0;
+    uint64_t lastPosition = 0;
+    bool introWrites = false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if ( static_cast<int>(i) == loop ) loopPosition = position;
+        if ( static_cast<int>(i) < loop && events[i].chip != VGM_EVENT_WAIT ) introWrites = true;
+        lastPosition = position;
+        position += events[i].wait;
+    }
+    if ( loop >= 0 && static_cast<uint32_t>(loop) < count )
+    {
+        m_header.loopFrame = (loopPosition * rate + VGM_SAMPLE_RATE / 2) / VGM_SAMPLE_RATE;
+        // Intro writes cannot share the frame with the loop start
+        if ( introWrites && m_header.loopFrame == 0 ) m_header.loopFrame = 1;
+    }
+    m_header.frameCount = (position * rate + VGM_SAMPLE_RATE / 2) / VGM_SAMPLE_RATE;
+    if ( m_header.loopFrame != FRAME_NO_LOOP && m_header.frameCount <= m_header.loopFrame )
+    {
+        m_header.frameCount = m_header.loopFrame + 1;
+    }
+    // Writes after the last wait need their own frame
+    uint32_t lastFrame = getFrame( lastPosition, static_cast<int>(count) <= loop );
+    if ( count && m_header.frameCount <= lastFrame )
+    {
+        m_header.frameCount = lastFrame + 1;
+    }
+
+    std::vector<uint8_t> raw;
+    uint32_t loopOffset = 0;
+    uint32_t emptyFrames = 0;
+    uint32_t index = 0;
+    position = 0;
+    for (uint32_t frame = 0; frame < m_header.frameCount; frame++)
+    {
+        if ( frame == m_header.loopFrame )
+        {
+            // Register values at the loop start differ for the first and next passes
+            if ( emptyFrames ) raw.push_back( FRAME_EMPTY_RUN | (emptyFrames - 1) );
+            emptyFrames = 0;
+            loopOffset = raw.size();
+            memset( m_shadowValid, 0, sizeof(m_shadowValid) );
+        }
+        uint8_t values[FRAME_MAX_SLOTS]{};
+        uint32_t written = 0;
+        while ( index < count && getFrame( position, static_cast<int>(index) < loop ) <= frame )
+        {
+            const VgmEvent &event = events[index++];
+            position += event.wait;
+            if ( event.chip == VGM_EVENT_WAIT )
+            {
+                continue;
+            }
+            m_stats.writes++;
+            int slot = getSlot( event.reg, written );
+            if ( slot < 0 )
+            {
+                m_stats.dropped++;
+                continue;
+            }
+            if ( written & (1 << slot) ) m_stats.merged++;
+            values[slot] = event.value;
+            written |= 1 << slot;
+        }
+        uint8_t data[1 + FRAME_MAX_SLOTS / 8 + FRAME_MAX_SLOTS];
+        uint32_t length = encodeFrame( values, written, data );
+        if ( length == 0 )
+        {
+            if ( ++emptyFrames == FRAME_MAX_EMPTY_RUN )
+            {
+                raw.push_back( FRAME_EMPTY_RUN | (emptyFrames - 1) );
+                emptyFrames = 0;
+            }
+            continue;
+        }
+        if ( emptyFrames )
+        {
+            raw.push_back( FRAME_EMPTY_RUN | (emptyFrames - 1) );
+            emptyFrames = 0;
+        }
+        raw.insert( raw.end(), data, data + length );
+    }
+    if ( emptyFrames )
+    {
+        raw.push_back( FRAME_EMPTY_RUN | (emptyFrames - 1) );
+    }
+
+    m_header.loopOffset = loopOffset;
+    if ( compress )
+    {
+        // Both parts are compressed separately, so the loop can be decoded without the intro
+        VgmFrameConverter::compress( raw.data(), loopOffset, m_stream );
+        uint32_t compressedLoopOffset = m_stream.size();
+        VgmFrameConverter::compress( raw.data() + loopOffset, raw.size() - loopOffset, m_stream );
+        if ( m_stream.size() < raw.size() )
+        {
+            m_header.flags |= FRAME_FLAG_LZ;
+            m_header.loopOffset = compressedLoopOffset;
+        }
+    }
+    if ( !(m_header.flags & FRAME_FLAG_LZ) )
+    {
+        m_stream = raw;
+    }
+    m_header.streamSize = m_stream.size();
+    m_stats.frames = m_header.frameCount;
+    m_stats.rawSize = raw.size();
+    m_stats.streamSize = m_stream.size();
+    return true;
+}
+
+bool VgmFrameConverter::save(FILE *file)
+{
+    if ( fwrite( &m_header, sizeof(m_header), 1, file ) != 1 )
+    {
+        LOGE( "Failed to write frame data\n" );
+        return false;
+    }
+    for (int i = 0; i < m_header.dataBlocks; i++)
+    {
+        uint32_t size;
+        const uint8_t *data = m_decoder->getNesDataBlock( i, size );
+        if ( fwrite( &size, sizeof(size), 1, file ) != 1 || fwrite( data, size, 1, file ) != 1 )
+        {
+            LOGE( "Failed to write frame data\n" );
+            return false;
+        }
+    }
+    if ( m_stream.size() && fwrite( m_stream.data(), m_stream.size(), 1, file ) != 1 )
+    {
+        LOGE( "Failed to write frame data\n" );
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,199 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "vgm_optimizer.h"
+#include "formats/vgm_decoder.h"
+#include "formats/vgm_format.h"
+#include "chips/chip_registers.h"
+
+#include <string.h>
+
+#define VGM_OPTIMIZER_DEBUG 1
+
+#if VGM_OPTIMIZER_DEBUG && !defined(VGM_DECODER_LOGGER)
+#define VGM_DECODER_LOGGER VGM_OPTIMIZER_DEBUG
+#endif
+#include "vgm_logger.h"
+
+#define GD3_IDENT  0x20336447 // "Gd3 "
+
+/** VGM data block type for NES APU RAM */
+#define VGM_NES_APU_DATA_BLOCK 0xC2
+
+static uint32_t readUint32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+VgmOptimizer::VgmOptimizer()
+{
+}
+
+VgmOptimizer::~VgmOptimizer()
+{
+    close();
+}
+
+bool VgmOptimizer::open(const uint8_t *data, int size)
+{
+    close();
+    m_decoder = VgmMusicDecoder::tryOpen( data, size );
+    if ( m_decoder == nullptr )
+    {
+        return false;
+    }
+    const VgmHeader *header = m_decoder->getHeader();
+    if ( !header->ay8910Clock && !header->nesApuClock )
+    {
+        LOGE( "Vgm file has no AY-3-8910 or NES APU chips\n" );
+        close();
+        return false;
+    }
+    m_data = data;
+    m_size = size;
+    return true;
+}
+
+void VgmOptimizer::close()
+{
+    delete m_decoder;
+    m_decoder = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+}
+
+void VgmOptimizer::invalidateShadows()
+{
+    memset( m_shadowValid, 0, sizeof(m_shadowValid) );
+}
+
+bool VgmOptimizer::isDeadWrite(uint32_t index, uint32_t end) const
+{
+    const VgmEvent *events = m_decoder->getEvents();
+    if ( !(chipRegisterClass( events[index].chip, events[index].reg ) & REG_OVERWRITE) )
+    {
+        return false;
+    }
+    for (uint32_t i = index + 1; i < end; i++)
+    {
+        if ( events[i].chip == VGM_EVENT_WAIT )
+        {
+            continue;
+        }
+        if ( events[i].reg == events[index].reg )
+        {
+            return true;
+        }
+        if ( chipRegisterClass( events[i].chip, events[i].reg ) & REG_BARRIER )
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool VgmOptimizer::optimize()
+{
+    if ( m_decoder == nullptr )
+    {
+        return false;
+    }
+    const VgmHeader *header = m_decoder->getHeader();
+    m_writer.clear();
+    m_stats = Stats{};
+    invalidateShadows();
+    if ( header->ay8910Clock ) m_writer.setAy8910( header->ay8910Clock, header->ay8910Type, header->ay8910Flags );
+    if ( header->nesApuClock ) m_writer.setNesApu( header->nesApuClock );
+    // Data blocks are registered by decoder at open time, so they can be stored before all commands
+    for (int i = 0; i < m_decoder->getNesDataBlockCount(); i++)
+    {
+        uint32_t dataSize;
+        const uint8_t *data = m_decoder->getNesDataBlock( i, dataSize );
+        m_writer.dataBlock( VGM_NES_APU_DATA_BLOCK, data, dataSize );
+    }
+
+    const VgmEvent *events = m_decoder->getEvents();
+    uint32_t count = m_decoder->getEventCount();
+    int loop = m_decoder->getLoopEvent();
+    uint32_t start = 0;
+    while ( start < count )
+    {
+        if ( static_cast<int>(start) == loop )
+        {
+            // Register values at the loop start differ for the first and next passes
+            m_writer.setLoop();
+            invalidateShadows();
+        }
+        // Writes without waits between them, loop start always begins new group
+        uint32_t end = start;
+        while ( end + 1 < count && !events[end].wait && static_cast<int>(end + 1) != loop ) end++;
+        for (uint32_t i = start; i <= end; i++)
+        {
+            const VgmEvent &event = events[i];
+            if ( event.chip != VGM_EVENT_WAIT )
+            {
+                m_stats.writes++;
+                uint8_t regClass = chipRegisterClass( event.chip, event.reg );
+                if ( isDeadWrite( i, end + 1 ) )
+                {
+                    m_stats.dead++;
+                }
+                else if ( (regClass & REG_NOOP) && m_shadowValid[event.reg] && m_shadow[event.reg] == event.value )
+                {
+                    m_stats.noops++;
+                }
+                else
+                {
+                    m_writer.write( event.chip, event.reg, event.value );
+                    if ( regClass & REG_UNKNOWN ) invalidateShadows();
+                    m_shadow[event.reg] = event.value;
+                    m_shadowValid[event.reg] = !(regClass & REG_UNKNOWN);
+                }
+            }
+            m_writer.wait( event.wait );
+        }
+        start = end + 1;
+    }
+    if ( loop >= 0 && static_cast<uint32_t>(loop) == count )
+    {
+        m_writer.setLoop();
+    }
+    // Keep GD3 tags of the source file
+    uint64_t gd3Offset = header->gd3Offset + static_cast<uint64_t>(0x14);
+    if ( header->gd3Offset && gd3Offset + 12 <= static_cast<uint64_t>(m_size) )
+    {
+        const uint8_t *gd3 = m_data + gd3Offset;
+        uint32_t length = readUint32( gd3 + 8 );
+        if ( readUint32( gd3 ) == GD3_IDENT && length <= m_size - gd3Offset - 12 )
+        {
+            m_writer.setGd3( gd3, length + 12 );
+        }
+    }
+    return true;
+}
+
+bool VgmOptimizer::save(FILE *file)
+{
+    return m_writer.save( file );
+}
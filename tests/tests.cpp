@@ -0,0 +1,56 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "tests.h"
+
+#include <string.h>
+
+typedef struct
+{
+    const char *name;
+    bool (*run)();
+} TestCase;
+
+static const TestCase tests[] =
+{
+    { "track_switch", testTrackSwitch },
+    { "vgm_validate", testVgmValidate },
+};
+
+/** Runs the test, given in command line, or all tests */
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    for (const TestCase &test: tests)
+    {
+        if ( argc > 1 && strcmp( argv[1], test.name ) )
+        {
+            continue;
+        }
+        bool passed = test.run();
+        fprintf( stderr, "%s: %s\n", test.name, passed ? "passed" : "FAILED" );
+        if ( !passed ) failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "tests.h"
+#include "vgm_file.h"
+
+#include <stdint.h>
+#include <vector>
+
+/** Track durations and fades of the test file, milliseconds */
+static const uint32_t trackTimes[] = { 2000, 1000, 1500 };
+static const uint32_t trackFades[] = { 0, 500, 0 };
+
+static void putChunk(std::vector<uint8_t> &file, const char *id, const std::vector<uint8_t> &data)
+{
+    uint32_t size = data.size();
+    for (int i = 0; i < 4; i++) file.push_back( (size >> (i * 8)) & 0xFF );
+    file.insert( file.end(), id, id + 4 );
+    file.insert( file.end(), data.begin(), data.end() );
+}
+
+static std::vector<uint8_t> timeChunk(const uint32_t *times)
+{
+    std::vector<uint8_t> data;
+    for (int track = 0; track < 3; track++)
+    {
+        for (int i = 0; i < 4; i++) data.push_back( (times[track] >> (i * 8)) & 0xFF );
+    }
+    return data;
+}
+
+/** NSFe with 3 tracks: init enables pulse 1, play changes its period every frame */
+static std::vector<uint8_t> createNsfe()
+{
+    const uint8_t init[] = { 0xA9, 0x0F, 0x8D, 0x15, 0x40,  // LDA #$0F, STA $4015
+                             0xA9, 0x9F, 0x8D, 0x00, 0x40,  // LDA #$9F, STA $4000
+                             0x85, 0x00, 0x60 };            // STA $00, RTS
+    const uint8_t play[] = { 0xE6, 0x00, 0xA5, 0x00,        // INC $00, LDA $00
+                             0x8D, 0x02, 0x40,              // STA $4002
+                             0xA9, 0x01, 0x8D, 0x03, 0x40,  // LDA #$01, STA $4003
+                             0x60 };                        // RTS
+    std::vector<uint8_t> program( init, init + sizeof(init) );
+    program.resize( 0x20, 0x60 );
+    program.insert( program.end(), play, play + sizeof(play) );
+
+    std::vector<uint8_t> file = { 'N', 'S', 'F', 'E' };
+    // Load, init and play addresses, NTSC, no extra chips, 3 songs, first song 0
+    putChunk( file, "INFO", { 0x00, 0x80, 0x00, 0x80, 0x20, 0x80, 0x00, 0x00, 0x03, 0x00 } );
+    putChunk( file, "DATA", program );
+    putChunk( file, "time", timeChunk( trackTimes ) );
+    putChunk( file, "fade", timeChunk( trackFades ) );
+    putChunk( file, "NEND", {} );
+    return file;
+}
+
+static std::vector<uint8_t> render(VgmFile &file, uint32_t maxSamples)
+{
+    std::vector<uint8_t> pcm;
+    uint8_t buffer[1024];
+    while ( pcm.size() < maxSamples * 4 )
+    {
+        int size = file.decodePcm( buffer, sizeof(buffer) );
+        pcm.insert( pcm.end(), buffer, buffer + size );
+        if ( size < static_cast<int>(sizeof(buffer)) ) break;
+    }
+    return pcm;
+}
+
+static std::vector<uint8_t> renderTrack(const std::vector<uint8_t> &nsfe, int track)
+{
+    VgmFile file;
+    if ( !file.open( nsfe.data(), nsfe.size() ) || !file.setTrack( track ) )
+    {
+        return {};
+    }
+    return render( file, UINT32_MAX );
+}
+
+/** Switching tracks while playing, with or without prepared track, renders the track from the beginning */
+bool testTrackSwitch()
+{
+    std::vector<uint8_t> nsfe = createNsfe();
+    VgmFile file;
+    TEST_CHECK( file.open( nsfe.data(), nsfe.size() ) );
+    TEST_CHECK( file.getTrackCount() == 3 );
+    for (int track = 1; track < 3; track++)
+    {
+        std::vector<uint8_t> expected = renderTrack( nsfe, track );
+        uint32_t samples = (trackTimes[track] + trackFades[track]) * 44100 / 1000;
+        // Playback stops at the first frame (735 samples), which ends after the track time
+        TEST_CHECK( expected.size() >= samples * 4 && expected.size() < (samples + 735) * 4 );
+
+        TEST_CHECK( file.setTrack( 0 ) );
+        TEST_CHECK( render( file, 44100 / 2 ).size() >= 44100 / 2 * 4 );
+        // Track 1 is prepared in advance, track 2 is initialized by setTrack()
+        if ( track == 1 ) TEST_CHECK( file.prepareTrack( track ) );
+        TEST_CHECK( file.setTrack( track ) );
+        TEST_CHECK( file.getDecodedSamples() == 0 );
+        std::vector<uint8_t> switched = render( file, UINT32_MAX );
+        TEST_CHECK( switched.size() == expected.size() );
+        TEST_CHECK( switched == expected );
+    }
+    return true;
+}
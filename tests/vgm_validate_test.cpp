@@ -0,0 +1,67 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "tests.h"
+#include "vgm_file.h"
+#include "formats/vgm_format.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/** VGM 1.61 file for NES APU: command stream starts at 0x100 with given data block command */
+static std::vector<uint8_t> createVgm(uint8_t compatibility)
+{
+    VgmHeader header;
+    memset( &header, 0, sizeof(header) );
+    header.ident = 0x206D6756;
+    header.version = 0x00000161;
+    header.vgmDataOffset = 0x100 - 0x34;
+    header.nesApuClock = 1789772;
+    std::vector<uint8_t> file( reinterpret_cast<const uint8_t *>(&header),
+                               reinterpret_cast<const uint8_t *>(&header) + sizeof(header) );
+    file.resize( 0x100, 0x00 );
+    // Data block of type 0xC2 (NES APU RAM) with 2 bytes at 0xC000
+    const uint8_t commands[] = { 0x67, compatibility, 0xC2, 0x04, 0x00, 0x00, 0x00,
+                                 0x00, 0xC0, 0x55, 0xAA,
+                                 0x62,                   // wait 735 samples
+                                 0x66 };                 // end of sound data
+    file.insert( file.end(), commands, commands + sizeof(commands) );
+    uint32_t eofOffset = file.size() - 4;
+    memcpy( file.data() + 4, &eofOffset, sizeof(eofOffset) );
+    return file;
+}
+
+/** Data block without 0x66 compatibility byte makes open() fail */
+bool testVgmValidate()
+{
+    std::vector<uint8_t> valid = createVgm( 0x66 );
+    VgmFile file;
+    TEST_CHECK( file.open( valid.data(), valid.size() ) );
+    file.close();
+
+    std::vector<uint8_t> malformed = createVgm( 0x00 );
+    TEST_CHECK( !file.open( malformed.data(), malformed.size() ) );
+    return true;
+}
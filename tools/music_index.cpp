@@ -0,0 +1,372 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "music_index.h"
+#include "chips/state_hash.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct
+{
+    std::string path;
+    bool valid;
+    MusicIndexEntry entry;
+    std::vector<MusicIndexTrack> tracks;
+    std::string tags[MUSIC_TAG_COUNT];
+} IndexRecord;
+
+static bool isMusicFile(const char *name)
+{
+    const char *ext = strrchr( name, '.' );
+    return ext && ( !strcasecmp( ext, ".vgm" ) || !strcasecmp( ext, ".nsf" ) ||
+                   !strcasecmp( ext, ".nsfe" ) );
+}
+
+static void scanDirectory(const std::string &root, const std::string &relative, std::vector<std::string> &files)
+{
+    DIR *dir = opendir( (root + relative).c_str() );
+    if ( dir == nullptr )
+    {
+        fprintf( stderr, "Failed to open directory %s\n", (root + relative).c_str() );
+        return;
+    }
+    struct dirent *item;
+    while ( (item = readdir( dir )) != nullptr )
+    {
+        if ( !strcmp( item->d_name, "." ) || !strcmp( item->d_name, ".." ) )
+        {
+            continue;
+        }
+        std::string path = relative.empty() ? item->d_name : relative + "/" + item->d_name;
+        struct stat info;
+        if ( lstat( (root + path).c_str(), &info ) != 0 )
+        {
+            continue;
+        }
+        // Linked files are indexed, linked directories are skipped, since they can make a loop
+        if ( S_ISLNK( info.st_mode ) && ( stat( (root + path).c_str(), &info ) != 0 || S_ISDIR( info.st_mode ) ) )
+        {
+            continue;
+        }
+        if ( S_ISDIR( info.st_mode ) )
+        {
+            scanDirectory( root, path, files );
+        }
+        else if ( S_ISREG( info.st_mode ) && isMusicFile( item->d_name ) )
+        {
+            files.push_back( path );
+        }
+    }
+    closedir( dir );
+}
+
+static bool probeFile(const std::string &fileName, IndexRecord &record)
+{
+    FILE *file = fopen( fileName.c_str(), "rb" );
+    if ( file == nullptr )
+    {
+        return false;
+    }
+    std::vector<uint8_t> data( record.entry.fileSize );
+    bool result = data.empty() || fread( data.data(), data.size(), 1, file ) == 1;
+    fclose( file );
+    MusicInfo info;
+    if ( !result || !info.probe( data.data(), data.size() ) )
+    {
+        return false;
+    }
+    record.entry.contentHash = stateHash( data.data(), data.size() );
+    record.entry.chips = info.getChips();
+    record.entry.format = info.getFormat();
+    record.entry.startTrack = info.getStartTrack();
+    record.entry.trackCount = info.getTrackCount();
+    // VGM tracks have duration of the file, NSFe and NSF2 files store time of each track
+    record.tracks.clear();
+    for (int track = 0; track < info.getTrackCount(); track++)
+    {
+        MusicIndexTrack item{};
+        if ( info.getTrackSamples( track, item.totalSamples, item.fadeSamples ) )
+        {
+            item.loopSamples = info.getFormat() == MUSIC_FORMAT_VGM ? info.getLoopSamples() : 0;
+        }
+        record.tracks.push_back( item );
+    }
+    for (int i = 0; i < MUSIC_TAG_COUNT; i++)
+    {
+        char text[1024];
+        MusicInfo::copyTag( info.getTag( i ), text, sizeof(text) );
+        record.tags[i] = text;
+    }
+    return true;
+}
+
+static void reuseRecord(const MusicIndex &index, const MusicIndexEntry &entry, IndexRecord &record)
+{
+    record.entry = entry;
+    record.tracks.clear();
+    for (int i = 0; i < entry.trackCount; i++)
+    {
+        record.tracks.push_back( index.getTrack( entry, i ) );
+    }
+    for (int i = 0; i < MUSIC_TAG_COUNT; i++)
+    {
+        record.tags[i] = index.getString( entry.tags[i] );
+    }
+}
+
+static uint32_t addString(std::string &strings, const std::string &text)
+{
+    uint32_t offset = strings.size();
+    strings.append( text.c_str(), text.size() + 1 );
+    return offset;
+}
+
+static bool writeIndex(const char *indexFile, std::vector<IndexRecord> &records)
+{
+    std::vector<MusicIndexEntry> entries;
+    std::vector<MusicIndexTrack> tracks;
+    // Offset 0 is always empty string
+    std::string strings( 1, '\0' );
+    std::vector<uint32_t> paths;
+    for (IndexRecord &record: records)
+    {
+        if ( !record.valid )
+        {
+            continue;
+        }
+        MusicIndexEntry entry = record.entry;
+        entry.path = addString( strings, record.path );
+        entry.firstTrack = tracks.size();
+        entry.trackCount = record.tracks.size();
+        tracks.insert( tracks.end(), record.tracks.begin(), record.tracks.end() );
+        for (int i = 0; i < MUSIC_TAG_COUNT; i++)
+        {
+            entry.tags[i] = record.tags[i].empty() ? 0 : addString( strings, record.tags[i] );
+        }
+        entries.push_back( entry );
+    }
+    MusicIndexHeader header{};
+    header.ident = MUSIC_INDEX_IDENT;
+    header.version = MUSIC_INDEX_VERSION;
+    header.entrySize = sizeof(MusicIndexEntry);
+    header.entryCount = entries.size();
+    header.entriesOffset = sizeof(MusicIndexHeader);
+    header.trackCount = tracks.size();
+    header.tracksOffset = header.entriesOffset + entries.size() * sizeof(MusicIndexEntry);
+    header.stringsOffset = header.tracksOffset + tracks.size() * sizeof(MusicIndexTrack);
+    header.fileSize = header.stringsOffset + strings.size();
+    // Strings are addressed from the start of the file
+    for (MusicIndexEntry &entry: entries)
+    {
+        entry.path += header.stringsOffset;
+        for (int i = 0; i < MUSIC_TAG_COUNT; i++) entry.tags[i] += header.stringsOffset;
+    }
+    // Write to temporary file first, so the index, mapped by other processes, stays valid
+    std::string tempFile = std::string( indexFile ) + ".tmp";
+    FILE *file = fopen( tempFile.c_str(), "wb" );
+    if ( file == nullptr )
+    {
+        fprintf( stderr, "Failed to open file %s\n", tempFile.c_str() );
+        return false;
+    }
+    bool result = fwrite( &header, sizeof(header), 1, file ) == 1;
+    if ( result && entries.size() ) result = fwrite( entries.data(), entries.size() * sizeof(MusicIndexEntry), 1, file ) == 1;
+    if ( result && tracks.size() ) result = fwrite( tracks.data(), tracks.size() * sizeof(MusicIndexTrack), 1, file ) == 1;
+    if ( result ) result = fwrite( strings.data(), strings.size(), 1, file ) == 1;
+    result = fclose( file ) == 0 && result;
+    if ( !result || rename( tempFile.c_str(), indexFile ) != 0 )
+    {
+        fprintf( stderr, "Failed to write index file %s\n", indexFile );
+        remove( tempFile.c_str() );
+        return false;
+    }
+    return true;
+}
+
+bool MusicIndex::build(const char *directory, const char *indexFile, int threads, BuildStats *stats)
+{
+    std::string root = directory;
+    if ( !root.empty() && root.back() != '/' ) root += "/";
+    std::vector<std::string> files;
+    scanDirectory( root, "", files );
+    std::sort( files.begin(), files.end() );
+
+    MusicIndex previous;
+    previous.open( indexFile );
+    std::vector<IndexRecord> records( files.size() );
+    std::atomic<uint32_t> next( 0 );
+    std::atomic<uint32_t> reused( 0 );
+    std::atomic<uint32_t> failed( 0 );
+    auto worker = [&]()
+    {
+        for (uint32_t i = next++; i < files.size(); i = next++)
+        {
+            IndexRecord &record = records[i];
+            record.path = files[i];
+            record.valid = false;
+            struct stat info;
+            if ( stat( (root + files[i]).c_str(), &info ) != 0 )
+            {
+                failed++;
+                continue;
+            }
+            const MusicIndexEntry *entry = previous.find( files[i].c_str() );
+            if ( entry && entry->fileSize == static_cast<uint64_t>(info.st_size) && entry->mtime == info.st_mtime )
+            {
+                reuseRecord( previous, *entry, record );
+                record.valid = true;
+                reused++;
+                continue;
+            }
+            record.entry = MusicIndexEntry{};
+            record.entry.fileSize = info.st_size;
+            record.entry.mtime = info.st_mtime;
+            record.valid = probeFile( root + files[i], record );
+            if ( !record.valid ) failed++;
+        }
+    };
+    if ( threads <= 0 ) threads = std::thread::hardware_concurrency();
+    if ( threads <= 0 ) threads = 1;
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; i++)
+    {
+        pool.emplace_back( worker );
+    }
+    worker();
+    for (std::thread &thread: pool)
+    {
+        thread.join();
+    }
+    previous.close();
+    if ( stats )
+    {
+        stats->files = files.size() - failed;
+        stats->reused = reused;
+        stats->scanned = files.size() - reused - failed;
+        stats->failed = failed;
+    }
+    return writeIndex( indexFile, records );
+}
+
+MusicIndex::~MusicIndex()
+{
+    close();
+}
+
+bool MusicIndex::open(const char *indexFile)
+{
+    close();
+    int fd = ::open( indexFile, O_RDONLY );
+    if ( fd < 0 )
+    {
+        return false;
+    }
+    struct stat info;
+    void *data = MAP_FAILED;
+    if ( fstat( fd, &info ) == 0 && info.st_size >= static_cast<off_t>(sizeof(MusicIndexHeader)) )
+    {
+        data = mmap( nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    }
+    ::close( fd );
+    if ( data == MAP_FAILED )
+    {
+        return false;
+    }
+    m_data = static_cast<const uint8_t *>(data);
+    m_size = info.st_size;
+    const MusicIndexHeader *header = reinterpret_cast<const MusicIndexHeader *>(m_data);
+    if ( header->ident != MUSIC_INDEX_IDENT || header->version != MUSIC_INDEX_VERSION ||
+         header->entrySize != sizeof(MusicIndexEntry) || header->fileSize != m_size ||
+         header->entriesOffset + static_cast<uint64_t>(header->entryCount) * sizeof(MusicIndexEntry) > header->tracksOffset ||
+         header->tracksOffset + static_cast<uint64_t>(header->trackCount) * sizeof(MusicIndexTrack) > header->stringsOffset ||
+         header->stringsOffset >= m_size || m_data[m_size - 1] != '\0' )
+    {
+        fprintf( stderr, "Invalid index file %s\n", indexFile );
+        close();
+        return false;
+    }
+    m_header = header;
+    m_entries = reinterpret_cast<const MusicIndexEntry *>(m_data + header->entriesOffset);
+    m_tracks = reinterpret_cast<const MusicIndexTrack *>(m_data + header->tracksOffset);
+    for (uint32_t i = 0; i < header->entryCount; i++)
+    {
+        bool valid = m_entries[i].path >= header->stringsOffset && m_entries[i].path < m_size &&
+                     static_cast<uint64_t>(m_entries[i].firstTrack) + m_entries[i].trackCount <= header->trackCount;
+        for (int j = 0; j < MUSIC_TAG_COUNT; j++)
+        {
+            valid = valid && m_entries[i].tags[j] >= header->stringsOffset && m_entries[i].tags[j] < m_size;
+        }
+        if ( !valid )
+        {
+            fprintf( stderr, "Invalid index file %s\n", indexFile );
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void MusicIndex::close()
+{
+    if ( m_data )
+    {
+        munmap( const_cast<uint8_t *>(m_data), m_size );
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_header = nullptr;
+    m_entries = nullptr;
+    m_tracks = nullptr;
+}
+
+const MusicIndexEntry *MusicIndex::find(const char *path) const
+{
+    uint32_t low = 0;
+    uint32_t high = getCount();
+    while ( low < high )
+    {
+        uint32_t middle = (low + high) / 2;
+        int result = strcmp( getString( m_entries[middle].path ), path );
+        if ( result == 0 )
+        {
+            return &m_entries[middle];
+        }
+        if ( result < 0 ) low = middle + 1; else high = middle;
+    }
+    return nullptr;
+}
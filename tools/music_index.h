@@ -0,0 +1,133 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "music_info.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MUSIC_INDEX_IDENT   0x494D4756 // "VGMI"
+#define MUSIC_INDEX_VERSION 2
+
+/**
+ * Index file layout (little endian), all offsets are from the start of the file:
+ *   MusicIndexHeader
+ *   MusicIndexEntry[entryCount], sorted by path
+ *   MusicIndexTrack[trackCount]
+ *   null terminated UTF-8 strings
+ */
+typedef struct
+{
+    uint32_t ident;          // "VGMI"
+    uint16_t version;
+    uint16_t entrySize;      // sizeof(MusicIndexEntry)
+    uint32_t entryCount;
+    uint32_t entriesOffset;
+    uint32_t trackCount;
+    uint32_t tracksOffset;
+    uint32_t stringsOffset;
+    uint32_t fileSize;
+} MusicIndexHeader;
+
+typedef struct
+{
+    uint64_t fileSize;
+    int64_t  mtime;          // modification time in seconds
+    uint64_t contentHash;    // 64-bit FNV-1a of the file content
+    uint32_t path;           // string offset, path relative to indexed directory
+    uint32_t chips;          // MUSIC_CHIP_* mask
+    uint32_t firstTrack;     // index of the first MusicIndexTrack
+    uint16_t trackCount;
+    uint8_t  format;         // MUSIC_FORMAT_*
+    uint8_t  startTrack;
+    uint32_t tags[MUSIC_TAG_COUNT]; // string offsets, empty string if tag is absent
+} MusicIndexEntry;
+
+typedef struct
+{
+    uint32_t totalSamples;   // including fade, 0 if duration is unknown (NSF without time chunk)
+    uint32_t loopSamples;
+    uint32_t fadeSamples;    // fade length, stored in NSFe and NSF2 files
+} MusicIndexTrack;
+
+/**
+ * Binary index of the music library. build() scans directory tree for VGM and NSF
+ * files in parallel, probes metadata of each file with MusicInfo and writes the index.
+ * Files with the same size and modification time, as in the previous index, are not read
+ * again. open() maps index file to memory, so the queries do not need any parsing.
+ */
+class MusicIndex
+{
+public:
+    MusicIndex() = default;
+    ~MusicIndex();
+
+    /** Statistics of the last build() call */
+    typedef struct
+    {
+        uint32_t files;      // number of indexed files
+        uint32_t reused;     // entries taken from previous index
+        uint32_t scanned;    // files probed
+        uint32_t failed;     // files, which cannot be read or have unknown format
+    } BuildStats;
+
+    /**
+     * Scans directory and writes index file. If index file exists, unchanged entries are reused.
+     * @param directory root of music library
+     * @param indexFile index file name
+     * @param threads number of worker threads, 0 to use all cpu cores
+     * @param stats optional pointer to statistics
+     */
+    static bool build(const char *directory, const char *indexFile, int threads = 0, BuildStats *stats = nullptr);
+
+    /** Maps index file to memory */
+    bool open(const char *indexFile);
+
+    /** Unmaps index file */
+    void close();
+
+    /** Returns number of entries */
+    uint32_t getCount() const { return m_header ? m_header->entryCount : 0; }
+
+    /** Returns entry by index */
+    const MusicIndexEntry &getEntry(uint32_t index) const { return m_entries[index]; }
+
+    /** Finds entry by path relative to indexed directory, returns nullptr if not found */
+    const MusicIndexEntry *find(const char *path) const;
+
+    /** Returns string, stored in the index */
+    const char *getString(uint32_t offset) const { return reinterpret_cast<const char *>(m_data) + offset; }
+
+    /** Returns track info of the entry */
+    const MusicIndexTrack &getTrack(const MusicIndexEntry &entry, int track) const { return m_tracks[entry.firstTrack + track]; }
+
+private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+    const MusicIndexHeader *m_header = nullptr;
+    const MusicIndexEntry *m_entries = nullptr;
+    const MusicIndexTrack *m_tracks = nullptr;
+};
@@ -0,0 +1,512 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "render_cache.h"
+#include "vgm_file.h"
+#include "chips/state_hash.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+RenderCache::~RenderCache()
+{
+    close();
+}
+
+bool RenderCache::open(const char *directory, uint64_t maxBytes)
+{
+    close();
+    if ( mkdir( directory, 0755 ) != 0 && errno != EEXIST )
+    {
+        fprintf( stderr, "Failed to create cache directory %s\n", directory );
+        return false;
+    }
+    m_directory = directory;
+    m_maxBytes = maxBytes;
+    evict();
+    return true;
+}
+
+void RenderCache::close()
+{
+    stop();
+    m_directory.clear();
+}
+
+uint64_t RenderCache::hashFile(const uint8_t *data, int size)
+{
+    return stateHash( data, size );
+}
+
+std::string RenderCache::getEntryPath(const RenderCacheKey &key) const
+{
+    uint64_t hash = stateHash( &key.fileHash, sizeof(key.fileHash) );
+    hash = stateHash( &key.track, sizeof(key.track), hash );
+    hash = stateHash( &key.sampleRate, sizeof(key.sampleRate), hash );
+    hash = stateHash( &key.duration, sizeof(key.duration), hash );
+    hash = stateHash( &key.volume, sizeof(key.volume), hash );
+    hash = stateHash( &key.format, sizeof(key.format), hash );
+    hash = stateHash( &key.flags, sizeof(key.flags), hash );
+    char name[24];
+    snprintf( name, sizeof(name), "/%016llx", static_cast<unsigned long long>(hash) );
+    return m_directory + name;
+}
+
+std::string RenderCache::getChunkPath(uint32_t chunk) const
+{
+    char name[24];
+    snprintf( name, sizeof(name), "/%08x.pcm", chunk );
+    return m_entry + name;
+}
+
+static bool isSameKey(const RenderCacheKey &a, const RenderCacheKey &b)
+{
+    return a.fileHash == b.fileHash && a.track == b.track && a.sampleRate == b.sampleRate &&
+           a.duration == b.duration && a.volume == b.volume && a.format == b.format && a.flags == b.flags;
+}
+
+bool RenderCache::readIndex(const std::string &entry, RenderCacheIndex &index) const
+{
+    FILE *file = fopen( (entry + "/index").c_str(), "rb" );
+    if ( file == nullptr )
+    {
+        return false;
+    }
+    bool result = fread( &index, sizeof(index), 1, file ) == 1;
+    fclose( file );
+    return result && index.ident == RENDER_CACHE_IDENT && index.version == RENDER_CACHE_VERSION &&
+           index.chunkBytes == RENDER_CACHE_CHUNK_BYTES;
+}
+
+bool RenderCache::writeIndex()
+{
+    // Index is replaced atomically, so it never describes more data than written to chunks
+    if ( m_writer ) fflush( m_writer );
+    std::string tempFile = m_entry + "/index.tmp";
+    FILE *file = fopen( tempFile.c_str(), "wb" );
+    if ( file == nullptr )
+    {
+        return false;
+    }
+    bool result = fwrite( &m_index, sizeof(m_index), 1, file ) == 1;
+    result = fclose( file ) == 0 && result;
+    if ( !result || rename( tempFile.c_str(), (m_entry + "/index").c_str() ) != 0 )
+    {
+        fprintf( stderr, "Failed to write cache index %s\n", tempFile.c_str() );
+        return false;
+    }
+    m_dirty = false;
+    return true;
+}
+
+bool RenderCache::contains(const RenderCacheKey &key)
+{
+    RenderCacheIndex index;
+    return !m_directory.empty() && readIndex( getEntryPath( key ), index ) &&
+           index.complete && isSameKey( index.key, key );
+}
+
+bool RenderCache::start(const RenderCacheKey &key, VgmFile *vgm)
+{
+    stop();
+    if ( m_directory.empty() )
+    {
+        return false;
+    }
+    m_entry = getEntryPath( key );
+    if ( readIndex( m_entry, m_index ) && isSameKey( m_index.key, key ) )
+    {
+        // Index modification time is used as access time for eviction
+        utimensat( AT_FDCWD, (m_entry + "/index").c_str(), nullptr, 0 );
+    }
+    else
+    {
+        if ( mkdir( m_entry.c_str(), 0755 ) != 0 && errno != EEXIST )
+        {
+            fprintf( stderr, "Failed to create cache entry %s\n", m_entry.c_str() );
+            return false;
+        }
+        m_index = RenderCacheIndex{};
+        m_index.ident = RENDER_CACHE_IDENT;
+        m_index.version = RENDER_CACHE_VERSION;
+        m_index.key = key;
+        m_index.chunkBytes = RENDER_CACHE_CHUNK_BYTES;
+        if ( !writeIndex() )
+        {
+            return false;
+        }
+    }
+    if ( !m_index.complete && vgm == nullptr )
+    {
+        return false;
+    }
+    m_vgm = vgm;
+    m_decoded = 0;
+    m_position = 0;
+    m_writeFailed = false;
+    m_active = true;
+    return true;
+}
+
+void RenderCache::stop()
+{
+    if ( !m_active )
+    {
+        return;
+    }
+    if ( m_dirty ) writeIndex();
+    if ( m_writer )
+    {
+        fclose( m_writer );
+        m_writer = nullptr;
+    }
+    unmap();
+    m_active = false;
+    m_vgm = nullptr;
+    evict();
+    m_entry.clear();
+}
+
+void RenderCache::unmap()
+{
+    if ( m_map )
+    {
+        munmap( const_cast<uint8_t *>(m_map), m_mapSize );
+        m_map = nullptr;
+    }
+}
+
+bool RenderCache::map(uint32_t chunk, uint32_t size)
+{
+    unmap();
+    if ( m_writer && m_writerChunk == chunk ) fflush( m_writer );
+    int fd = ::open( getChunkPath( chunk ).c_str(), O_RDONLY );
+    if ( fd < 0 )
+    {
+        return false;
+    }
+    void *data = mmap( nullptr, size, PROT_READ, MAP_SHARED, fd, 0 );
+    ::close( fd );
+    if ( data == MAP_FAILED )
+    {
+        return false;
+    }
+    m_map = static_cast<const uint8_t *>(data);
+    m_mapChunk = chunk;
+    m_mapSize = size;
+    return true;
+}
+
+int RenderCache::readCached(uint8_t *buffer, int size)
+{
+    uint32_t chunk = m_position / m_index.chunkBytes;
+    uint32_t offset = m_position % m_index.chunkBytes;
+    uint64_t chunkStart = static_cast<uint64_t>(chunk) * m_index.chunkBytes;
+    uint32_t valid = std::min<uint64_t>( m_index.chunkBytes, m_index.renderedBytes - chunkStart );
+    if ( !m_map || m_mapChunk != chunk || m_mapSize < valid )
+    {
+        if ( !map( chunk, valid ) )
+        {
+            fprintf( stderr, "Failed to map cache chunk %s\n", getChunkPath( chunk ).c_str() );
+            return -1;
+        }
+    }
+    int count = std::min<uint32_t>( size, valid - offset );
+    memcpy( buffer, m_map + offset, count );
+    m_position += count;
+    return count;
+}
+
+bool RenderCache::append(const uint8_t *data, int size)
+{
+    while ( size > 0 )
+    {
+        uint32_t chunk = m_index.renderedBytes / m_index.chunkBytes;
+        uint32_t offset = m_index.renderedBytes % m_index.chunkBytes;
+        if ( !m_writer || m_writerChunk != chunk )
+        {
+            if ( m_writer ) fclose( m_writer );
+            // Chunk file can contain garbage after rendered data, if the index was not updated
+            m_writer = offset ? fopen( getChunkPath( chunk ).c_str(), "r+b" ) : fopen( getChunkPath( chunk ).c_str(), "wb" );
+            m_writerChunk = chunk;
+            if ( m_writer == nullptr || fseek( m_writer, offset, SEEK_SET ) != 0 )
+            {
+                return false;
+            }
+        }
+        int count = std::min<uint32_t>( size, m_index.chunkBytes - offset );
+        if ( fwrite( data, count, 1, m_writer ) != 1 )
+        {
+            return false;
+        }
+        m_index.renderedBytes += count;
+        m_dirty = true;
+        data += count;
+        size -= count;
+        if ( offset + count == m_index.chunkBytes )
+        {
+            fclose( m_writer );
+            m_writer = nullptr;
+            writeIndex();
+        }
+    }
+    return true;
+}
+
+int RenderCache::decode(uint8_t *buffer, int size)
+{
+    if ( m_vgm == nullptr )
+    {
+        return 0;
+    }
+    // Decoder is always started from the beginning of the track, skip the data, which is cached
+    while ( m_decoded < m_position )
+    {
+        uint8_t skip[4096];
+        int count = m_vgm->decodePcm( skip, std::min<uint64_t>( sizeof(skip), m_position - m_decoded ) );
+        if ( count <= 0 )
+        {
+            return 0;
+        }
+        m_decoded += count;
+    }
+    if ( m_decoded != m_position )
+    {
+        return -1;
+    }
+    int count = m_vgm->decodePcm( buffer, size );
+    if ( count < 0 )
+    {
+        return -1;
+    }
+    if ( m_decoded == m_index.renderedBytes && !m_writeFailed && !append( buffer, count ) )
+    {
+        fprintf( stderr, "Failed to write cache chunk, caching is stopped\n" );
+        m_writeFailed = true;
+    }
+    m_decoded += count;
+    m_position += count;
+    if ( count < size && m_index.renderedBytes == m_decoded )
+    {
+        m_index.complete = 1;
+        writeIndex();
+    }
+    return count;
+}
+
+int RenderCache::read(uint8_t *buffer, int size)
+{
+    if ( !m_active )
+    {
+        return -1;
+    }
+    // Only whole stereo samples are read
+    size &= ~3;
+    int total = 0;
+    while ( total < size )
+    {
+        int count;
+        if ( m_position < m_index.renderedBytes )
+        {
+            count = readCached( buffer + total, size - total );
+        }
+        else if ( m_index.complete )
+        {
+            break;
+        }
+        else
+        {
+            count = decode( buffer + total, size - total );
+            if ( count >= 0 && count < size - total )
+            {
+                total += count;
+                break;
+            }
+        }
+        if ( count <= 0 )
+        {
+            return total ? total : count;
+        }
+        total += count;
+    }
+    return total;
+}
+
+bool RenderCache::seek(uint64_t sample)
+{
+    if ( !m_active )
+    {
+        return false;
+    }
+    uint64_t position = sample * 4;
+    if ( position <= m_index.renderedBytes )
+    {
+        m_position = position;
+        return true;
+    }
+    // Positions after cached data are reached by decoding, decoded data is cached.
+    // Decoder can be ahead of cached data only if writing to the cache failed.
+    uint64_t start = std::max( m_index.renderedBytes, m_decoded );
+    if ( m_index.complete || position < start )
+    {
+        return false;
+    }
+    m_position = start;
+    while ( m_position < position )
+    {
+        uint8_t buffer[4096];
+        int size = std::min<uint64_t>( sizeof(buffer), position - m_position );
+        if ( read( buffer, size ) != size )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct
+{
+    std::string path;
+    int64_t mtime;           // nanoseconds
+    uint64_t size;
+} CacheEntry;
+
+static bool isHexName(const char *name, size_t digits)
+{
+    for (size_t i = 0; i < digits; i++)
+    {
+        if ( !isxdigit( static_cast<unsigned char>(name[i]) ) ) return false;
+    }
+    return true;
+}
+
+/** Entry names are key hashes, see getEntryPath() */
+static bool isEntryName(const char *name)
+{
+    return strlen( name ) == 16 && isHexName( name, 16 );
+}
+
+/** Files, which cache creates in the entry: index, index.tmp and chunks */
+static bool isEntryFile(const char *name)
+{
+    return !strcmp( name, "index" ) || !strcmp( name, "index.tmp" ) ||
+           ( strlen( name ) == 12 && isHexName( name, 8 ) && !strcmp( name + 8, ".pcm" ) );
+}
+
+static bool hasCacheIdent(const std::string &entry)
+{
+    uint32_t ident = 0;
+    FILE *file = fopen( (entry + "/index").c_str(), "rb" );
+    if ( file == nullptr )
+    {
+        return false;
+    }
+    bool result = fread( &ident, sizeof(ident), 1, file ) == 1;
+    fclose( file );
+    return result && ident == RENDER_CACHE_IDENT;
+}
+
+static void removeEntry(const std::string &path)
+{
+    DIR *dir = opendir( path.c_str() );
+    if ( dir )
+    {
+        struct dirent *item;
+        while ( (item = readdir( dir )) != nullptr )
+        {
+            if ( isEntryFile( item->d_name ) ) unlink( (path + "/" + item->d_name).c_str() );
+        }
+        closedir( dir );
+    }
+    // Directory stays, if it has other files
+    rmdir( path.c_str() );
+}
+
+void RenderCache::evict()
+{
+    DIR *dir = m_directory.empty() ? nullptr : opendir( m_directory.c_str() );
+    if ( dir == nullptr )
+    {
+        return;
+    }
+    std::vector<CacheEntry> entries;
+    uint64_t total = 0;
+    time_t now = time( nullptr );
+    struct dirent *item;
+    while ( (item = readdir( dir )) != nullptr )
+    {
+        CacheEntry entry{ m_directory + "/" + item->d_name, 0, 0 };
+        struct stat info;
+        // Symbolic links are not followed, other files are not cache entries
+        if ( !isEntryName( item->d_name ) || lstat( entry.path.c_str(), &info ) != 0 || !S_ISDIR( info.st_mode ) )
+        {
+            continue;
+        }
+        if ( m_active && entry.path == m_entry )
+        {
+            // Current track is never removed, but it takes space
+            total += m_index.renderedBytes;
+            continue;
+        }
+        RenderCacheIndex index;
+        if ( !readIndex( entry.path, index ) )
+        {
+            // Entry of other cache version, or entry abandoned before its index was written
+            if ( hasCacheIdent( entry.path ) || now - info.st_mtime > RENDER_CACHE_PARTIAL_SECONDS )
+            {
+                removeEntry( entry.path );
+            }
+            continue;
+        }
+        if ( lstat( (entry.path + "/index").c_str(), &info ) != 0 )
+        {
+            continue;
+        }
+        entry.mtime = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        entry.size = index.renderedBytes;
+        total += entry.size;
+        entries.push_back( entry );
+    }
+    closedir( dir );
+    std::sort( entries.begin(), entries.end(), [](const CacheEntry &a, const CacheEntry &b)
+    {
+        return a.mtime < b.mtime;
+    } );
+    for (size_t i = 0; i < entries.size() && total > m_maxBytes; i++)
+    {
+        removeEntry( entries[i].path );
+        total -= entries[i].size;
+    }
+}
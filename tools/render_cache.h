@@ -0,0 +1,178 @@
+/*
+MIT License
+
+Copyright (c) 2021 Aleksei Dynda
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+class VgmFile;
+
+#define RENDER_CACHE_IDENT   0x434D4756 // "VGMC"
+#define RENDER_CACHE_VERSION 1
+
+/** Size of one chunk file with rendered pcm data */
+#ifndef RENDER_CACHE_CHUNK_BYTES
+#define RENDER_CACHE_CHUNK_BYTES (1024 * 1024)
+#endif
+
+/**
+ * Entries without index are removed by evict() only after this time, since other
+ * process can be creating them.
+ */
+#ifndef RENDER_CACHE_PARTIAL_SECONDS
+#define RENDER_CACHE_PARTIAL_SECONDS 3600
+#endif
+
+/** Output formats, stored in the key */
+#define RENDER_CACHE_FORMAT_U16_STEREO 0 // VgmFile::decodePcm() output
+
+/** Render settings, which identify cached pcm data */
+typedef struct
+{
+    uint64_t fileHash;       // 64-bit FNV-1a of the source file content
+    uint32_t track;
+    uint32_t sampleRate;
+    uint32_t duration;       // decoding limit in samples (VgmFile::getTotalSamples()), 0 if there is no limit
+    uint16_t volume;
+    uint8_t  format;         // RENDER_CACHE_FORMAT_*
+    uint8_t  flags;          // bit 0 - fading, bits 1-2 - VgmFile quality (CHIP_QUALITY_*), bits 3-7 reserved
+} RenderCacheKey;
+
+/**
+ * Layout of cache directory:
+ *   <key hash>/index         RenderCacheIndex
+ *   <key hash>/00000000.pcm  RENDER_CACHE_CHUNK_BYTES of pcm data
+ *   <key hash>/00000001.pcm  ...
+ * Modification time of the index is the last access time, used for LRU eviction.
+ * Key hash is 16 hex digits, other files and directories are never touched by the cache.
+ */
+typedef struct
+{
+    uint32_t ident;          // "VGMC"
+    uint16_t version;
+    uint16_t complete;       // 1 if the whole track is rendered
+    RenderCacheKey key;
+    uint32_t chunkBytes;
+    uint32_t reserved;
+    uint64_t renderedBytes;  // valid pcm bytes from the start of the track
+} RenderCacheIndex;
+
+/**
+ * On-disk cache of rendered pcm data, addressed by the content hash of the music file
+ * and render settings. Cached chunks are mapped to memory, so a cache hit costs memcpy
+ * only. On a miss the track is decoded by VgmFile and stored to the cache while the
+ * data is read, so partially played tracks are cached too. Total size of the cache is
+ * limited, least recently used tracks are removed first. The cache directory must not
+ * be shared between processes, which render the same track at the same time.
+ * Only cache entries are removed from the directory, so it can hold other data.
+ */
+class RenderCache
+{
+public:
+    RenderCache() = default;
+    ~RenderCache();
+
+    /**
+     * Opens cache directory (it is created if needed).
+     * @param directory cache directory
+     * @param maxBytes maximum size of cached data
+     */
+    bool open(const char *directory, uint64_t maxBytes);
+
+    /** Stops current track and closes the cache */
+    void close();
+
+    /** Returns 64-bit content hash of music file for RenderCacheKey::fileHash */
+    static uint64_t hashFile(const uint8_t *data, int size);
+
+    /** Returns true if the whole track is cached */
+    bool contains(const RenderCacheKey &key);
+
+    /**
+     * Starts reading the track. If the track is not fully cached, vgm must be opened and
+     * configured (setTrack(), setSampleFrequency(), etc.) according to the key. Decoder is
+     * used only when the data is not in the cache, and it must not be used by the caller
+     * until stop() is called. vgm can be nullptr if contains() returned true.
+     */
+    bool start(const RenderCacheKey &key, VgmFile *vgm);
+
+    /**
+     * Reads pcm data from current position, returns number of bytes read.
+     * Less than size bytes are returned only at the end of the track.
+     */
+    int read(uint8_t *buffer, int size);
+
+    /**
+     * Moves read position to specified sample. Cached data is accessed directly,
+     * positions after rendered data are reached by decoding the track.
+     */
+    bool seek(uint64_t sample);
+
+    /** Returns current position in samples */
+    uint64_t getPosition() const { return m_position / 4; }
+
+    /** Stores index of current track and releases it */
+    void stop();
+
+    /**
+     * Removes least recently used tracks until the cache fits maxBytes. Entries of other
+     * cache versions are removed, entries without index only after RENDER_CACHE_PARTIAL_SECONDS.
+     */
+    void evict();
+
+private:
+    std::string m_directory;
+    uint64_t m_maxBytes = 0;
+
+    // Current track
+    std::string m_entry;
+    RenderCacheIndex m_index{};
+    bool m_active = false;
+    bool m_dirty = false;
+    bool m_writeFailed = false;
+    uint64_t m_position = 0;
+
+    // Decoder state: decoded bytes are appended to m_writer chunk
+    VgmFile *m_vgm = nullptr;
+    uint64_t m_decoded = 0;
+    FILE *m_writer = nullptr;
+    uint32_t m_writerChunk = 0;
+
+    // Mapped chunk
+    const uint8_t *m_map = nullptr;
+    uint32_t m_mapChunk = 0;
+    uint32_t m_mapSize = 0;
+
+    std::string getEntryPath(const RenderCacheKey &key) const;
+    std::string getChunkPath(uint32_t chunk) const;
+    bool readIndex(const std::string &entry, RenderCacheIndex &index) const;
+    bool writeIndex();
+    void unmap();
+    bool map(uint32_t chunk, uint32_t size);
+    int readCached(uint8_t *buffer, int size);
+    int decode(uint8_t *buffer, int size);
+    bool append(const uint8_t *data, int size);
+};